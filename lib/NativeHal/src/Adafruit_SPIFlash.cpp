@@ -0,0 +1,102 @@
+#include "Adafruit_SPIFlash.h"
+
+#include <string.h>
+
+#include "NativeHal.h"
+
+#define SIM_FLASH_SIZE (2ul * 1024 * 1024)
+
+bool Adafruit_SPIFlash::begin() {
+    const char *path = hal_env("SIM_FLASH_IMAGE", "");
+    if (!*path) return false;
+
+    // a new chip comes erased
+    _image = fopen(path, "r+b");
+    if (!_image) _image = fopen(path, "w+b");
+    if (!_image) return false;
+
+    fseek(_image, 0, SEEK_END);
+    long length = ftell(_image);
+    if (length < (long)SIM_FLASH_SIZE) {
+        uint8_t erased[SFLASH_SECTOR_SIZE];
+        memset(erased, 0xFF, sizeof(erased));
+        for (long at = length; at < (long)SIM_FLASH_SIZE; at += sizeof(erased)) {
+            fwrite(erased, 1, min((long)sizeof(erased), (long)SIM_FLASH_SIZE - at), _image);
+        }
+        fflush(_image);
+    }
+
+    _size = SIM_FLASH_SIZE;
+    return true;
+}
+
+void Adafruit_SPIFlash::_charge_read(uint32_t len) {
+    // command, address and a dummy byte, then the data
+    _read_ns += (len + 5) * hal_env_u32("SIM_FLASH_BYTE_NS", 350);
+    hal_advance_us(_read_ns / 1000);
+    _read_ns %= 1000;
+}
+
+uint32_t Adafruit_SPIFlash::readBuffer(uint32_t address, uint8_t *buffer, uint32_t len) {
+    if (!_image || address >= _size) return 0;
+    len = min(len, _size - address);
+
+    waitUntilReady();
+    _charge_read(len);
+
+    fseek(_image, address, SEEK_SET);
+    return fread(buffer, 1, len, _image);
+}
+
+uint32_t Adafruit_SPIFlash::writeBuffer(uint32_t address, uint8_t const *buffer, uint32_t len) {
+    if (!_image || address >= _size) return 0;
+    len = min(len, _size - address);
+
+    uint32_t written = 0;
+    while (written < len) {
+        // a page program wraps within its page, so stop each one at the page end
+        uint32_t count = min(len - written, SFLASH_PAGE_SIZE - (address + written) % SFLASH_PAGE_SIZE);
+
+        waitUntilReady();
+        _charge_read(count);
+
+        uint8_t page[SFLASH_PAGE_SIZE];
+        fseek(_image, address + written, SEEK_SET);
+        fread(page, 1, count, _image);
+        // NOR cells only go from 1 to 0
+        for (uint32_t i = 0; i < count; i++) page[i] &= buffer[written + i];
+        fseek(_image, address + written, SEEK_SET);
+        fwrite(page, 1, count, _image);
+
+        _busy_until_us = hal_now_us() + hal_env_u32("SIM_FLASH_PROGRAM_US", 700);
+        written += count;
+    }
+    fflush(_image);
+    return written;
+}
+
+bool Adafruit_SPIFlash::eraseSector(uint32_t sectorNumber) {
+    if (!_image || sectorNumber >= _size / SFLASH_SECTOR_SIZE) return false;
+
+    waitUntilReady();
+
+    uint8_t erased[SFLASH_SECTOR_SIZE];
+    memset(erased, 0xFF, sizeof(erased));
+    fseek(_image, sectorNumber * SFLASH_SECTOR_SIZE, SEEK_SET);
+    fwrite(erased, 1, sizeof(erased), _image);
+    fflush(_image);
+
+    _busy_until_us = hal_now_us() + hal_env_u32("SIM_FLASH_ERASE_US", 50000);
+    return true;
+}
+
+uint8_t Adafruit_SPIFlash::readStatus() {
+    _charge_read(0);
+    return hal_now_us() < _busy_until_us ? 0x01 : 0x00;
+}
+
+void Adafruit_SPIFlash::waitUntilReady() {
+    while (readStatus() & 0x01) {
+        hal_advance_us(min(_busy_until_us - hal_now_us(), (uint64_t)100));
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef NATIVE_ADAFRUIT_SPIFLASH_H_
+#define NATIVE_ADAFRUIT_SPIFLASH_H_
+
+#include <stdio.h>
+#include <Arduino.h>
+#include <SPI.h>
+
+/**
+ * Emulated Adafruit_SPIFlash, a 2MB NOR chip backed by the file SIM_FLASH_IMAGE. With no image
+ * there's no chip and begin() fails, as on a board without flash.
+ *
+ * Programming can only clear bits, erasing sets a whole sector back to 0xFF. Both run in the
+ * background like the real chip: the status register's WIP bit stays set for
+ * SIM_FLASH_PROGRAM_US or SIM_FLASH_ERASE_US of virtual time, and the next command waits it
+ * out first. Reads cost SIM_FLASH_BYTE_NS per byte.
+ */
+
+#define SFLASH_SECTOR_SIZE 4096
+#define SFLASH_PAGE_SIZE 256
+
+class Adafruit_FlashTransport_SPI {
+public:
+    Adafruit_FlashTransport_SPI(uint8_t ss, SPIClass &spi) : _ss(ss), _spi(&spi) {}
+
+private:
+    uint8_t _ss;
+    SPIClass *_spi;
+};
+
+class Adafruit_SPIFlash {
+public:
+    Adafruit_SPIFlash(Adafruit_FlashTransport_SPI *transport) : _transport(transport) {}
+
+    bool begin();
+    uint32_t size() { return _size; }
+
+    uint32_t readBuffer(uint32_t address, uint8_t *buffer, uint32_t len);
+    /** Program len bytes, one page at a time, waiting for each page before the next */
+    uint32_t writeBuffer(uint32_t address, uint8_t const *buffer, uint32_t len);
+    /** Start erasing a 4KB sector, this doesn't wait for it to finish */
+    bool eraseSector(uint32_t sectorNumber);
+
+    /** Bit 0 (WIP) is set while a program or erase is running */
+    uint8_t readStatus();
+    void waitUntilReady();
+
+private:
+    void _charge_read(uint32_t len);
+
+    Adafruit_FlashTransport_SPI *_transport;
+    FILE *_image = NULL;
+    uint32_t _size = 0;
+    // virtual time the program or erase in progress ends
+    uint64_t _busy_until_us = 0;
+    // read time not yet charged, under a microsecond
+    uint32_t _read_ns = 0;
+};
+
+#endif // NATIVE_ADAFRUIT_SPIFLASH_H_
@@ -0,0 +1,264 @@
+#include "Adafruit_ZeroDMA.h"
+
+static Adafruit_ZeroDMA *channels[DMAC_CH_NUM];
+// the DMAC write-back memory, the block each channel has in flight
+static DmacDescriptor writeback[DMAC_CH_NUM];
+
+// CRCCTRL.CRCSRC value of channel 0
+#define CRCSRC_CHANNEL_0 0x20
+
+void hal_dma_trigger(uint8_t trigger_id) {
+    for (uint8_t i = 0; i < DMAC_CH_NUM; ++i) {
+        if (channels[i] && channels[i]->isActive()) {
+            channels[i]->_on_trigger(trigger_id);
+        }
+    }
+}
+
+bool hal_dma_pending(uint8_t trigger_id) {
+    for (uint8_t i = 0; i < DMAC_CH_NUM; ++i) {
+        if (channels[i] && channels[i]->isActive() && channels[i]->_waits_for(trigger_id)) return true;
+    }
+    return false;
+}
+
+/** The CRC engine, CRC16 CCITT over byte beats */
+static void crc_beat(const uint8_t *data, uint32_t len) {
+    uint16_t crc = (uint16_t)hal_dmac.CRCCHKSUM.reg;
+    while (len--) {
+        crc ^= (uint16_t)*data++ << 8;
+        for (uint8_t i = 0; i < 8; ++i) crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    hal_dmac.CRCCHKSUM.reg = crc;
+}
+
+Adafruit_ZeroDMA::Adafruit_ZeroDMA() {}
+
+ZeroDMAstatus Adafruit_ZeroDMA::allocate() {
+    if (_channel != 0xFF) return DMA_STATUS_OK;
+
+    for (uint8_t i = 0; i < DMAC_CH_NUM; ++i) {
+        if (!channels[i]) {
+            channels[i] = this;
+            _channel = i;
+            hal_dmac.WRBADDR.reg = (uintptr_t)writeback;
+            return DMA_STATUS_OK;
+        }
+    }
+
+    return DMA_STATUS_ERR_NOT_FOUND;
+}
+
+ZeroDMAstatus Adafruit_ZeroDMA::free() {
+    if (_channel == 0xFF) return DMA_STATUS_ERR_NOT_INITIALIZED;
+    if (_active) return DMA_STATUS_BUSY;
+
+    channels[_channel] = NULL;
+    _channel = 0xFF;
+
+    DmacDescriptor *desc = _first_descriptor;
+    while (desc) {
+        DmacDescriptor *next = (DmacDescriptor *)desc->DESCADDR.reg;
+        delete desc;
+        desc = next == _first_descriptor ? NULL : next;
+    }
+    _first_descriptor = _last_descriptor = NULL;
+
+    return DMA_STATUS_OK;
+}
+
+void Adafruit_ZeroDMA::setTrigger(uint8_t trigger) {
+    _peripheral_trigger = trigger;
+}
+
+void Adafruit_ZeroDMA::setAction(dma_transfer_trigger_action action) {
+    _trigger_action = action;
+}
+
+void Adafruit_ZeroDMA::setCallback(void (*callback)(Adafruit_ZeroDMA *), dma_callback_type type) {
+    if (type == DMA_CALLBACK_TRANSFER_DONE) {
+        _callback = callback;
+    } else if (type == DMA_CALLBACK_TRANSFER_ERROR) {
+        _error_callback = callback;
+    } else if (type == DMA_CALLBACK_CHANNEL_SUSPEND) {
+        _suspend_callback = callback;
+    }
+}
+
+void Adafruit_ZeroDMA::loop(boolean flag) {
+    _loop = flag;
+    if (_last_descriptor) {
+        _last_descriptor->DESCADDR.reg = flag ? (uintptr_t)_first_descriptor : 0;
+    }
+}
+
+DmacDescriptor *Adafruit_ZeroDMA::addDescriptor(void *src, void *dst, uint32_t count, dma_beat_size size,
+                                                bool srcInc, bool dstInc, uint32_t stepSize, bool stepSel) {
+    (void)stepSize;
+    (void)stepSel;
+
+    if (_channel == 0xFF) return NULL;
+
+    DmacDescriptor *desc = new DmacDescriptor();
+    desc->BTCTRL.bit.VALID = true;
+    desc->BTCTRL.bit.BLOCKACT = 0;
+    desc->BTCTRL.bit.BEATSIZE = size;
+    desc->BTCTRL.bit.SRCINC = srcInc;
+    desc->BTCTRL.bit.DSTINC = dstInc;
+    desc->BTCNT.reg = count;
+
+    // like the DMAC, incrementing addresses point at the END of the transfer
+    uint32_t bytes = count << size;
+    desc->SRCADDR.reg = (uintptr_t)src + (srcInc ? bytes : 0);
+    desc->DSTADDR.reg = (uintptr_t)dst + (dstInc ? bytes : 0);
+    desc->DESCADDR.reg = _loop ? (uintptr_t)desc : 0;
+
+    if (!_first_descriptor) {
+        _first_descriptor = desc;
+    } else {
+        _last_descriptor->DESCADDR.reg = (uintptr_t)desc;
+        if (_loop) desc->DESCADDR.reg = (uintptr_t)_first_descriptor;
+    }
+    _last_descriptor = desc;
+
+    return desc;
+}
+
+void Adafruit_ZeroDMA::changeDescriptor(DmacDescriptor *desc, void *src, void *dst, uint32_t count) {
+    if (!desc) return;
+
+    uint32_t size = desc->BTCTRL.bit.BEATSIZE;
+    if (count) desc->BTCNT.reg = count;
+    uint32_t bytes = (uint32_t)desc->BTCNT.reg << size;
+
+    if (src) desc->SRCADDR.reg = (uintptr_t)src + (desc->BTCTRL.bit.SRCINC ? bytes : 0);
+    if (dst) desc->DSTADDR.reg = (uintptr_t)dst + (desc->BTCTRL.bit.DSTINC ? bytes : 0);
+}
+
+ZeroDMAstatus Adafruit_ZeroDMA::startJob() {
+    if (_channel == 0xFF || !_first_descriptor) return DMA_STATUS_ERR_NOT_INITIALIZED;
+    if (_active) return DMA_STATUS_BUSY;
+
+    _active = true;
+    _suspended = false;
+    if (!_load_block(_first_descriptor)) _fetch_error();
+    return DMA_STATUS_OK;
+}
+
+void Adafruit_ZeroDMA::trigger() {
+    _step();
+}
+
+void Adafruit_ZeroDMA::suspend() {
+    _suspended = true;
+}
+
+void Adafruit_ZeroDMA::resume() {
+    _suspended = false;
+}
+
+void Adafruit_ZeroDMA::abort() {
+    _active = false;
+    _suspended = false;
+}
+
+bool Adafruit_ZeroDMA::isActive() {
+    return _active;
+}
+
+bool Adafruit_ZeroDMA::_load_block(DmacDescriptor *desc) {
+    if (!desc->BTCTRL.bit.VALID) return false;
+
+    _current = desc;
+    writeback[_channel] = *desc;
+    _beat_size = 1u << desc->BTCTRL.bit.BEATSIZE;
+    _beats_left = desc->BTCNT.reg;
+    _src_inc = desc->BTCTRL.bit.SRCINC;
+    _dst_inc = desc->BTCTRL.bit.DSTINC;
+
+    uint32_t bytes = _beats_left * _beat_size;
+    _src = (uint8_t *)(desc->SRCADDR.reg - (_src_inc ? bytes : 0));
+    _dst = (uint8_t *)(desc->DSTADDR.reg - (_dst_inc ? bytes : 0));
+    return true;
+}
+
+bool Adafruit_ZeroDMA::_beat() {
+    if (_beats_left > 0) {
+        memcpy(_dst, _src, _beat_size);
+        if (hal_dmac.CTRL.bit.CRCENABLE && hal_dmac.CRCCTRL.reg >> 8 == CRCSRC_CHANNEL_0 + _channel) {
+            crc_beat(_src, _beat_size);
+        }
+        if (_src_inc) _src += _beat_size;
+        if (_dst_inc) _dst += _beat_size;
+        _beats_left--;
+        writeback[_channel].BTCNT.reg = _beats_left;
+    }
+
+    if (_beats_left > 0) return false;
+
+    // block done, fetch the next descriptor before the interrupt is serviced, like the DMAC does
+    DmacDescriptor *done = _current;
+    DmacDescriptor *next = (DmacDescriptor *)done->DESCADDR.reg;
+
+    bool fetched = next && _load_block(next);
+    if (!next) _active = false;
+
+    if (!next || done->BTCTRL.bit.BLOCKACT == (DMAC_BTCTRL_BLOCKACT_INT >> DMAC_BTCTRL_BLOCKACT_Pos)) {
+        hal_irq_raise(_dispatch_callback, this);
+    }
+
+    // TCMPL is serviced before SUSP, so the block's callback runs first
+    if (next && !fetched) _fetch_error();
+
+    return true;
+}
+
+void Adafruit_ZeroDMA::_fetch_error() {
+    _suspended = true;
+    hal_irq_raise(_dispatch_suspend_callback, this);
+}
+
+bool Adafruit_ZeroDMA::_waits_for(uint8_t trigger_id) {
+    return trigger_id == _peripheral_trigger && !_suspended;
+}
+
+void Adafruit_ZeroDMA::_on_trigger(uint8_t trigger_id) {
+    if (trigger_id == _peripheral_trigger) _step();
+}
+
+void Adafruit_ZeroDMA::_step() {
+    if (!_active || _suspended) return;
+
+    switch (_trigger_action) {
+    case DMA_TRIGGER_ACTON_BEAT:
+        _beat();
+        break;
+    case DMA_TRIGGER_ACTON_BLOCK:
+        while (_active && !_suspended && !_beat());
+        break;
+    case DMA_TRIGGER_ACTON_TRANSACTION:
+        while (_active && !_suspended) _beat();
+        break;
+    }
+}
+
+void Adafruit_ZeroDMA::_dispatch_callback(void *arg) {
+    Adafruit_ZeroDMA *dma = (Adafruit_ZeroDMA *)arg;
+    if (dma->_channel != 0xFF && dma->_callback) {
+        dma->_callback(dma);
+    }
+}
+
+void Adafruit_ZeroDMA::_dispatch_error_callback(void *arg) {
+    Adafruit_ZeroDMA *dma = (Adafruit_ZeroDMA *)arg;
+    if (dma->_channel != 0xFF && dma->_error_callback) {
+        dma->_error_callback(dma);
+    }
+}
+
+void Adafruit_ZeroDMA::_dispatch_suspend_callback(void *arg) {
+    Adafruit_ZeroDMA *dma = (Adafruit_ZeroDMA *)arg;
+    if (dma->_channel != 0xFF && dma->_suspend_callback) {
+        dma->_suspend_callback(dma);
+    }
+}
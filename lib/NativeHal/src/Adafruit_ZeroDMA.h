@@ -0,0 +1,116 @@
+#ifndef NATIVE_ADAFRUIT_ZERODMA_H_
+#define NATIVE_ADAFRUIT_ZERODMA_H_
+
+#include <Arduino.h>
+
+/**
+ * Emulated Adafruit_ZeroDMA. Descriptors live in ordinary memory and use the same end-address
+ * convention as the DMAC. Channels step one beat per hardware trigger (see hal_dma_trigger),
+ * fetch the next linked descriptor when a block ends, and raise the callback at blocks with
+ * BLOCKACT_INT and at the end of the chain. Fetching a descriptor without VALID set is a fetch
+ * error, as on the DMAC: the channel suspends and raises the channel suspend callback, after the
+ * transfer done callback of the block before it. It stays enabled, and has to be aborted before
+ * startJob() will run it from its first descriptor again.
+ */
+
+#define DMAC_CH_NUM 12
+
+enum ZeroDMAstatus {
+    DMA_STATUS_OK = 0,
+    DMA_STATUS_ERR_NOT_FOUND,
+    DMA_STATUS_ERR_NOT_INITIALIZED,
+    DMA_STATUS_ERR_INVALID_ARG,
+    DMA_STATUS_ERR_IO,
+    DMA_STATUS_ERR_TIMEOUT,
+    DMA_STATUS_BUSY,
+    DMA_STATUS_SUSPEND,
+    DMA_STATUS_ABORTED,
+    DMA_STATUS_JOBSTATUS = -1
+};
+
+enum dma_beat_size {
+    DMA_BEAT_SIZE_BYTE = 0,
+    DMA_BEAT_SIZE_HWORD,
+    DMA_BEAT_SIZE_WORD,
+};
+
+enum dma_transfer_trigger_action {
+    DMA_TRIGGER_ACTON_BLOCK = 0,
+    DMA_TRIGGER_ACTON_BEAT = 2,
+    DMA_TRIGGER_ACTON_TRANSACTION = 3,
+};
+
+enum dma_callback_type {
+    DMA_CALLBACK_TRANSFER_ERROR,
+    DMA_CALLBACK_TRANSFER_DONE,
+    DMA_CALLBACK_CHANNEL_SUSPEND,
+    DMA_CALLBACK_N,
+};
+
+#define DMA_ADDRESS_INCREMENT_STEP_SIZE_1 0
+#define DMA_STEPSEL_DST false
+
+class Adafruit_ZeroDMA {
+public:
+    Adafruit_ZeroDMA();
+
+    ZeroDMAstatus allocate();
+    ZeroDMAstatus free();
+    ZeroDMAstatus startJob();
+    void trigger();
+    void setTrigger(uint8_t trigger);
+    void setAction(dma_transfer_trigger_action action);
+    void setCallback(void (*callback)(Adafruit_ZeroDMA *) = NULL,
+                     dma_callback_type type = DMA_CALLBACK_TRANSFER_DONE);
+    void loop(boolean flag);
+    void suspend();
+    void resume();
+    void abort();
+    bool isActive();
+    uint8_t getChannel() { return _channel; }
+
+    DmacDescriptor *addDescriptor(void *src, void *dst, uint32_t count = 0,
+                                  dma_beat_size size = DMA_BEAT_SIZE_BYTE,
+                                  bool srcInc = true, bool dstInc = true,
+                                  uint32_t stepSize = DMA_ADDRESS_INCREMENT_STEP_SIZE_1,
+                                  bool stepSel = DMA_STEPSEL_DST);
+    void changeDescriptor(DmacDescriptor *d, void *src = NULL, void *dst = NULL, uint32_t count = 0);
+
+    /** Emulation: a peripheral raised a DMA trigger */
+    void _on_trigger(uint8_t trigger_id);
+    /** Emulation: the channel is waiting on this trigger */
+    bool _waits_for(uint8_t trigger_id);
+
+private:
+    void _step();
+    bool _load_block(DmacDescriptor *desc);
+    bool _beat();
+    static void _dispatch_callback(void *arg);
+    static void _dispatch_error_callback(void *arg);
+    static void _dispatch_suspend_callback(void *arg);
+    /** The fetched descriptor wasn't VALID, suspend like the DMAC does on CHSTATUS.FERR */
+    void _fetch_error();
+
+    uint8_t _channel = 0xFF;
+    uint8_t _peripheral_trigger = 0;
+    dma_transfer_trigger_action _trigger_action = DMA_TRIGGER_ACTON_BLOCK;
+    void (*_callback)(Adafruit_ZeroDMA *) = NULL;
+    void (*_error_callback)(Adafruit_ZeroDMA *) = NULL;
+    void (*_suspend_callback)(Adafruit_ZeroDMA *) = NULL;
+    bool _loop = false;
+    bool _active = false;
+    bool _suspended = false;
+
+    DmacDescriptor *_first_descriptor = NULL;
+    DmacDescriptor *_last_descriptor = NULL;
+
+    // working copy of the block in flight, like the DMAC write-back memory
+    DmacDescriptor *_current = NULL;
+    uint8_t *_src;
+    uint8_t *_dst;
+    uint32_t _beat_size;
+    uint32_t _beats_left;
+    bool _src_inc, _dst_inc;
+};
+
+#endif // NATIVE_ADAFRUIT_ZERODMA_H_
@@ -0,0 +1,220 @@
+#ifndef NATIVE_ARDUINO_H_
+#define NATIVE_ARDUINO_H_
+
+/**
+ * Minimal Arduino core for the native environment: timing, pins, Serial and the handful of
+ * SAMD21 peripheral registers (DAC, TC5, GCLK, DMAC) that the firmware touches directly.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "NativeHal.h"
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 0x1
+#define LOW 0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define CHANGE 2
+#define FALLING 3
+#define RISING 4
+
+#define digitalPinToInterrupt(p) (p)
+
+#define LED_BUILTIN 13
+#define A0 14
+#define A1 15
+#define A2 16
+
+// the Express boards' onboard SPI flash, on its own SERCOM
+#define SS1 39
+#define EXTERNAL_FLASH_USE_SPI SPI1
+#define EXTERNAL_FLASH_USE_CS SS1
+
+#ifdef __cplusplus
+
+template <class T, class L>
+auto min(const T &a, const L &b) -> decltype((b < a) ? b : a) {
+    return (b < a) ? b : a;
+}
+
+template <class T, class L>
+auto max(const T &a, const L &b) -> decltype((b < a) ? b : a) {
+    return (a < b) ? b : a;
+}
+
+unsigned long micros();
+unsigned long millis();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+void pinMode(uint32_t pin, uint32_t mode);
+int digitalRead(uint32_t pin);
+void digitalWrite(uint32_t pin, uint32_t val);
+void analogWriteResolution(int bits);
+/** One pin interrupt at a time, raised at the exact virtual time of each edge of SIM_DIAL */
+void attachInterrupt(uint32_t pin, void (*callback)(void), uint32_t mode);
+void detachInterrupt(uint32_t pin);
+
+long map(long x, long in_min, long in_max, long out_min, long out_max);
+
+inline void noInterrupts() { hal_irq_disable(); }
+inline void interrupts() { hal_irq_enable(); }
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper *>(string_literal))
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *str) { return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+
+    size_t print(const char *str) { return write(str); }
+    size_t print(const __FlashStringHelper *str) { return write((const char *)str); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(long n, int base = 10);
+    size_t print(unsigned long n, int base = 10);
+    size_t print(int n, int base = 10) { return print((long)n, base); }
+    size_t print(unsigned int n, int base = 10) { return print((unsigned long)n, base); }
+
+    size_t println() { return write("\r\n"); }
+    template <typename T>
+    size_t println(T value) { return print(value) + println(); }
+};
+
+class HalSerial : public Print {
+public:
+    void begin(unsigned long baud) { (void)baud; }
+    operator bool() const { return true; }
+    /** Input is scripted by SIM_SERIAL_IN, see NativeHal.h */
+    int available();
+    int read();
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    using Print::write;
+    /** Room left in the modelled USB transmit buffer, a bigger write waits for it to drain, see SIM_SERIAL_BYTE_US */
+    int availableForWrite();
+};
+
+extern HalSerial Serial;
+
+// -- SAMD21 peripheral registers
+// Only the fields the firmware reads or writes exist. Sync/reset bits are not aliased onto
+// reg and always read back as idle, so the register polling loops fall straight through.
+
+typedef struct {
+    struct { uint8_t reg; struct { uint8_t SWRST : 1; uint8_t ENABLE : 1; } bit; } CTRLA;
+    struct { uint8_t reg; struct { uint8_t SYNCBUSY : 1; } bit; } STATUS;
+    struct { uint16_t reg; } DATA;
+} Dac;
+
+typedef struct {
+    struct { uint16_t reg; struct { uint16_t SWRST : 1; uint16_t ENABLE : 1; } bit; } CTRLA;
+    struct { uint8_t reg; struct { uint8_t SYNCBUSY : 1; } bit; } STATUS;
+    struct { uint8_t reg; struct { uint8_t OVF : 1; uint8_t ERR : 1; uint8_t : 1; uint8_t SYNCRDY : 1; uint8_t MC0 : 1; uint8_t MC1 : 1; } bit; } INTENSET;
+    struct { uint16_t reg; } COUNT;
+    struct { uint16_t reg; } CC[2];
+} TcCount16;
+
+typedef struct {
+    struct { uint8_t reg; struct { uint8_t SYNCBUSY : 1; } bit; } STATUS;
+} Gclk;
+
+// the CRC engine only runs CRC16 over byte beats, the only mode the SD read DMA uses.
+// WRBADDR is pointer-sized like the descriptor addresses
+typedef struct {
+    struct { uint16_t reg; struct { uint16_t SWRST : 1; uint16_t DMAENABLE : 1; uint16_t CRCENABLE : 1; } bit; } CTRL;
+    struct { uint16_t reg; } CRCCTRL;
+    struct { uint32_t reg; } CRCCHKSUM;
+    struct { uint8_t reg; } CRCSTATUS;
+    struct { uintptr_t reg; } WRBADDR;
+} Dmac;
+
+extern Dac hal_dac;
+extern TcCount16 hal_tc5;
+extern Gclk hal_gclk;
+extern Dmac hal_dmac;
+extern uint16_t hal_gclk_clkctrl;
+
+#define DAC (&hal_dac)
+#define TC5 (&hal_tc5)
+#define GCLK (&hal_gclk)
+#define DMAC (&hal_dmac)
+#define REG_GCLK_CLKCTRL hal_gclk_clkctrl
+
+#define GCLK_CLKCTRL_ID(value) ((uint16_t)(value))
+#define GCLK_CLKCTRL_GEN_GCLK0 ((uint16_t)0)
+#define GCLK_CLKCTRL_CLKEN ((uint16_t)(1 << 14))
+#define GCM_TC4_TC5 0x1C
+
+#define TC_CTRLA_SWRST (1 << 0)
+#define TC_CTRLA_ENABLE (1 << 1)
+#define TC_CTRLA_MODE_COUNT16 (0 << 2)
+#define TC_CTRLA_WAVEGEN_MFRQ (1 << 5)
+#define TC_CTRLA_PRESCALER_Pos 8
+#define TC_CTRLA_PRESCALER_Msk (0x7 << TC_CTRLA_PRESCALER_Pos)
+#define TC_CTRLA_PRESCALER_DIV1 (0 << TC_CTRLA_PRESCALER_Pos)
+#define TC_CTRLA_PRESCALER_DIV2 (1 << TC_CTRLA_PRESCALER_Pos)
+#define TC_CTRLA_PRESCALER_DIV4 (2 << TC_CTRLA_PRESCALER_Pos)
+#define TC_CTRLA_PRESCALER_DIV8 (3 << TC_CTRLA_PRESCALER_Pos)
+#define TC_CTRLA_PRESCALER_DIV16 (4 << TC_CTRLA_PRESCALER_Pos)
+#define TC_CTRLA_PRESCALER_DIV64 (5 << TC_CTRLA_PRESCALER_Pos)
+#define TC_CTRLA_PRESCALER_DIV256 (6 << TC_CTRLA_PRESCALER_Pos)
+#define TC_CTRLA_PRESCALER_DIV1024 (7 << TC_CTRLA_PRESCALER_Pos)
+
+#define TC5_DMAC_ID_OVF 0x1E
+
+#define DMAC_CRCCTRL_CRCBEATSIZE_BYTE ((uint16_t)0)
+#define DMAC_CRCCTRL_CRCPOLY_CRC16 ((uint16_t)(0 << 2))
+#define DMAC_CRCCTRL_CRCSRC(value) ((uint16_t)((value) << 8))
+#define DMAC_CRCSTATUS_CRCBUSY ((uint8_t)(1 << 0))
+
+// -- DMAC descriptor, addresses are pointer-sized so the same code runs on a 64-bit host
+
+typedef struct {
+    union {
+        struct {
+            uint16_t VALID : 1;
+            uint16_t EVOSEL : 2;
+            uint16_t BLOCKACT : 2;
+            uint16_t : 3;
+            uint16_t BEATSIZE : 2;
+            uint16_t SRCINC : 1;
+            uint16_t DSTINC : 1;
+            uint16_t STEPSEL : 1;
+            uint16_t STEPSIZE : 3;
+        } bit;
+        uint16_t reg;
+    } BTCTRL;
+    union { struct { uint16_t BTCNT; } bit; uint16_t reg; } BTCNT;
+    union { struct { uintptr_t SRCADDR; } bit; uintptr_t reg; } SRCADDR;
+    union { struct { uintptr_t DSTADDR; } bit; uintptr_t reg; } DSTADDR;
+    union { struct { uintptr_t DESCADDR; } bit; uintptr_t reg; } DESCADDR;
+} DmacDescriptor;
+
+#define DMAC_BTCTRL_VALID (1 << 0)
+#define DMAC_BTCTRL_BLOCKACT_Pos 3
+#define DMAC_BTCTRL_BLOCKACT_NOACT (0 << DMAC_BTCTRL_BLOCKACT_Pos)
+#define DMAC_BTCTRL_BLOCKACT_INT (1 << DMAC_BTCTRL_BLOCKACT_Pos)
+#define DMAC_BTCTRL_BLOCKACT_SUSPEND (2 << DMAC_BTCTRL_BLOCKACT_Pos)
+#define DMAC_BTCTRL_BLOCKACT_BOTH (3 << DMAC_BTCTRL_BLOCKACT_Pos)
+
+/** Firmware entry points */
+void setup();
+void loop();
+
+#endif // __cplusplus
+
+#endif // NATIVE_ARDUINO_H_
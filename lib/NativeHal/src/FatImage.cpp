@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "FatImage.h"
+
+#define SECTOR_BYTES 512
+#define RESERVED_SECTORS 32
+// a few past the most a FAT16 volume can have
+#define CLUSTER_COUNT 65600
+#define FAT_SECTORS (((CLUSTER_COUNT + 2) * 4 + SECTOR_BYTES - 1) / SECTOR_BYTES)
+#define DATA_START_SECTOR (RESERVED_SECTORS + FAT_SECTORS)
+#define ROOT_CLUSTER 2
+#define FAT32_EOC 0x0FFFFFFF
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, (uint16_t)v);
+    put16(p + 2, (uint16_t)(v >> 16));
+}
+
+static bool write_at(FILE *f, uint32_t sector, const void *data, size_t len) {
+    return fseek(f, (long)sector * SECTOR_BYTES, SEEK_SET) == 0 && fwrite(data, 1, len, f) == len;
+}
+
+/** "13.WAV" as the space padded "13      WAV" of a directory entry, false if it isn't 8.3 */
+static bool short_name(const char *name, uint8_t *out) {
+    memset(out, ' ', 11);
+    const char *dot = strchr(name, '.');
+    size_t base = dot ? (size_t)(dot - name) : strlen(name);
+    size_t ext = dot ? strlen(dot + 1) : 0;
+    if (base == 0 || base > 8 || ext > 3) return false;
+
+    for (size_t i = 0; i < base; i++) out[i] = (uint8_t)toupper(name[i]);
+    for (size_t i = 0; i < ext; i++) out[8 + i] = (uint8_t)toupper(dot[1 + i]);
+    return true;
+}
+
+bool fat_image_write(const char *path, const FatImageFile *files, uint8_t num_files, uint32_t run_clusters) {
+    // the root directory is a single one-sector cluster
+    if (num_files > SECTOR_BYTES / 32) return false;
+
+    FILE *f = fopen(path, "wb");
+    if (!f) return false;
+
+    bool ok = true;
+    uint32_t *fat = (uint32_t *)calloc(CLUSTER_COUNT + 2, sizeof(uint32_t));
+    uint8_t root[SECTOR_BYTES] = {};
+    uint8_t boot[SECTOR_BYTES] = {};
+    uint32_t next_cluster = ROOT_CLUSTER + 1;
+
+    fat[0] = 0x0FFFFFF8;
+    fat[1] = FAT32_EOC;
+    fat[ROOT_CLUSTER] = FAT32_EOC;
+
+    for (uint8_t i = 0; i < num_files && ok; i++) {
+        uint8_t *entry = root + 32 * i;
+        uint32_t clusters = (files[i].size + SECTOR_BYTES - 1) / SECTOR_BYTES;
+        uint32_t first = 0, prev = 0;
+
+        for (uint32_t c = 0; c < clusters && ok; c++) {
+            // leave a free cluster between runs, so the file has to be followed through the FAT
+            if (run_clusters && c > 0 && c % run_clusters == 0) next_cluster++;
+            if (next_cluster >= CLUSTER_COUNT + 2) {
+                ok = false;
+                break;
+            }
+
+            uint32_t cluster = next_cluster++;
+            if (prev) {
+                fat[prev] = cluster;
+            } else {
+                first = cluster;
+            }
+            prev = cluster;
+
+            uint32_t offset = c * SECTOR_BYTES;
+            uint32_t len = files[i].size - offset < SECTOR_BYTES ? files[i].size - offset : SECTOR_BYTES;
+            ok = write_at(f, DATA_START_SECTOR + cluster - 2, files[i].data + offset, len);
+        }
+        if (prev) fat[prev] = FAT32_EOC;
+
+        ok = ok && short_name(files[i].name, entry);
+        entry[11] = 0x20;
+        put16(entry + 20, (uint16_t)(first >> 16));
+        put16(entry + 26, (uint16_t)first);
+        put32(entry + 28, files[i].size);
+    }
+
+    // one FAT, little-endian entries
+    for (uint32_t s = 0; s < FAT_SECTORS && ok; s++) {
+        uint8_t sector[SECTOR_BYTES];
+        for (uint32_t e = 0; e < SECTOR_BYTES / 4; e++) {
+            uint32_t n = s * (SECTOR_BYTES / 4) + e;
+            put32(sector + 4 * e, n < CLUSTER_COUNT + 2 ? fat[n] : 0);
+        }
+        ok = write_at(f, RESERVED_SECTORS + s, sector, SECTOR_BYTES);
+    }
+
+    boot[0] = 0xEB;
+    boot[1] = 0x58;
+    boot[2] = 0x90;
+    memcpy(boot + 3, "MSWIN4.1", 8);
+    put16(boot + 11, SECTOR_BYTES);
+    boot[13] = 1;
+    put16(boot + 14, RESERVED_SECTORS);
+    boot[16] = 1;
+    boot[21] = 0xF8;
+    put32(boot + 32, DATA_START_SECTOR + CLUSTER_COUNT);
+    put32(boot + 36, FAT_SECTORS);
+    put32(boot + 44, ROOT_CLUSTER);
+    put16(boot + 510, 0xAA55);
+
+    ok = ok && write_at(f, 0, boot, SECTOR_BYTES) && write_at(f, DATA_START_SECTOR, root, SECTOR_BYTES);
+
+    // the last sector sets the image's size, everything up to it that wasn't written reads as zeros
+    uint8_t zero = 0;
+    ok = ok && fseek(f, (long)(DATA_START_SECTOR + CLUSTER_COUNT) * SECTOR_BYTES - 1, SEEK_SET) == 0
+        && fwrite(&zero, 1, 1, f) == 1;
+
+    free(fat);
+    return fclose(f) == 0 && ok;
+}
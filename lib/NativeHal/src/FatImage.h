@@ -0,0 +1,25 @@
+#ifndef NATIVE_FAT_IMAGE_H_
+#define NATIVE_FAT_IMAGE_H_
+
+#include <stdint.h>
+
+/** A file to put on a generated card image */
+typedef struct {
+    // 8.3 name, e.g. "13.WAV"
+    const char *name;
+    const uint8_t *data;
+    uint32_t size;
+} FatImageFile;
+
+/**
+ * Write a FAT32 card image holding files in its root directory, for the native tests. Clusters
+ * are one sector, and the volume has just enough of them to be FAT32, so the image is ~33MB (sparse
+ * where the filesystem allows it).
+ *
+ * With run_clusters 0 each file is contiguous. Otherwise every file is split into runs of
+ * run_clusters clusters with a free cluster after each, so a file of n clusters has n / run_clusters
+ * extents, the worst case being 1.
+ */
+bool fat_image_write(const char *path, const FatImageFile *files, uint8_t num_files, uint32_t run_clusters);
+
+#endif // NATIVE_FAT_IMAGE_H_
@@ -0,0 +1,424 @@
+#include <Arduino.h>
+#include <SPI.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "NativeHal.h"
+
+HalSerial Serial;
+SPIClass SPI;
+SPIClass SPI1;
+
+Dac hal_dac;
+TcCount16 hal_tc5;
+Gclk hal_gclk;
+Dmac hal_dmac;
+uint16_t hal_gclk_clkctrl;
+
+static uint64_t now_us = 0;
+// main() sets this from SIM_DURATION_MS, tests run until they return
+static uint64_t end_us = UINT64_MAX;
+// TC5 input clock cycles not yet accounted for by an overflow
+static uint64_t tc5_cycles = 0;
+static FILE *dac_out = NULL;
+static void (*dac_sink)(uint16_t) = NULL;
+
+static uint32_t irq_disable_depth = 0;
+
+static struct {
+    uint32_t pin;
+    void (*callback)(void);
+    uint32_t mode;
+    int level;
+} pin_irq;
+
+#define MAX_PENDING_IRQS 16
+static struct {
+    void (*handler)(void *);
+    void *arg;
+    // virtual time the handler gets to run, models interrupt latency
+    uint64_t due_us;
+} pending_irqs[MAX_PENDING_IRQS];
+static uint32_t num_pending_irqs = 0;
+
+const char *hal_env(const char *name, const char *fallback) {
+    const char *value = getenv(name);
+    return value && *value ? value : fallback;
+}
+
+uint32_t hal_env_u32(const char *name, uint32_t fallback) {
+    const char *value = getenv(name);
+    return value && *value ? (uint32_t)strtoul(value, NULL, 0) : fallback;
+}
+
+// -- interrupts
+
+bool hal_irq_enabled() {
+    return irq_disable_depth == 0;
+}
+
+void hal_irq_disable() {
+    irq_disable_depth++;
+}
+
+void hal_irq_enable() {
+    if (irq_disable_depth > 0) irq_disable_depth--;
+    hal_irq_dispatch();
+}
+
+void hal_irq_dispatch() {
+    if (irq_disable_depth > 0) return;
+
+    // run anything raised while masked or whose latency has passed, handlers may raise more
+    uint32_t i = 0;
+    while (i < num_pending_irqs) {
+        if (pending_irqs[i].due_us > now_us) {
+            i++;
+            continue;
+        }
+
+        void (*handler)(void *) = pending_irqs[i].handler;
+        void *arg = pending_irqs[i].arg;
+        num_pending_irqs--;
+        memmove(&pending_irqs[i], &pending_irqs[i + 1], (num_pending_irqs - i) * sizeof(pending_irqs[0]));
+        handler(arg);
+    }
+}
+
+void hal_irq_raise(void (*handler)(void *), void *arg) {
+    uint32_t latency_us = hal_env_u32("SIM_IRQ_LATENCY_US", 0);
+    if (hal_irq_enabled() && latency_us == 0) {
+        handler(arg);
+        return;
+    }
+
+    if (num_pending_irqs < MAX_PENDING_IRQS) {
+        pending_irqs[num_pending_irqs].handler = handler;
+        pending_irqs[num_pending_irqs].arg = arg;
+        pending_irqs[num_pending_irqs].due_us = now_us + latency_us;
+        num_pending_irqs++;
+    }
+}
+
+// -- virtual clock
+
+uint64_t hal_now_us() {
+    return now_us;
+}
+
+static void tc5_overflow() {
+    hal_dma_trigger(TC5_DMAC_ID_OVF);
+
+    uint16_t sample = hal_dac.DATA.reg;
+    if (dac_out) {
+        uint8_t le[2] = { (uint8_t)sample, (uint8_t)(sample >> 8) };
+        fwrite(le, 1, 2, dac_out);
+    }
+    if (dac_sink) dac_sink(sample);
+}
+
+void hal_set_dac_sink(void (*sink)(uint16_t sample)) {
+    dac_sink = sink;
+}
+
+uint64_t hal_host_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+static int pin_level(uint32_t pin, uint64_t t, uint64_t *next_change);
+
+static void dispatch_pin_irq(void *arg) {
+    (void)arg;
+    if (pin_irq.callback) pin_irq.callback();
+}
+
+static void advance_to(uint64_t target_us);
+
+void hal_advance_us(uint64_t us) {
+    uint64_t target_us = now_us + us;
+
+    // stop at every edge of an interrupt pin on the way, so its handler sees the time of the edge
+    uint64_t edge_us;
+    while (pin_irq.callback && (pin_level(pin_irq.pin, now_us, &edge_us), edge_us <= target_us)) {
+        advance_to(edge_us);
+
+        int level = hal_pin_level(pin_irq.pin);
+        if (level == pin_irq.level) continue;
+        pin_irq.level = level;
+
+        if (pin_irq.mode == CHANGE || (pin_irq.mode == RISING) == (level == HIGH)) {
+            hal_irq_raise(dispatch_pin_irq, NULL);
+        }
+    }
+
+    advance_to(target_us);
+}
+
+/** Clock the SPI bus up to a time, a byte per byte time while a DMA channel feeds it */
+static void spi_run_to(uint64_t target_us) {
+    static uint64_t spi_ns = 0;
+    static uint64_t byte_ns = 0;
+    if (!byte_ns) byte_ns = hal_env_u32("SIM_SD_SECTOR_US", 350) * 1000ull / 512;
+
+    uint64_t target_ns = target_us * 1000;
+    while (spi_ns + byte_ns <= target_ns && hal_dma_pending(SPI.getDMAC_ID_TX())) {
+        spi_ns += byte_ns;
+        SPI._clock_dma();
+    }
+    // an idle bus doesn't bank time
+    if (!hal_dma_pending(SPI.getDMAC_ID_TX())) spi_ns = target_ns;
+}
+
+static void advance_to(uint64_t target_us) {
+    uint64_t us = target_us - now_us;
+    if (now_us + us >= end_us) {
+        if (dac_out) fclose(dac_out);
+        fflush(stdout);
+        exit(0);
+    }
+
+    if (!(hal_tc5.CTRLA.reg & TC_CTRLA_ENABLE)) {
+        spi_run_to(target_us);
+        now_us += us;
+        tc5_cycles = 0;
+        hal_irq_dispatch();
+        return;
+    }
+
+    static const uint16_t prescalers[8] = { 1, 2, 4, 8, 16, 64, 256, 1024 };
+    uint32_t prescaler = prescalers[(hal_tc5.CTRLA.reg & TC_CTRLA_PRESCALER_Msk) >> TC_CTRLA_PRESCALER_Pos];
+
+    // step through the overflows one at a time so handlers see the time they happened at
+    tc5_cycles += us * (HAL_CPU_HZ / 1000000);
+    while (true) {
+        uint64_t period = ((uint64_t)hal_tc5.CC[0].reg + 1) * prescaler;
+        if (tc5_cycles < period) break;
+
+        tc5_cycles -= period;
+        now_us = target_us - tc5_cycles / (HAL_CPU_HZ / 1000000);
+        spi_run_to(now_us);
+        hal_irq_dispatch();
+        tc5_overflow();
+
+        if (!(hal_tc5.CTRLA.reg & TC_CTRLA_ENABLE)) break;
+    }
+    spi_run_to(target_us);
+    now_us = target_us;
+    hal_irq_dispatch();
+}
+
+unsigned long micros() {
+    return (unsigned long)now_us;
+}
+
+unsigned long millis() {
+    return (unsigned long)(now_us / 1000);
+}
+
+void delay(unsigned long ms) {
+    hal_advance_us((uint64_t)ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+    hal_advance_us(us);
+}
+
+void yield() {
+    hal_advance_us(1);
+}
+
+long map(long x, long in_min, long in_max, long out_min, long out_max) {
+    if (in_max == in_min) return out_min;
+    return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+
+void analogWriteResolution(int bits) {
+    (void)bits;
+}
+
+// -- pins
+
+void pinMode(uint32_t pin, uint32_t mode) {
+    (void)pin;
+    (void)mode;
+}
+
+void digitalWrite(uint32_t pin, uint32_t val) {
+    (void)pin;
+    (void)val;
+}
+
+int digitalRead(uint32_t pin) {
+    return hal_pin_level(pin);
+}
+
+void attachInterrupt(uint32_t pin, void (*callback)(void), uint32_t mode) {
+    pin_irq.pin = pin;
+    pin_irq.mode = mode;
+    pin_irq.level = hal_pin_level(pin);
+    pin_irq.callback = callback;
+}
+
+void detachInterrupt(uint32_t pin) {
+    if (pin == pin_irq.pin) pin_irq.callback = NULL;
+}
+
+int hal_pin_level(uint32_t pin) {
+    uint64_t next_change;
+    return pin_level(pin, now_us, &next_change);
+}
+
+/**
+ * The dialer pin idles HIGH and drops LOW once per pulse: 60ms low, 40ms high, with 800ms
+ * between digits, matching a rotary dial. A '0' sends 10 pulses, and a ',' waits another
+ * second. For SIM_DIAL_BOUNCE_US after each change the contacts chatter, flipping every 500us.
+ * next_change is a time after t the level may change at, or UINT64_MAX if it never will.
+ */
+static int pin_level(uint32_t pin, uint64_t t, uint64_t *next_change) {
+    *next_change = UINT64_MAX;
+    if (pin != A1) return LOW;
+
+    const char *digits = hal_env("SIM_DIAL", "");
+    uint64_t start = (uint64_t)hal_env_u32("SIM_DIAL_AT_MS", 2000) * 1000;
+    if (t < start) {
+        if (*digits) *next_change = start;
+        return HIGH;
+    }
+
+    int level = HIGH;
+    uint64_t last_change = 0;
+    for (const char *d = digits; *d; ++d) {
+        if (*d == ',') {
+            if (t < start + 1000000) {
+                *next_change = start + 1000000;
+                break;
+            }
+            start += 1000000;
+            continue;
+        }
+        if (*d < '0' || *d > '9') continue;
+
+        uint32_t pulses = *d == '0' ? 10 : *d - '0';
+        uint64_t digit_us = pulses * 100000ull;
+        if (t < start + digit_us) {
+            uint64_t pulse_start = t - (t - start) % 100000;
+            level = t - pulse_start < 60000 ? LOW : HIGH;
+            last_change = pulse_start + (level == LOW ? 0 : 60000);
+            *next_change = pulse_start + (level == LOW ? 60000 : 100000);
+            break;
+        }
+        start += digit_us;
+
+        if (t < start + 800000) {
+            last_change = start - 40000;
+            *next_change = start + 800000;
+            break;
+        }
+        start += 800000;
+    }
+
+    uint64_t bounce_us = hal_env_u32("SIM_DIAL_BOUNCE_US", 0);
+    if (last_change > 0 && t - last_change < bounce_us) {
+        uint64_t flips = (t - last_change) / 500;
+        *next_change = min(last_change + (flips + 1) * 500, last_change + bounce_us);
+        if (flips % 2) level = level == HIGH ? LOW : HIGH;
+    }
+
+    return level;
+}
+
+// -- Serial
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+    size_t n = 0;
+    while (size--) n += write(*buffer++);
+    return n;
+}
+
+size_t Print::print(long n, int base) {
+    char buf[24];
+    snprintf(buf, sizeof(buf), base == 16 ? "%lx" : "%ld", n);
+    return write(buf);
+}
+
+size_t Print::print(unsigned long n, int base) {
+    char buf[24];
+    snprintf(buf, sizeof(buf), base == 16 ? "%lx" : "%lu", n);
+    return write(buf);
+}
+
+// # of SIM_SERIAL_IN characters already read
+static size_t serial_in_pos = 0;
+
+int HalSerial::available() {
+    if (now_us < (uint64_t)hal_env_u32("SIM_SERIAL_IN_AT_MS", 8000) * 1000) return 0;
+    return (int)(strlen(hal_env("SIM_SERIAL_IN", "")) - serial_in_pos);
+}
+
+int HalSerial::read() {
+    if (available() <= 0) return -1;
+    return (uint8_t)hal_env("SIM_SERIAL_IN", "")[serial_in_pos++];
+}
+
+// the transmit buffer is empty from this time on
+static uint64_t serial_tx_empty_us = 0;
+
+int HalSerial::availableForWrite() {
+    uint32_t byte_us = hal_env_u32("SIM_SERIAL_BYTE_US", 0);
+    uint32_t tx_bytes = hal_env_u32("SIM_SERIAL_TX_BYTES", 64);
+    if (byte_us == 0 || serial_tx_empty_us <= now_us) return (int)tx_bytes;
+
+    uint64_t queued = (serial_tx_empty_us - now_us + byte_us - 1) / byte_us;
+    return queued >= tx_bytes ? 0 : (int)(tx_bytes - queued);
+}
+
+size_t HalSerial::write(uint8_t c) {
+    return write(&c, 1);
+}
+
+size_t HalSerial::write(const uint8_t *buffer, size_t size) {
+    uint32_t byte_us = hal_env_u32("SIM_SERIAL_BYTE_US", 0);
+    if (byte_us > 0) {
+        // like the USB CDC driver, block until the buffer has room for every byte
+        for (size_t i = 0; i < size; i++) {
+            while (availableForWrite() == 0) hal_advance_us(byte_us);
+            if (serial_tx_empty_us < now_us) serial_tx_empty_us = now_us;
+            serial_tx_empty_us += byte_us;
+        }
+    }
+    return fwrite(buffer, 1, size, stdout);
+}
+
+// -- entry point
+
+// the unit tests under test/ bring their own
+#ifndef PIO_UNIT_TESTING
+int main() {
+    end_us = (uint64_t)hal_env_u32("SIM_DURATION_MS", 10000) * 1000;
+
+    const char *dac_path = hal_env("SIM_DAC_OUT", NULL);
+    if (dac_path) {
+        dac_out = fopen(dac_path, "wb");
+        if (!dac_out) {
+            fprintf(stderr, "native: failed to open %s\n", dac_path);
+            return 1;
+        }
+    }
+
+    setup();
+
+    // each pass through loop() costs a microsecond of virtual time
+    for (;;) {
+        loop();
+        hal_advance_us(1);
+    }
+}
+#endif // PIO_UNIT_TESTING
@@ -0,0 +1,80 @@
+#ifndef NATIVE_HAL_H_
+#define NATIVE_HAL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief Host-side stand-in for the Feather M0 hardware used by the player.
+ *
+ * Time is virtual: it only moves when the firmware yields, delays, talks to the SD card or
+ * returns from loop(). Every advance replays the TC5 overflows that fall inside it, which
+ * step any DMA channel triggered by TC5 and sample the DAC into the optional output file,
+ * clocks the SPI bus while a DMA channel feeds it, and raises the pin interrupt at each edge
+ * of the dialer pin inside it.
+ *
+ * The simulation is configured through environment variables:
+ *   SIM_SD_IMAGE      FAT16/FAT32/exFAT disk image backing the SD card (default "sd.img")
+ *   SIM_DURATION_MS   virtual run time before the process exits (default 10000)
+ *   SIM_DAC_OUT       file receiving one little-endian uint16 per TC5 overflow
+ *   SIM_DIAL          digits to pulse on the dialer pin, e.g. "13", a ',' pauses for a second
+ *   SIM_DIAL_AT_MS    virtual time of the first dial pulse (default 2000)
+ *   SIM_DIAL_BOUNCE_US contact bounce after each dialer pin edge (default 0)
+ *   SIM_SD_ACCESS_US  modelled command/access latency of a read (default 500)
+ *   SIM_SD_SECTOR_US  modelled transfer time of one 512-byte sector (default 350)
+ *   SIM_SD_STALL_EVERY every Nth read command stalls, 0 for never (default 0)
+ *   SIM_SD_STALL_US   extra latency of a stalled read (default 50000)
+ *   SIM_SD_CRC_ERROR_EVERY every Nth streamed sector fails its CRC, 0 for never (default 0)
+ *   SIM_SD_GAP_BYTES  idle bytes between a streamed sector's CRC and the next start token (default 1)
+ *   SIM_SD_LONG_GAP_EVERY every Nth streamed sector is followed by a long gap, 0 for never (default 0)
+ *   SIM_SD_LONG_GAP_BYTES length of a long gap (default 64)
+ *   SIM_FLASH_IMAGE   file backing the onboard SPI flash, created if missing. No flash without one
+ *   SIM_FLASH_BYTE_NS modelled time to clock one byte out of the flash (default 350)
+ *   SIM_FLASH_PROGRAM_US modelled time to program one flash page (default 700)
+ *   SIM_FLASH_ERASE_US modelled time to erase one 4KB flash sector (default 50000)
+ *   SIM_IRQ_LATENCY_US delay between an interrupt being raised and its handler running (default 0)
+ *   SIM_SERIAL_IN     characters that arrive on Serial, e.g. "h"
+ *   SIM_SERIAL_IN_AT_MS virtual time they arrive (default 8000)
+ *   SIM_SERIAL_BYTE_US modelled time for the host to take one byte written to Serial, 0 for instant (default 0)
+ *   SIM_SERIAL_TX_BYTES size of the transmit buffer writes wait on once it's full (default 64)
+ */
+
+#define HAL_CPU_HZ 48000000
+
+/** Current virtual time */
+uint64_t hal_now_us();
+
+/** Advance virtual time, running any peripheral activity and interrupts that fall inside it */
+void hal_advance_us(uint64_t us);
+
+/** Interrupt masking, callbacks raised while masked run when interrupts are re-enabled */
+void hal_irq_disable();
+void hal_irq_enable();
+bool hal_irq_enabled();
+/** Run an interrupt handler now, or defer it until interrupts are re-enabled and SIM_IRQ_LATENCY_US has passed */
+void hal_irq_raise(void (*handler)(void *), void *arg);
+/** Run any deferred handlers that are due */
+void hal_irq_dispatch();
+
+/** Simulated level of a digital input pin */
+int hal_pin_level(uint32_t pin);
+
+/** Environment-backed simulation settings */
+const char *hal_env(const char *name, const char *fallback);
+uint32_t hal_env_u32(const char *name, uint32_t fallback);
+
+/** Hooks implemented by the DMA emulation */
+void hal_dma_trigger(uint8_t trigger_id);
+/** A running channel waits on this trigger */
+bool hal_dma_pending(uint8_t trigger_id);
+
+/** Called with the DAC's value at every TC5 overflow, for tests checking the output. NULL to stop */
+void hal_set_dac_sink(void (*sink)(uint16_t sample));
+
+/** Host CPU timestamp for benchmarks: TSC cycles on x86, nanoseconds elsewhere */
+uint64_t hal_host_cycles();
+
+/** Hook implemented by the SD card emulation, the byte the card clocks out for one clocked in */
+uint8_t hal_spi_exchange(uint8_t out);
+
+#endif // NATIVE_HAL_H_
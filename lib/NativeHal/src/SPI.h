@@ -0,0 +1,39 @@
+#ifndef NATIVE_SPI_H_
+#define NATIVE_SPI_H_
+
+#include <Arduino.h>
+
+/**
+ * SPI stand-in. Bytes are exchanged with the emulated card, each costing virtual time. A DMA
+ * channel waiting on DRE clocks the bus by itself as virtual time passes, see hal_advance_us().
+ */
+class SPIClass {
+public:
+    void begin() {}
+    void end() {}
+
+    uint8_t transfer(uint8_t data) {
+        hal_advance_us(1);
+        return hal_spi_exchange(data);
+    }
+
+    uint8_t getDMAC_ID_TX() { return 0x04; }
+    uint8_t getDMAC_ID_RX() { return 0x03; }
+    void *getDataRegister() { return (void *)&_data; }
+
+    /** Emulation: one byte time driven by DMA, DRE has TX fill DATA, then RXC has RX empty it */
+    void _clock_dma() {
+        hal_dma_trigger(getDMAC_ID_TX());
+        _data = hal_spi_exchange(_data);
+        hal_dma_trigger(getDMAC_ID_RX());
+    }
+
+private:
+    volatile uint8_t _data = 0xFF;
+};
+
+extern SPIClass SPI;
+// the onboard flash's bus, see Adafruit_SPIFlash.h
+extern SPIClass SPI1;
+
+#endif // NATIVE_SPI_H_
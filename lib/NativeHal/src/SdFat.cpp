@@ -0,0 +1,606 @@
+#include "SdFat.h"
+
+#include <ctype.h>
+
+SdFs *SdFs::_cwv = NULL;
+
+static uint16_t get16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get64(const uint8_t *p) {
+    return (uint64_t)get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+static bool name_equals(const char *a, const char *b) {
+    while (*a && *b) {
+        if (toupper((unsigned char)*a) != toupper((unsigned char)*b)) return false;
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+// -- SdCard
+
+// the card on the SPI bus
+static SdCard *spi_card = NULL;
+// sectors streamed, for SIM_SD_CRC_ERROR_EVERY and SIM_SD_LONG_GAP_EVERY
+static uint32_t num_streamed = 0;
+
+static uint16_t crc16_ccitt(const uint8_t *data, size_t len) {
+    uint16_t crc = 0;
+    while (len--) {
+        crc ^= (uint16_t)*data++ << 8;
+        for (uint8_t i = 0; i < 8; ++i) crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+/** A corrupted sector, it arrives with the CRC of the good data */
+static bool inject_crc_error() {
+    uint32_t crc_error_every = hal_env_u32("SIM_SD_CRC_ERROR_EVERY", 0);
+    return ++num_streamed, crc_error_every && num_streamed % crc_error_every == 0;
+}
+
+uint8_t hal_spi_exchange(uint8_t out) {
+    return spi_card ? spi_card->spiExchange(out) : 0xFF;
+}
+
+/** Charge a read command, with an occasional long stall like a card doing internal wear leveling */
+static void charge_access() {
+    static uint32_t num_commands = 0;
+
+    uint64_t us = hal_env_u32("SIM_SD_ACCESS_US", 500);
+    uint32_t stall_every = hal_env_u32("SIM_SD_STALL_EVERY", 0);
+    if (stall_every && ++num_commands % stall_every == 0) {
+        us += hal_env_u32("SIM_SD_STALL_US", 50000);
+    }
+    hal_advance_us(us);
+}
+
+bool SdCard::begin(const char *path) {
+    end();
+
+    _image = fopen(path, "rb");
+    if (!_image) return false;
+
+    fseek(_image, 0, SEEK_END);
+    _sector_count = (uint32_t)(ftell(_image) / 512);
+    spi_card = this;
+    return _sector_count > 0;
+}
+
+void SdCard::end() {
+    if (_image) fclose(_image);
+    _image = NULL;
+    _streaming = false;
+    _spi_phase = SPI_IDLE;
+    if (spi_card == this) spi_card = NULL;
+}
+
+bool SdCard::readRaw(uint32_t sector, uint8_t *dst, size_t ns) {
+    if (!_image || sector + ns > _sector_count) return false;
+    if (fseek(_image, (long)sector * 512, SEEK_SET) != 0) return false;
+    return fread(dst, 512, ns, _image) == ns;
+}
+
+bool SdCard::readSectors(uint32_t sector, uint8_t *dst, size_t ns) {
+    // a plain multi-sector read always pays a fresh command
+    _streaming = false;
+    charge_access();
+    hal_advance_us(ns * hal_env_u32("SIM_SD_SECTOR_US", 350));
+    return readRaw(sector, dst, ns);
+}
+
+bool SdCard::readStart(uint32_t sector) {
+    if (!_image || sector >= _sector_count) return false;
+
+    charge_access();
+    _streaming = true;
+    _stream_sector = sector;
+
+    // the access time is charged, a few idle bytes are left before the first start token
+    _spi_phase = SPI_GAP;
+    _spi_left = 4;
+    return true;
+}
+
+bool SdCard::readData(uint8_t *dst) {
+    if (!_streaming) return false;
+
+    hal_advance_us(hal_env_u32("SIM_SD_SECTOR_US", 350));
+
+    // as SdFat with USE_SD_CRC fails a sector whose CRC doesn't match, the card still moves on
+    if (inject_crc_error()) {
+        _stream_sector++;
+        return false;
+    }
+
+    return readRaw(_stream_sector++, dst, 1);
+}
+
+bool SdCard::readStop() {
+    _streaming = false;
+    _spi_phase = SPI_IDLE;
+    return true;
+}
+
+void SdCard::_load_stream_sector() {
+    if (!readRaw(_stream_sector++, _spi_sector, 1)) memset(_spi_sector, 0, sizeof(_spi_sector));
+    _spi_crc = crc16_ccitt(_spi_sector, sizeof(_spi_sector));
+    _spi_pos = 0;
+}
+
+uint8_t SdCard::spiExchange(uint8_t out) {
+    (void)out;
+
+    switch (_spi_phase) {
+    case SPI_IDLE:
+        return 0xFF;
+    case SPI_GAP:
+        if (_spi_left) {
+            _spi_left--;
+            return 0xFF;
+        }
+        _load_stream_sector();
+        _spi_phase = SPI_DATA;
+        return 0xFE;
+    case SPI_DATA: {
+        // a sector the card got ready but wasn't clocked out doesn't count towards the errors
+        if (_spi_pos == 0 && inject_crc_error()) _spi_sector[17] ^= 0x04;
+        uint8_t b = _spi_sector[_spi_pos++];
+        if (_spi_pos == sizeof(_spi_sector)) {
+            _spi_phase = SPI_CRC;
+            _spi_left = 2;
+        }
+        return b;
+    }
+    case SPI_CRC: {
+        uint8_t b = --_spi_left ? _spi_crc >> 8 : _spi_crc & 0xFF;
+        if (!_spi_left) {
+            // the card's idle bytes before the next sector, now and then a long wait
+            uint32_t long_gap_every = hal_env_u32("SIM_SD_LONG_GAP_EVERY", 0);
+            _spi_phase = SPI_GAP;
+            _spi_left = long_gap_every && num_streamed % long_gap_every == 0
+                ? hal_env_u32("SIM_SD_LONG_GAP_BYTES", 64)
+                : hal_env_u32("SIM_SD_GAP_BYTES", 1);
+        }
+        return b;
+    }
+    }
+    return 0xFF;
+}
+
+// -- SdFs
+
+bool SdFs::begin(SdSpiConfig cfg) {
+    (void)cfg;
+
+    const char *image = hal_env("SIM_SD_IMAGE", "sd.img");
+    if (!_card.begin(image)) {
+        Serial.print("SdFs: failed to open card image ");
+        Serial.println(image);
+        return false;
+    }
+
+    return volumeBegin();
+}
+
+void SdFs::end() {
+    _card.end();
+    if (_cwv == this) _cwv = NULL;
+}
+
+bool SdFs::volumeBegin() {
+    uint8_t buf[512];
+    if (!_card.readRaw(0, buf, 1)) return false;
+
+    // bare volume, or an MBR with the volume in the first partition
+    _volume_start = 0;
+    bool is_exfat = memcmp(buf + 3, "EXFAT   ", 8) == 0;
+    bool is_fat = (buf[0] == 0xEB || buf[0] == 0xE9) && get16(buf + 11) == 512;
+    if (!is_exfat && !is_fat) {
+        if (get16(buf + 510) != 0xAA55) return false;
+        _volume_start = get32(buf + 446 + 8);
+        if (!_card.readRaw(_volume_start, buf, 1)) return false;
+        is_exfat = memcmp(buf + 3, "EXFAT   ", 8) == 0;
+    }
+
+    if (is_exfat) {
+        if (buf[108] != 9) return false;
+        _fat_type = FAT_TYPE_EXFAT;
+        _fat_start_sector = _volume_start + get32(buf + 80);
+        _data_start_sector = _volume_start + get32(buf + 88);
+        _cluster_count = get32(buf + 92);
+        _root_cluster = get32(buf + 96);
+        _sectors_per_cluster_shift = buf[109];
+    } else {
+        if (get16(buf + 11) != 512) return false;
+
+        uint8_t sectors_per_cluster = buf[13];
+        _sectors_per_cluster_shift = 0;
+        while ((1u << _sectors_per_cluster_shift) < sectors_per_cluster) _sectors_per_cluster_shift++;
+
+        uint32_t reserved = get16(buf + 14);
+        uint32_t num_fats = buf[16];
+        uint32_t root_entries = get16(buf + 17);
+        uint32_t total_sectors = get16(buf + 19) ? get16(buf + 19) : get32(buf + 32);
+        uint32_t fat_size = get16(buf + 22) ? get16(buf + 22) : get32(buf + 36);
+
+        _root_sectors = (root_entries * 32 + 511) / 512;
+        _fat_start_sector = _volume_start + reserved;
+        _root_start_sector = _fat_start_sector + num_fats * fat_size;
+        _data_start_sector = _root_start_sector + _root_sectors;
+        _cluster_count = (total_sectors - (_data_start_sector - _volume_start)) >> _sectors_per_cluster_shift;
+
+        if (_cluster_count < 4085) {
+            _fat_type = FAT_TYPE_FAT12;
+            return false;
+        } else if (_cluster_count < 65525) {
+            _fat_type = FAT_TYPE_FAT16;
+            _root_cluster = 0;
+        } else {
+            _fat_type = FAT_TYPE_FAT32;
+            _root_cluster = get32(buf + 44);
+        }
+    }
+
+    _cwv = this;
+    return true;
+}
+
+bool SdFs::_fat_get(uint32_t n, uint32_t *v) {
+    uint8_t buf[512];
+    uint32_t entry_size = _fat_type == FAT_TYPE_FAT16 ? 2 : 4;
+    uint32_t offset = n * entry_size;
+
+    if (!_card.readRaw(_fat_start_sector + offset / 512, buf, 1)) return false;
+
+    const uint8_t *p = buf + offset % 512;
+    if (_fat_type == FAT_TYPE_FAT16) {
+        *v = get16(p);
+    } else if (_fat_type == FAT_TYPE_FAT32) {
+        *v = get32(p) & 0x0FFFFFFF;
+    } else {
+        *v = get32(p);
+    }
+    return true;
+}
+
+bool SdFs::_is_eoc(uint32_t cluster) const {
+    if (_fat_type == FAT_TYPE_FAT16) return cluster >= 0xFFF8;
+    if (_fat_type == FAT_TYPE_FAT32) return cluster >= 0x0FFFFFF8;
+    return cluster == 0xFFFFFFFF;
+}
+
+int8_t SdFs::dbgFat(uint32_t n, uint32_t *v) {
+    if (n < 2 || n > _cluster_count + 1) return -1;
+
+    // the volume keeps FAT sectors in its cache, so a lookup is charged as a cheap access
+    hal_advance_us(1);
+
+    uint32_t next;
+    if (!_fat_get(n, &next)) return -1;
+    *v = next;
+    if (_is_eoc(next)) return 0;
+    if (next < 2 || next > _cluster_count + 1) return -1;
+    return 1;
+}
+
+void SdFs::printFatType(print_t *pr) {
+    if (_fat_type == FAT_TYPE_EXFAT) {
+        pr->println("exFat");
+    } else {
+        pr->print("FAT");
+        pr->println((unsigned int)_fat_type);
+    }
+}
+
+bool SdFs::exists(const char *path) {
+    SdDirEntry entry;
+    return find(path, &entry);
+}
+
+bool SdFs::find(const char *path, SdDirEntry *entry) {
+    while (*path == '/') path++;
+    if (!*path || strchr(path, '/')) return false;
+
+    char name[256];
+    uint32_t pos = 0;
+    while (dirNext(&pos, entry, name, sizeof(name))) {
+        if (!entry->is_dir && name_equals(path, name)) return true;
+    }
+    return false;
+}
+
+bool SdFs::dirNext(uint32_t *pos, SdDirEntry *entry, char *name, size_t size) {
+    return _fat_type == FAT_TYPE_EXFAT ? _next_exfat(pos, entry, name, size) : _next_fat(pos, entry, name, size);
+}
+
+bool SdFs::_dir_sector(uint32_t index, uint32_t *sector) {
+    if (!_root_cluster) {
+        // FAT16 fixed root directory
+        if (index >= _root_sectors) return false;
+        *sector = _root_start_sector + index;
+        return true;
+    }
+
+    uint32_t cluster = _root_cluster;
+    for (uint32_t i = index >> _sectors_per_cluster_shift; i > 0; --i) {
+        if (dbgFat(cluster, &cluster) != 1) return false;
+    }
+    *sector = clusterStartSector(cluster) + (index & (sectorsPerCluster() - 1));
+    return true;
+}
+
+static void copy_name(char *dst, size_t size, const char *src) {
+    if (size == 0) return;
+    strncpy(dst, src, size - 1);
+    dst[size - 1] = 0;
+}
+
+bool SdFs::_next_fat(uint32_t *pos, SdDirEntry *entry, char *name, size_t size) {
+    uint8_t buf[512];
+    char long_name[256];
+    bool has_long_name = false;
+
+    // directory sectors are read through the card like any other, so a scan costs virtual time
+    uint32_t loaded = 0xFFFFFFFF;
+    for (uint32_t i = *pos;; ++i) {
+        uint32_t sector_index = i / 16;
+        if (sector_index != loaded) {
+            uint32_t sector;
+            if (!_dir_sector(sector_index, &sector) || !_card.readSector(sector, buf)) return false;
+            loaded = sector_index;
+        }
+
+        const uint8_t *de = buf + (i % 16) * 32;
+        uint8_t attr = de[11];
+
+        if (de[0] == 0x00) return false;
+        if (de[0] == 0xE5) {
+            has_long_name = false;
+            continue;
+        }
+
+        if (attr == 0x0F) {
+            // long name fragments are stored last first, 13 UTF-16 characters each
+            uint8_t ord = de[0] & 0x1F;
+            if (de[0] & 0x40) {
+                memset(long_name, 0, sizeof(long_name));
+                has_long_name = true;
+            }
+            static const uint8_t offsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+            for (uint8_t c = 0; c < 13 && ord > 0; ++c) {
+                uint32_t p = (ord - 1) * 13 + c;
+                uint16_t ch = get16(de + offsets[c]);
+                if (p < sizeof(long_name) - 1 && ch != 0xFFFF) {
+                    long_name[p] = ch < 0x80 ? (char)ch : '?';
+                }
+            }
+            continue;
+        }
+
+        if (attr & 0x08) {
+            has_long_name = false;
+            continue;
+        }
+
+        char short_name[13];
+        uint8_t n = 0;
+        for (uint8_t c = 0; c < 8 && de[c] != ' '; ++c) short_name[n++] = de[c];
+        if (de[8] != ' ') {
+            short_name[n++] = '.';
+            for (uint8_t c = 8; c < 11 && de[c] != ' '; ++c) short_name[n++] = de[c];
+        }
+        short_name[n] = 0;
+
+        // skip the dot entries of subdirectories
+        if (short_name[0] == '.') {
+            has_long_name = false;
+            continue;
+        }
+
+        copy_name(name, size, has_long_name ? long_name : short_name);
+        entry->first_cluster = ((uint32_t)get16(de + 20) << 16) | get16(de + 26);
+        entry->size = get32(de + 28);
+        entry->no_fat_chain = false;
+        entry->is_dir = attr & 0x10;
+        *pos = i + 1;
+        return true;
+    }
+}
+
+bool SdFs::_next_exfat(uint32_t *pos, SdDirEntry *entry, char *name, size_t size) {
+    uint8_t buf[512];
+    char file_name[256];
+    uint8_t name_length = 0, name_pos = 0;
+    uint8_t secondary_left = 0;
+    bool is_dir = false;
+    SdDirEntry found;
+
+    uint32_t loaded = 0xFFFFFFFF;
+    for (uint32_t i = *pos;; ++i) {
+        uint32_t sector_index = i / 16;
+        if (sector_index != loaded) {
+            uint32_t sector;
+            if (!_dir_sector(sector_index, &sector) || !_card.readSector(sector, buf)) return false;
+            loaded = sector_index;
+        }
+
+        const uint8_t *de = buf + (i % 16) * 32;
+        uint8_t type = de[0];
+
+        if (type == 0x00) return false;
+
+        if (type == 0x85) {
+            // file entry, followed by a stream extension and name entries
+            secondary_left = de[1];
+            is_dir = get16(de + 4) & 0x10;
+            name_pos = 0;
+            continue;
+        }
+
+        if (secondary_left == 0) continue;
+        secondary_left--;
+
+        if (type == 0xC0) {
+            found.no_fat_chain = de[1] & 0x02;
+            name_length = de[3];
+            found.first_cluster = get32(de + 20);
+            found.size = get64(de + 24);
+        } else if (type == 0xC1) {
+            for (uint8_t c = 0; c < 15 && name_pos < name_length; ++c) {
+                uint16_t ch = get16(de + 2 + 2 * c);
+                file_name[name_pos++] = ch < 0x80 ? (char)ch : '?';
+            }
+        }
+
+        if (secondary_left == 0) {
+            file_name[name_pos] = 0;
+            copy_name(name, size, file_name);
+            found.is_dir = is_dir;
+            *entry = found;
+            *pos = i + 1;
+            return true;
+        }
+    }
+}
+
+// -- FsFile
+
+bool FsFile::open(const char *path, oflag_t oflag) {
+    return open(SdFs::cwv(), path, oflag);
+}
+
+bool FsFile::open(SdFs *vol, const char *path, oflag_t oflag) {
+    if ((oflag & O_ACCMODE) != O_RDONLY) return false;
+
+    close();
+    if (!vol) return false;
+
+    // only the root directory can be opened as a directory
+    if (strcmp(path, "/") == 0) {
+        memset(&_entry, 0, sizeof(_entry));
+        _entry.is_dir = true;
+        copy_name(_name, sizeof(_name), "/");
+    } else {
+        if (!vol->find(path, &_entry)) return false;
+        while (*path == '/') path++;
+        copy_name(_name, sizeof(_name), path);
+    }
+
+    _vol = vol;
+    _position = 0;
+    return true;
+}
+
+bool FsFile::openNext(FsFile *dir, oflag_t oflag) {
+    if ((oflag & O_ACCMODE) != O_RDONLY) return false;
+
+    close();
+    if (!dir || !dir->isOpen() || !dir->isDir()) return false;
+
+    // the directory's position is its entry index
+    uint32_t pos = (uint32_t)dir->_position;
+    if (!dir->_vol->dirNext(&pos, &_entry, _name, sizeof(_name))) return false;
+    dir->_position = pos;
+
+    _vol = dir->_vol;
+    _position = 0;
+    return true;
+}
+
+size_t FsFile::getName(char *name, size_t size) {
+    if (!_vol || size == 0) return 0;
+    copy_name(name, size, _name);
+    return strlen(name);
+}
+
+bool FsFile::close() {
+    _vol = NULL;
+    return true;
+}
+
+uint32_t FsFile::firstSector() const {
+    if (!_vol || _entry.first_cluster < 2) return 0;
+    return _vol->clusterStartSector(_entry.first_cluster);
+}
+
+bool FsFile::isContiguous() {
+    uint32_t b, e;
+    return contiguousRange(&b, &e);
+}
+
+bool FsFile::contiguousRange(uint32_t *bgnSector, uint32_t *endSector) {
+    if (!_vol || _entry.first_cluster < 2 || _entry.size == 0) return false;
+
+    uint32_t clusters = (uint32_t)((_entry.size + _vol->bytesPerCluster() - 1) / _vol->bytesPerCluster());
+
+    if (!_entry.no_fat_chain) {
+        uint32_t cluster = _entry.first_cluster;
+        for (uint32_t i = 1; i < clusters; ++i) {
+            uint32_t next;
+            if (_vol->dbgFat(cluster, &next) != 1 || next != cluster + 1) return false;
+            cluster = next;
+        }
+    }
+
+    if (bgnSector) *bgnSector = firstSector();
+    if (endSector) *endSector = firstSector() + (clusters << _vol->sectorsPerClusterShift()) - 1;
+    return true;
+}
+
+bool FsFile::seekSet(uint64_t pos) {
+    if (!_vol || pos > _entry.size) return false;
+    _position = pos;
+    return true;
+}
+
+int FsFile::read(void *buf, size_t count) {
+    if (!_vol) return -1;
+
+    uint8_t sector_buf[512];
+    uint8_t *dst = (uint8_t *)buf;
+    size_t done = 0;
+
+    uint32_t cluster = _entry.first_cluster;
+    uint32_t cluster_index = 0;
+
+    while (done < count && _position < _entry.size) {
+        uint64_t file_sector = _position / 512;
+        uint32_t target_cluster = (uint32_t)(file_sector >> _vol->sectorsPerClusterShift());
+
+        if (_entry.no_fat_chain) {
+            cluster = _entry.first_cluster + target_cluster;
+        } else {
+            if (target_cluster < cluster_index) {
+                cluster = _entry.first_cluster;
+                cluster_index = 0;
+            }
+            while (cluster_index < target_cluster) {
+                if (_vol->dbgFat(cluster, &cluster) != 1) return -1;
+                cluster_index++;
+            }
+        }
+
+        uint32_t sector = _vol->clusterStartSector(cluster)
+            + (uint32_t)(file_sector & (_vol->sectorsPerCluster() - 1));
+        if (!_vol->card()->readSector(sector, sector_buf)) return -1;
+
+        uint32_t offset = (uint32_t)(_position % 512);
+        size_t n = min((size_t)(512 - offset), count - done);
+        n = (size_t)min((uint64_t)n, _entry.size - _position);
+        memcpy(dst + done, sector_buf + offset, n);
+
+        done += n;
+        _position += n;
+    }
+
+    return (int)done;
+}
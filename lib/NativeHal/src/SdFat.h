@@ -0,0 +1,182 @@
+#ifndef NATIVE_SDFAT_H_
+#define NATIVE_SDFAT_H_
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <fcntl.h>
+
+/**
+ * Image-backed stand-in for the parts of SdFat the player uses. The card is a raw disk image
+ * (whole card with an MBR, or a bare volume) holding a FAT16, FAT32 or exFAT file system.
+ * Only the root directory is searched or listed, and files are read-only. Reads cost virtual time
+ * according to SIM_SD_ACCESS_US / SIM_SD_SECTOR_US.
+ */
+
+#define SD_FAT_VERSION_STR "2.2.3-native"
+
+#define FAT_TYPE_FAT12 12
+#define FAT_TYPE_FAT16 16
+#define FAT_TYPE_FAT32 32
+#define FAT_TYPE_EXFAT 64
+
+#define DATA_START_SECTOR 0XFE
+
+#define DEDICATED_SPI 1
+#define SHARED_SPI 0
+#define SD_SCK_MHZ(maxMhz) (1000000UL * (maxMhz))
+
+typedef int oflag_t;
+#define FILE_READ O_RDONLY
+
+typedef Print print_t;
+
+struct SdSpiConfig {
+    SdSpiConfig(uint8_t cs, uint8_t opt, uint32_t maxSck) : csPin(cs), options(opt), maxSck(maxSck) {}
+    uint8_t csPin;
+    uint8_t options;
+    uint32_t maxSck;
+};
+
+inline bool isSpi(SdSpiConfig cfg) {
+    (void)cfg;
+    return true;
+}
+
+class SdCard {
+public:
+    bool begin(const char *path);
+    void end();
+
+    uint32_t sectorCount() const { return _sector_count; }
+
+    bool readSector(uint32_t sector, uint8_t *dst) { return readSectors(sector, dst, 1); }
+    bool readSectors(uint32_t sector, uint8_t *dst, size_t ns);
+
+    /** Multi-block streaming, as with CMD18 / CMD12 */
+    bool readStart(uint32_t sector);
+    bool readData(uint8_t *dst);
+    bool readStop();
+
+    /** Read without charging virtual time, for host-side bookkeeping */
+    bool readRaw(uint32_t sector, uint8_t *dst, size_t ns);
+
+    /** The byte on the bus for one clocked in, a stream sends each sector as a start token, data and CRC */
+    uint8_t spiExchange(uint8_t out);
+
+private:
+    enum SpiPhase { SPI_IDLE, SPI_GAP, SPI_DATA, SPI_CRC };
+
+    void _load_stream_sector();
+
+    FILE *_image = NULL;
+    uint32_t _sector_count = 0;
+    bool _streaming = false;
+    uint32_t _stream_sector = 0;
+
+    SpiPhase _spi_phase = SPI_IDLE;
+    uint32_t _spi_left = 0;
+    uint8_t _spi_sector[512];
+    uint16_t _spi_pos = 0;
+    uint16_t _spi_crc = 0;
+};
+
+/** Directory entry resolved from the image */
+struct SdDirEntry {
+    uint32_t first_cluster;
+    uint64_t size;
+    // exFAT NoFatChain, the clusters are allocated contiguously and not recorded in the FAT
+    bool no_fat_chain;
+    bool is_dir;
+};
+
+class SdFs {
+public:
+    bool begin(SdSpiConfig cfg);
+    bool volumeBegin();
+    void end();
+
+    bool exists(const char *path);
+
+    SdCard *card() { return &_card; }
+
+    uint8_t fatType() const { return _fat_type; }
+    uint32_t sectorsPerCluster() const { return 1ul << _sectors_per_cluster_shift; }
+    uint8_t sectorsPerClusterShift() const { return _sectors_per_cluster_shift; }
+    uint32_t bytesPerCluster() const { return SD_SECTOR_BYTES << _sectors_per_cluster_shift; }
+    uint32_t clusterCount() const { return _cluster_count; }
+    uint32_t fatStartSector() const { return _fat_start_sector; }
+    uint32_t dataStartSector() const { return _data_start_sector; }
+
+    /** Read FAT entry n: 1 with the next cluster in *v, 0 at end of chain, -1 on error */
+    int8_t dbgFat(uint32_t n, uint32_t *v);
+
+    void printFatType(print_t *pr);
+
+    /** Host-side helpers for FsFile */
+    bool find(const char *path, SdDirEntry *entry);
+    /** Root directory entry at or after *pos, *pos is advanced past it */
+    bool dirNext(uint32_t *pos, SdDirEntry *entry, char *name, size_t size);
+    uint32_t clusterStartSector(uint32_t cluster) const {
+        return _data_start_sector + ((cluster - 2) << _sectors_per_cluster_shift);
+    }
+
+    static SdFs *cwv() { return _cwv; }
+
+private:
+    static const uint32_t SD_SECTOR_BYTES = 512;
+
+    bool _fat_get(uint32_t n, uint32_t *v);
+    bool _is_eoc(uint32_t cluster) const;
+    bool _dir_sector(uint32_t index, uint32_t *sector);
+    bool _next_fat(uint32_t *pos, SdDirEntry *entry, char *name, size_t size);
+    bool _next_exfat(uint32_t *pos, SdDirEntry *entry, char *name, size_t size);
+
+    static SdFs *_cwv;
+
+    SdCard _card;
+    uint8_t _fat_type = 0;
+    uint8_t _sectors_per_cluster_shift = 0;
+    uint32_t _volume_start = 0;
+    uint32_t _fat_start_sector = 0;
+    uint32_t _data_start_sector = 0;
+    uint32_t _cluster_count = 0;
+    uint32_t _root_cluster = 0;
+    // FAT16 fixed root directory region
+    uint32_t _root_start_sector = 0;
+    uint32_t _root_sectors = 0;
+};
+
+class SdFat32 : public SdFs {};
+class SdExFat : public SdFs {};
+
+class FsFile {
+public:
+    bool open(const char *path, oflag_t oflag = FILE_READ);
+    bool open(SdFs *vol, const char *path, oflag_t oflag = FILE_READ);
+    /** Open the next entry of an open directory */
+    bool openNext(FsFile *dir, oflag_t oflag = FILE_READ);
+    bool close();
+
+    bool isOpen() const { return _vol != NULL; }
+    bool isDir() const { return isOpen() && _entry.is_dir; }
+    size_t getName(char *name, size_t size);
+    operator bool() const { return isOpen(); }
+
+    uint64_t fileSize() const { return _entry.size; }
+    uint64_t curPosition() const { return _position; }
+    uint32_t firstSector() const;
+    bool isContiguous();
+    bool contiguousRange(uint32_t *bgnSector, uint32_t *endSector);
+
+    bool seekSet(uint64_t pos);
+    int read(void *buf, size_t count);
+
+private:
+    SdFs *_vol = NULL;
+    SdDirEntry _entry;
+    // byte position for files, entry index for directories
+    uint64_t _position = 0;
+    char _name[256];
+};
+
+#endif // NATIVE_SDFAT_H_
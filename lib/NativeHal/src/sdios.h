@@ -0,0 +1,78 @@
+#ifndef NATIVE_SDIOS_H_
+#define NATIVE_SDIOS_H_
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <type_traits>
+
+/** Subset of the SdFat ostream used for logging: strings, chars, integers, pointers and hex/dec */
+class ArduinoOutStream {
+public:
+    typedef ArduinoOutStream &(*manipulator)(ArduinoOutStream &);
+
+    explicit ArduinoOutStream(Print &pr) : _pr(&pr) {}
+
+    ArduinoOutStream &operator<<(manipulator m) { return m(*this); }
+
+    ArduinoOutStream &operator<<(const char *str) {
+        _pr->write(str);
+        return *this;
+    }
+
+    ArduinoOutStream &operator<<(const __FlashStringHelper *str) {
+        return *this << (const char *)str;
+    }
+
+    ArduinoOutStream &operator<<(char c) {
+        _pr->write((uint8_t)c);
+        return *this;
+    }
+
+    ArduinoOutStream &operator<<(signed char c) { return *this << (char)c; }
+    ArduinoOutStream &operator<<(unsigned char c) { return *this << (char)c; }
+
+    ArduinoOutStream &operator<<(bool b) { return *this << (b ? 1u : 0u); }
+
+    ArduinoOutStream &operator<<(const void *ptr) {
+        char buf[24];
+        snprintf(buf, sizeof(buf), "0X%llX", (unsigned long long)(uintptr_t)ptr);
+        return *this << buf;
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, ArduinoOutStream &>::type
+    operator<<(T value) {
+        char buf[24];
+        if (_hex) {
+            snprintf(buf, sizeof(buf), _uppercase ? "%llX" : "%llx", (unsigned long long)value);
+        } else if (std::is_signed<T>::value || std::is_enum<T>::value) {
+            snprintf(buf, sizeof(buf), "%lld", (long long)value);
+        } else {
+            snprintf(buf, sizeof(buf), "%llu", (unsigned long long)value);
+        }
+        return *this << buf;
+    }
+
+    ArduinoOutStream &operator<<(double value) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.2f", value);
+        return *this << buf;
+    }
+
+    void set_hex(bool hex) { _hex = hex; }
+    void set_uppercase(bool uppercase) { _uppercase = uppercase; }
+
+private:
+    Print *_pr;
+    bool _hex = false;
+    bool _uppercase = false;
+};
+
+inline ArduinoOutStream &endl(ArduinoOutStream &s) { return s << '\n'; }
+inline ArduinoOutStream &flush(ArduinoOutStream &s) { return s; }
+inline ArduinoOutStream &hex(ArduinoOutStream &s) { s.set_hex(true); return s; }
+inline ArduinoOutStream &dec(ArduinoOutStream &s) { s.set_hex(false); return s; }
+inline ArduinoOutStream &uppercase(ArduinoOutStream &s) { s.set_uppercase(true); return s; }
+inline ArduinoOutStream &nouppercase(ArduinoOutStream &s) { s.set_uppercase(false); return s; }
+
+#endif // NATIVE_SDIOS_H_
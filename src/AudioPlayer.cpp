@@ -2,7 +2,9 @@
 #include <Adafruit_ZeroDMA.h>
 
 #include "io.h"
+#include "Log.h"
 #include "AudioPlayer.h"
+#include "LatencyHistogram.h"
 
 #define CPU_HZ 48000000
 
@@ -20,11 +22,22 @@ void AudioPlayer_::_static_dma_callback(Adafruit_ZeroDMA *dma)
     AudioPlayer._handle_dma_callback(dma);
 }
 
+void AudioPlayer_::_static_dma_error_callback(Adafruit_ZeroDMA *dma)
+{
+    AudioPlayer._handle_dma_error(dma);
+}
+
+void AudioPlayer_::_static_dma_suspend_callback(Adafruit_ZeroDMA *dma)
+{
+    AudioPlayer._handle_dma_suspend(dma);
+}
+
 AudioPlayer_::AudioPlayer_() {}
 
 bool AudioPlayer_::init(uint32_t bits)
 {
     analogWriteResolution(bits);
+    _bias = 1 << (bits - 1);
 
     if (!_allocate_dac_dma())
     {
@@ -52,102 +65,276 @@ bool AudioPlayer_::_allocate_dac_dma()
 
     _dma_dac.setTrigger(TC5_DMAC_ID_OVF);
     _dma_dac.setAction(DMA_TRIGGER_ACTON_BEAT);
-    
-    _dmac_dac_tx = _dma_dac.addDescriptor(
-        NULL,
+
+    // the first descriptor is rewritten before every start, see start() and _conceal()
+    _dmac_lead = _dma_dac.addDescriptor(
+        _fade,
         (void *)(&DAC->DATA.reg),
-        0,
+        AUDIO_FADE_SAMPLES,
         DMA_BEAT_SIZE_HWORD,
         true,
         false);
-    _dmac_dac_tx->BTCTRL.reg |= DMAC_BTCTRL_BLOCKACT_INT;
-    if (!_dmac_dac_tx) {
+    if (!_dmac_lead) {
+        cout << F("FATAL: Failed to add DMA descriptor") << endl;
+        return false;
+    }
+
+    // each queue block gets a fixed descriptor, only its length changes per block
+    for (uint8_t i = 0; i < AUDIO_QUEUE_DEPTH; ++i) {
+        _dmac_dac_tx[i] = _dma_dac.addDescriptor(
+            _queue.block(i),
+            (void *)(&DAC->DATA.reg),
+            AUDIO_BLOCK_SAMPLES,
+            DMA_BEAT_SIZE_HWORD,
+            true,
+            false);
+        if (!_dmac_dac_tx[i]) {
+            cout << F("FATAL: Failed to add DMA descriptor") << endl;
+            return false;
+        }
+
+        _dmac_dac_tx[i]->BTCTRL.reg |= DMAC_BTCTRL_BLOCKACT_INT;
+        _dmac_dac_tx[i]->BTCTRL.bit.VALID = 0;
+    }
+
+    _dmac_conceal = _dma_dac.addDescriptor(
+        &_conceal_level,
+        (void *)(&DAC->DATA.reg),
+        AUDIO_CONCEAL_SAMPLES,
+        DMA_BEAT_SIZE_HWORD,
+        false,
+        false);
+    if (!_dmac_conceal) {
         cout << F("FATAL: Failed to add DMA descriptor") << endl;
         return false;
     }
 
-    _dma_dac.loop(true);
+    // link the blocks in a ring, the lead and concealment descriptors are linked in as needed
+    for (uint8_t i = 0; i < AUDIO_QUEUE_DEPTH; ++i) {
+        _dmac_dac_tx[i]->DESCADDR.reg = (uintptr_t)_dmac_dac_tx[(i + 1) % AUDIO_QUEUE_DEPTH];
+    }
+    _dmac_conceal->DESCADDR.reg = (uintptr_t)_dmac_conceal;
+
     _dma_dac.setCallback(AudioPlayer_::_static_dma_callback);
+    _dma_dac.setCallback(AudioPlayer_::_static_dma_error_callback, DMA_CALLBACK_TRANSFER_ERROR);
+    _dma_dac.setCallback(AudioPlayer_::_static_dma_suspend_callback, DMA_CALLBACK_CHANNEL_SUSPEND);
 
     return true;
 }
 
-void AudioPlayer_::_setup_dac_dma(const int16_t *samples, uint32_t num_samples)
+void AudioPlayer_::start(uint32_t sample_rate)
 {
-    _dma_dac.abort();
+    LOG_INFO("AudioPlayer: Starting playback at sample rate %uHz", sample_rate);
 
-    _dma_dac.changeDescriptor(
-        _dmac_dac_tx,
-        (void *)samples,
-        (void *)(&DAC->DATA.reg),
-        num_samples);
-}
-
-void AudioPlayer_::start(uint32_t sample_rate, const int16_t *samples, uint32_t num_samples)
-{
-    cout << F("AudioPlayer: Starting playback at sample rate ") << sample_rate << F("Hz") << endl;
+    if (_queue.empty()) {
+        LOG_ERROR("AudioPlayer: Nothing queued to play");
+        return;
+    }
 
     startTimer(sample_rate);
-    _setup_dac_dma((const int16_t *)samples, num_samples);
 
-    _next_num_samples = 0;
-    _audio_samples_ptr = NULL;
-    _stop_playing = false;
+    _sample_rate = sample_rate;
+    _block_start_time = micros();
+    _draining = false;
+    _concealing = false;
+    _resumed = false;
     _is_playing = true;
 
+    // the channel starts from the lead descriptor, so have it play the front block and carry on
+    // into the ring after it. descriptors can't be assigned, the registers are volatile
+    uint8_t front = _queue.read_slot();
+    DmacDescriptor *desc = _dmac_dac_tx[front];
+    _dmac_lead->BTCTRL.reg = desc->BTCTRL.reg;
+    _dmac_lead->BTCNT.reg = desc->BTCNT.reg;
+    _dmac_lead->SRCADDR.reg = desc->SRCADDR.reg;
+    _dmac_lead->DESCADDR.reg = (uintptr_t)_dmac_dac_tx[(front + 1) % AUDIO_QUEUE_DEPTH];
+
     _dma_dac.startJob();
 }
 
 bool AudioPlayer_::ready()
 {
-    return _is_playing && !_stop_playing && _next_num_samples == 0;
+    return _is_playing && !_queue.full();
+}
+
+int16_t *AudioPlayer_::next_block()
+{
+    return _queue.write_block();
 }
 
-void AudioPlayer_::enqueue(const int16_t *samples, uint32_t num_samples)
+void AudioPlayer_::enqueue(uint32_t num_samples)
 {
-    // do nothing if we've been told to stop playing
-    if (_stop_playing)
+    if (num_samples == 0)
         return;
 
+    // the later a block arrives, the less is left for the DAC. blocks queued before playback
+    // starts have all the time in the world
+    if (_is_playing) hot_path.slack.record(_slack_us());
+
+    // arm the slot's descriptor before publishing it, the DMAC may fetch it any time after VALID is set
+    const int16_t *samples = _queue.write_block();
+    DmacDescriptor *desc = _dmac_dac_tx[_queue.write_slot()];
+    desc->BTCNT.bit.BTCNT = num_samples;
+    desc->SRCADDR.bit.SRCADDR = (uintptr_t)(samples + num_samples);
+    desc->BTCTRL.bit.VALID = 1;
+    _last_sample = (uint16_t)samples[num_samples - 1];
+
+    _queue.push(num_samples);
+
+    // the DAC ran dry and is playing concealment, send it back to the blocks. every block queued
+    // while concealing relinks, which also catches a block that slipped in as the DAC ran dry
+    noInterrupts();
+    if (_concealing) _resume();
+    interrupts();
+}
+
+void AudioPlayer_::finish()
+{
     noInterrupts();
-    _audio_samples_ptr = samples;
-    _next_num_samples = num_samples;
+    _draining = true;
+    if (_concealing) {
+        if (_queue.empty()) {
+            // the stream ended while the DAC was waiting on it
+            _dma_dac.abort();
+            _concealing = false;
+            _is_playing = false;
+        } else {
+            _resume();
+        }
+    }
     interrupts();
 }
 
+void AudioPlayer_::_resume()
+{
+    // the DMAC reads the link when it fetches the concealment descriptor again, so the front block
+    // starts after the current pass
+    _dmac_conceal->DESCADDR.reg = (uintptr_t)_dmac_dac_tx[_queue.read_slot()];
+    _resumed = true;
+    _block_start_time = micros();
+}
+
+uint32_t AudioPlayer_::_slack_us()
+{
+    uint32_t played = micros() - _block_start_time;
+    uint32_t queued = (uint32_t)((uint64_t)_queue.queued_samples() * 1000000 / _sample_rate);
+    return queued > played ? queued - played : 0;
+}
+
 void AudioPlayer_::stop() {
-    _stop_playing = true;
     _is_playing = false;
     _dma_dac.abort();
+
+    SampleQueueStats stats = _queue.stats();
+    if (stats.high_water > 0) {
+        LOG_INFO("AudioPlayer: queue occupancy low %u high %u of %u blocks", stats.low_water, stats.high_water, AUDIO_QUEUE_DEPTH);
+    }
+
+    if (_underruns > 0) {
+        LOG_WARN("AudioPlayer: %u underruns, concealed %u samples", _underruns, _concealed_samples);
+    }
+    _concealing = false;
+    _resumed = false;
+
+    // the DMA is stopped, so the queue has no consumer and can be emptied
+    for (uint8_t i = 0; i < AUDIO_QUEUE_DEPTH; ++i) {
+        _dmac_dac_tx[i]->BTCTRL.bit.VALID = 0;
+    }
+    _queue.reset();
 }
 
 void AudioPlayer_::_handle_dma_callback(Adafruit_ZeroDMA *dma)
 {
     (void)dma;
 
-    // take the next command
-    uint32_t num_samples;
-    int16_t *samples;
-    noInterrupts();
-    num_samples = _next_num_samples;
-    samples = (int16_t *)_audio_samples_ptr;
-    _audio_samples_ptr = 0;
-    _next_num_samples = 0;
-    interrupts();
+    if (_queue.empty())
+        return;
 
+    // the DMAC has already moved on to the next descriptor, so just retire the one that finished
+    _dmac_dac_tx[_queue.read_slot()]->BTCTRL.bit.VALID = 0;
+
+    if (_resumed) {
+        // the first block after an underrun, which took over from the concealment its own length ago
+        uint32_t num_samples = 0;
+        _queue.front(&num_samples);
+        uint32_t elapsed = (uint32_t)((uint64_t)(micros() - _underrun_time) * _sample_rate / 1000000);
+        if (elapsed > num_samples) _concealed_samples += elapsed - num_samples;
+
+        _dmac_conceal->DESCADDR.reg = (uintptr_t)_dmac_conceal;
+        _concealing = false;
+        _resumed = false;
+    }
+
+    _queue.pop();
+    _block_start_time = micros();
+}
+
+void AudioPlayer_::_handle_dma_error(Adafruit_ZeroDMA *dma)
+{
+    (void)dma;
+
+    // a bus error, there's no telling what the DAC was sent
     _dma_dac.abort();
+    _concealing = false;
+    _is_playing = false;
+}
 
-    // actually stop playback if there are no more samples to play
-    if (num_samples == 0)
-    {
+void AudioPlayer_::_handle_dma_suspend(Adafruit_ZeroDMA *dma)
+{
+    (void)dma;
+
+    // the channel fetched a descriptor that wasn't queued yet and suspended itself (CHSTATUS.FERR).
+    // it stays enabled, so it has to be aborted before it can start from the lead descriptor again
+    _dma_dac.abort();
+
+    // once the stream has ended there are no more samples to play, before that the producer is late
+    if (_draining || _underrun_policy == AudioUnderrun::STOP) {
         _is_playing = false;
         return;
     }
 
-    // otherwise enqueue the next set of samples
-    _dmac_dac_tx->SRCADDR.bit.SRCADDR = (uint32_t)(samples + num_samples);
-    _dmac_dac_tx->BTCNT.bit.BTCNT = num_samples;
+    _underruns++;
+    _underrun_time = micros();
+    _conceal();
+}
+
+void AudioPlayer_::_conceal()
+{
+    // every queued block has played, so the newest one's last sample is the last the DAC played
+    uint16_t from = _last_sample;
+    uint32_t lead_samples = 1;
+
+    switch (_underrun_policy) {
+    case AudioUnderrun::FADE: {
+        // Q16 steps, so the ramp costs one divide
+        int32_t step = (int32_t)(((int32_t)_bias - from) * 65536) / AUDIO_FADE_SAMPLES;
+        int32_t level = (int32_t)from * 65536;
+        for (uint32_t i = 0; i < AUDIO_FADE_SAMPLES; ++i) {
+            level += step;
+            _fade[i] = (uint16_t)((level + 32768) >> 16);
+        }
+        lead_samples = AUDIO_FADE_SAMPLES;
+        _conceal_level = _bias;
+        break;
+    }
+    case AudioUnderrun::HOLD:
+        _fade[0] = from;
+        _conceal_level = from;
+        break;
+    default:
+        _fade[0] = _bias;
+        _conceal_level = _bias;
+        break;
+    }
+
+    // the lead descriptor plays the fade, then the concealment descriptor loops until _resume()
+    _dmac_lead->BTCTRL.reg = (_dmac_lead->BTCTRL.reg & ~DMAC_BTCTRL_BLOCKACT_BOTH) | DMAC_BTCTRL_BLOCKACT_NOACT;
+    _dmac_lead->BTCTRL.bit.VALID = 1;
+    _dma_dac.changeDescriptor(_dmac_lead, _fade, NULL, lead_samples);
+    _dmac_lead->DESCADDR.reg = (uintptr_t)_dmac_conceal;
+    _dmac_conceal->DESCADDR.reg = (uintptr_t)_dmac_conceal;
 
+    _concealing = true;
     _dma_dac.startJob();
 }
 
@@ -161,8 +348,7 @@ static void setTimerFrequency(int frequencyHz)
     // to prevent any jitter or disconnect when changing the compare value.
     TC->COUNT.reg = map(TC->COUNT.reg, 0, TC->CC[0].reg, 0, compareValue);
     TC->CC[0].reg = compareValue;
-    Serial.println(TC->COUNT.reg);
-    Serial.println(TC->CC[0].reg);
+    LOG_DEBUG("AudioPlayer: TC5 count %u, compare %u", TC->COUNT.reg, TC->CC[0].reg);
     while (TC->STATUS.bit.SYNCBUSY == 1)
         ;
 }
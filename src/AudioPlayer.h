@@ -4,6 +4,53 @@
 #include <stdint.h>
 #include <Adafruit_ZeroDMA.h>
 
+#include "SampleQueue.h"
+
+/** # of sample blocks queued between the WavePlayer and the DAC DMA, must be a power of 2 */
+#ifndef AUDIO_QUEUE_DEPTH
+#define AUDIO_QUEUE_DEPTH 4
+#endif
+
+/** Capacity of each queued block, in samples */
+#ifndef AUDIO_BLOCK_SAMPLES
+#define AUDIO_BLOCK_SAMPLES 1024
+#endif
+
+typedef SampleQueue<AUDIO_QUEUE_DEPTH, AUDIO_BLOCK_SAMPLES> AudioQueue;
+
+/** What the DAC plays when the queue runs dry before the end of the stream */
+enum class AudioUnderrun {
+    // end playback
+    STOP = 0,
+    // keep playing the last sample until data catches up
+    HOLD,
+    // ramp from the last sample to the DAC bias over AUDIO_FADE_SAMPLES, then stay there
+    FADE,
+    // jump straight to the DAC bias
+    SILENCE
+};
+
+#ifndef AUDIO_UNDERRUN_POLICY
+#define AUDIO_UNDERRUN_POLICY AudioUnderrun::FADE
+#endif
+
+/** Length of the AudioUnderrun::FADE ramp, in samples */
+#ifndef AUDIO_FADE_SAMPLES
+#define AUDIO_FADE_SAMPLES 256
+#endif
+
+/** Concealment is played in passes of this many samples, playback resumes within 2 of them of the next block being queued */
+#ifndef AUDIO_CONCEAL_SAMPLES
+#define AUDIO_CONCEAL_SAMPLES 128
+#endif
+
+typedef struct {
+    // # of times the queue ran dry while playing
+    uint32_t underruns;
+    // samples the DAC played while waiting for data, over every underrun
+    uint32_t concealed_samples;
+} AudioUnderrunStats;
+
 class AudioPlayer_ {
 public:
     static AudioPlayer_& getInstance();
@@ -13,29 +60,88 @@ public:
 
     bool is_playing() const { return _is_playing; }
 
-    void start(uint32_t sample_rate, const int16_t *samples, uint32_t sample_count);
+    /** Start playing whatever has been queued. Blocks must be queued before this is called */
+    void start(uint32_t sample_rate);
+    /** True when there's a free block to fill */
     bool ready();
-    void enqueue(const int16_t *samples, uint32_t sample_count);
+    /** The next free block to fill with at most AUDIO_BLOCK_SAMPLES samples, or NULL if the queue is full */
+    int16_t *next_block();
+    /** Queue the block from next_block() holding sample_count samples */
+    void enqueue(uint32_t sample_count);
+    /** Nothing more will be queued, so running dry is the end of playback rather than an underrun */
+    void finish();
     void stop();
 
+    SampleQueueStats queue_stats() const { return _queue.stats(); }
+
+    /** Bytes of the queue's blocks, see idle_blocks() */
+    static const uint32_t IDLE_BYTES = AUDIO_QUEUE_DEPTH * AUDIO_BLOCK_SAMPLES * sizeof(int16_t);
+    /**
+     * The queue's blocks as IDLE_BYTES of word aligned scratch, or NULL while anything plays or is
+     * queued. Whatever is kept there is overwritten by the next block queued.
+     */
+    uint8_t *idle_blocks() { return _is_playing || !_queue.empty() ? NULL : (uint8_t *)_queue.block(0); }
+
+    void set_underrun_policy(AudioUnderrun policy) { _underrun_policy = policy; }
+    /** Counters since boot */
+    AudioUnderrunStats underrun_stats() const { return { _underruns, _concealed_samples }; }
+
 private:
     static void _static_dma_callback(Adafruit_ZeroDMA*);
 
     AudioPlayer_();
     bool _allocate_dac_dma();
-    void _setup_dac_dma(const int16_t *samples, uint32_t num_samples);
-    void _start_timer();
+    static void _static_dma_error_callback(Adafruit_ZeroDMA*);
+    static void _static_dma_suspend_callback(Adafruit_ZeroDMA*);
 
     void _handle_dma_callback(Adafruit_ZeroDMA*);
+    void _handle_dma_error(Adafruit_ZeroDMA*);
+    /** The channel caught up with the producer, or the stream has ended */
+    void _handle_dma_suspend(Adafruit_ZeroDMA*);
+    /** How long the DAC can keep playing from what's queued, 0 if it has already run dry */
+    uint32_t _slack_us();
+    /** Keep the DAC fed from the concealment descriptors, from the suspend interrupt */
+    void _conceal();
+    /** Send the DAC from the concealment descriptors on to the front block */
+    void _resume();
     
     Adafruit_ZeroDMA _dma_dac;
-    DmacDescriptor *_dmac_dac_tx;
+    /**
+     * One descriptor per queue slot, linked in a ring. A descriptor is only VALID while its
+     * block is queued, so the channel runs straight from one block into the next and suspends
+     * with a fetch error if it catches up with the producer.
+     */
+    DmacDescriptor *_dmac_dac_tx[AUDIO_QUEUE_DEPTH];
+    /**
+     * The channel always starts from its first descriptor, so that one is set up to play
+     * whatever should come first: the front block when playback starts, or the fade after an
+     * underrun. The concealment descriptor after it replays _conceal_level and loops on itself
+     * until a block is queued, then links on to it.
+     */
+    DmacDescriptor *_dmac_lead;
+    DmacDescriptor *_dmac_conceal;
+    uint16_t _fade[AUDIO_FADE_SAMPLES] __attribute__ ((aligned (4)));
+    uint16_t _conceal_level;
+
+    // blocks waiting to play, the front block is the one the DMA is reading
+    AudioQueue _queue;
+
+    volatile bool _is_playing = false;
+    uint32_t _sample_rate;
+    uint16_t _bias;
 
-    volatile const int16_t* _audio_samples_ptr;
-    volatile uint32_t _next_num_samples;
-        
-    volatile bool _stop_playing = false;
-    volatile bool _is_playing = true;
+    AudioUnderrun _underrun_policy = AUDIO_UNDERRUN_POLICY;
+    // last sample of the newest block, which is the last to play before an underrun
+    uint16_t _last_sample;
+    volatile bool _draining = false;
+    // the DAC is playing concealment, and has been sent on to a block since
+    volatile bool _concealing = false;
+    volatile bool _resumed = false;
+    uint32_t _underrun_time;
+    volatile uint32_t _underruns = 0;
+    volatile uint32_t _concealed_samples = 0;
+    // when the front block started playing
+    volatile uint32_t _block_start_time;
 };
 
 extern AudioPlayer_ &AudioPlayer;
@@ -0,0 +1,33 @@
+#ifndef DAC_FILE_H_
+#define DAC_FILE_H_
+
+#include <stdint.h>
+
+/**
+ * DAC-ready audio container, written by tools/wav2dac from a WAV file.
+ *
+ * Sector 0 holds the header, the rest of the header sector is zero. Samples start on sector 1
+ * as little-endian uint16 DAC codes, already scaled and biased for dac_bits, so sectors can be
+ * read straight into a sample block and played without touching them. The file is zero padded
+ * to a whole # of sectors.
+ */
+
+#define DAC_FILE_MAGIC "DACW"
+#define DAC_FILE_VERSION 1
+/** Byte offset of the first sample */
+#define DAC_FILE_DATA_OFFSET 512
+
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    // DAC resolution the samples were scaled for, must match DAC_BITS
+    uint8_t dac_bits;
+    uint8_t reserved;
+    uint32_t sample_rate;
+    uint32_t num_samples;
+    // a looping file plays through to loop_end, then carries on from loop_start (both in samples)
+    uint32_t loop_start;
+    uint32_t loop_end;
+} __attribute__ ((packed)) DacFileHeader;
+
+#endif // DAC_FILE_H_
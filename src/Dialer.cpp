@@ -1,11 +1,13 @@
 #include <Arduino.h>
 
 #include "io.h"
+#include "Log.h"
 #include "Dialer.h"
 
 #define PULSE_TIMEOUT 350000
 #define PULSE_WIDTH_MIN 30000
 #define PULSE_WIDTH_MAX 90000
+#define PULSE_DEBOUNCE 5000
 
 DialerClass &DialerClass::getInstance()
 {
@@ -15,21 +17,71 @@ DialerClass &DialerClass::getInstance()
 
 DialerClass::DialerClass() {}
 
+void DialerClass::_static_pin_isr()
+{
+    Dialer._handle_pin_change();
+}
+
 bool DialerClass::init(uint32_t pin)
 {
     _pin = pin;
     pinMode(_pin, INPUT);
+    _last_val = digitalRead(_pin);
+
+    attachInterrupt(digitalPinToInterrupt(_pin), DialerClass::_static_pin_isr, CHANGE);
 
     cout << F("Dialer initialized on pin ") << pin << endl;
 
     return true;
 }
 
+void DialerClass::_handle_pin_change()
+{
+    uint32_t head = _edge_head.load(std::memory_order_relaxed);
+    if (head - _edge_tail.load(std::memory_order_acquire) >= DIALER_EDGE_QUEUE_DEPTH) {
+        // every edge carries its level, so decoding picks up again from the next one
+        _dropped_edges++;
+        return;
+    }
+
+    DialerEdge &edge = _edges[head & (DIALER_EDGE_QUEUE_DEPTH - 1)];
+    edge.time = micros();
+    edge.level = digitalRead(_pin);
+    _edge_head.store(head + 1, std::memory_order_release);
+}
+
 bool DialerClass::check_dialed(uint32_t *number)
 {
-    _check_change();
+    // take the edges queued so far before reading the time, so none of them is newer than now.
+    // an edge queued in between waits for the next call
+    uint32_t tail = _edge_tail.load(std::memory_order_relaxed);
+    uint32_t head = _edge_head.load(std::memory_order_acquire);
+    uint32_t now = micros();
+    for (; tail != head; ++tail) {
+        const DialerEdge &edge = _edges[tail & (DIALER_EDGE_QUEUE_DEPTH - 1)];
 
-    if (_last_tick_time > 0 && _ticks > 0 && micros() - _last_tick_time > PULSE_TIMEOUT) {
+        if (_bouncing && edge.time - _bounce_last >= PULSE_DEBOUNCE) {
+            _settle();
+        }
+        if (!_bouncing) {
+            _bouncing = true;
+            _bounce_start = edge.time;
+        }
+        _bounce_last = edge.time;
+        _bounce_level = edge.level;
+    }
+    _edge_tail.store(tail, std::memory_order_release);
+
+    if (_bouncing && now - _bounce_last >= PULSE_DEBOUNCE) {
+        _settle();
+    }
+
+    if (_dropped_edges > 0) {
+        LOG_WARN("Dialer: Dropped %u edges", _dropped_edges);
+        _dropped_edges = 0;
+    }
+
+    if (_last_tick_time > 0 && _ticks > 0 && now - _last_tick_time > PULSE_TIMEOUT) {
         *number = _ticks;
         _ticks = 0;
         return true;
@@ -38,31 +90,36 @@ bool DialerClass::check_dialed(uint32_t *number)
     return false;
 }
 
-void DialerClass::_check_change()
+void DialerClass::_settle()
 {
-    uint32_t val = digitalRead(_pin);
-    if (val != _last_val) {
-        // falling
-        if (_is_up && val == LOW)
-        {
-            _last_fall_time = micros();
-        }
+    _bouncing = false;
 
-        // set the latest rise time
-        else if (!_is_up && val == HIGH)
+    // a glitch that ends where it started isn't a change
+    if (_bounce_level != _last_val) {
+        _on_change(_bounce_level, _bounce_start);
+    }
+}
+
+void DialerClass::_on_change(uint32_t level, uint32_t time)
+{
+    // falling
+    if (level == LOW)
+    {
+        _last_fall_time = time;
+    }
+
+    // set the latest rise time
+    else
+    {
+        uint32_t pulse_width = time - _last_fall_time;
+        if (pulse_width > PULSE_WIDTH_MIN && pulse_width < PULSE_WIDTH_MAX)
         {
-            uint64_t time = micros();
-            uint64_t pulse_width = time - _last_fall_time;
-            if (pulse_width > PULSE_WIDTH_MIN && pulse_width < PULSE_WIDTH_MAX)
-            {
-                _last_tick_time = time;
-                _ticks++;
-            }
+            _last_tick_time = time;
+            _ticks++;
         }
-
-        _is_up = val == HIGH;
     }
-    _last_val = val;
+
+    _last_val = level;
 }
 
-DialerClass &Dialer = DialerClass::getInstance();
\ No newline at end of file
+DialerClass &Dialer = DialerClass::getInstance();
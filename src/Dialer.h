@@ -2,27 +2,61 @@
 #define DIALER_H_
 
 #include <stdint.h>
+#include <atomic>
+
+/** # of pin edges the interrupt can queue between check_dialed() calls, a power of 2 */
+#ifndef DIALER_EDGE_QUEUE_DEPTH
+#define DIALER_EDGE_QUEUE_DEPTH 32
+#endif
+
+/** A change on the dialer pin, and the level it changed to */
+typedef struct {
+    uint32_t time;
+    uint32_t level;
+} DialerEdge;
 
 class DialerClass {
+    static_assert((DIALER_EDGE_QUEUE_DEPTH & (DIALER_EDGE_QUEUE_DEPTH - 1)) == 0, "edge queue depth must be a power of 2");
+
 public:
     static DialerClass& getInstance();
     DialerClass(DialerClass&) = delete;
 
     bool init(uint32_t pin);
+    /** Decode the edges queued since the last call, true with the digit once the dial has returned */
     bool check_dialed(uint32_t* number);
 
 private:
     DialerClass();
 
-    void _check_change();
+    static void _static_pin_isr();
+    void _handle_pin_change();
+    /** The last burst of edges has been quiet long enough to count as one change */
+    void _settle();
+    void _on_change(uint32_t level, uint32_t time);
 
     uint32_t _pin;
+
+    /**
+     * Edges timestamped by the pin interrupt, so pulses are measured from when they happened
+     * rather than when loop() got around to looking. Single producer (the interrupt) and single
+     * consumer (check_dialed()), with free-running indices like SampleQueue.
+     */
+    DialerEdge _edges[DIALER_EDGE_QUEUE_DEPTH];
+    std::atomic<uint32_t> _edge_head{0};
+    std::atomic<uint32_t> _edge_tail{0};
+    volatile uint32_t _dropped_edges = 0;
+
+    // edges closer together than PULSE_DEBOUNCE are contact bounce, the burst takes the time of
+    // its first edge and the level of its last
+    bool _bouncing = false;
+    uint32_t _bounce_start, _bounce_last, _bounce_level;
+
     uint32_t _last_val = HIGH;
-    bool _is_up = true;
     uint8_t _ticks = 0;
-    uint64_t _last_tick_time = 0, _last_fall_time = 0;
+    uint32_t _last_tick_time = 0, _last_fall_time = 0;
 };
 
 extern DialerClass &Dialer; 
 
-#endif // DIALER_H_
\ No newline at end of file
+#endif // DIALER_H_
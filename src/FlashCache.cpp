@@ -0,0 +1,446 @@
+#include <Arduino.h>
+#include <string.h>
+
+#include "io.h"
+#include "Log.h"
+#include "FlashCache.h"
+
+#if USE_FLASH_CACHE
+
+// status register, a program or erase is in progress
+#define FLASH_STATUS_WIP 0x01
+
+static bool same_file(const FlashCacheEntry *entry, const TrackInfo *track) {
+    return entry->first_sector == track->first_sector && entry->data_size == track->format.data_size
+        && entry->sample_rate == track->format.sample_rate && entry->audio_format == track->format.audio_format;
+}
+
+FlashCache::FlashCache() : _transport(EXTERNAL_FLASH_USE_CS, EXTERNAL_FLASH_USE_SPI), _flash(&_transport) {
+    _copy.num_extents = 0;
+}
+
+bool FlashCache::begin(SdFs *sd, const TrackIndex *tracks) {
+    _sd = sd;
+    _tracks = tracks;
+    memset(_plays, 0, sizeof(_plays));
+
+    if (!_flash.begin()) {
+        cout << F("FlashCache: No flash, playing everything from the card") << endl;
+        return false;
+    }
+    if (!_copier.init()) {
+        cout << F("FlashCache: Failed to initialize the copier") << endl;
+        return false;
+    }
+
+    _num_sectors = min(_flash.size() / SFLASH_SECTOR_SIZE, (uint32_t)FLASH_CACHE_MAX_SECTORS);
+    _mounted = true;
+
+    // the later of the two directories that's intact
+    FlashCacheDirectory other;
+    bool valid = _read_directory(1);
+    memcpy(&other, &_dir, sizeof(_dir));
+    if (!_read_directory(0) || (valid && other.generation > _dir.generation)) {
+        if (valid) {
+            memcpy(&_dir, &other, sizeof(_dir));
+        } else {
+            clear();
+        }
+    }
+
+    // drop whatever was copied from files that have since changed or gone
+    for (uint8_t i = 0; i < _dir.num_entries;) {
+        bool found = false;
+        for (uint8_t t = 0; t < tracks->size() && !found; t++) {
+            found = same_file(&_dir.entries[i], tracks->at(t));
+        }
+        if (found) {
+            i++;
+        } else {
+            _evict(i);
+        }
+    }
+
+    cout << F("FlashCache: ") << (uint32_t)_dir.num_entries << F(" tracks in ") << _num_sectors * (SFLASH_SECTOR_SIZE / 1024)
+        << F("KB of flash") << endl;
+    return true;
+}
+
+bool FlashCache::_read_directory(uint8_t sector) {
+    _flash.readBuffer(sector * SFLASH_SECTOR_SIZE, (uint8_t *)&_dir, sizeof(_dir));
+    if (_dir.magic != FLASH_CACHE_MAGIC || _dir.version != FLASH_CACHE_VERSION || _dir.checksum != _checksum()) {
+        return false;
+    }
+    // samples for another DAC are no use
+    if (_dir.dac_bits != DAC_BITS || _dir.dac_rate != DAC_SAMPLE_RATE || _dir.num_entries > FLASH_CACHE_MAX_ENTRIES) {
+        return false;
+    }
+    for (uint8_t i = 0; i < _dir.num_entries; i++) {
+        const FlashCacheEntry *entry = &_dir.entries[i];
+        if (entry->num_extents > FLASH_CACHE_EXTENTS) return false;
+        for (uint8_t e = 0; e < entry->num_extents; e++) {
+            if (entry->extents[e].sector < FIRST_DATA_SECTOR || entry->extents[e].sector + entry->extents[e].num_sectors > _num_sectors) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+uint32_t FlashCache::_checksum() {
+    const uint8_t *bytes = (const uint8_t *)&_dir;
+    uint32_t sum = 0;
+    for (size_t i = 0; i < offsetof(FlashCacheDirectory, checksum); i++) {
+        sum = sum * 31 + bytes[i];
+    }
+    return sum;
+}
+
+void FlashCache::clear() {
+    if (!_mounted) return;
+
+    pause();
+    uint32_t generation = _dir.magic == FLASH_CACHE_MAGIC ? _dir.generation : 0;
+    memset(&_dir, 0, sizeof(_dir));
+    _dir.magic = FLASH_CACHE_MAGIC;
+    _dir.version = FLASH_CACHE_VERSION;
+    _dir.dac_bits = DAC_BITS;
+    _dir.dac_rate = DAC_SAMPLE_RATE;
+    _dir.generation = generation;
+    _playing = NULL;
+    _write_directory();
+}
+
+FlashCacheEntry *FlashCache::_find(const TrackInfo *track) {
+    for (uint8_t i = 0; i < _dir.num_entries; i++) {
+        if (same_file(&_dir.entries[i], track)) return &_dir.entries[i];
+    }
+    return NULL;
+}
+
+void FlashCache::_count(uint8_t *plays) {
+    if (*plays < 0xFF) {
+        (*plays)++;
+        return;
+    }
+
+    for (uint8_t i = 0; i < _dir.num_entries; i++) _dir.entries[i].plays /= 2;
+    for (uint8_t i = 0; i < TRACK_INDEX_MAX_TRACKS; i++) _plays[i] /= 2;
+    (*plays)++;
+}
+
+bool FlashCache::start(const TrackInfo *track, bool loop) {
+    if (!_mounted) return false;
+
+    FlashCacheEntry *entry = _find(track);
+    if (entry) {
+        _count(&entry->plays);
+        entry->used = ++_dir.clock;
+        // counts are only saved along with other changes, but a directory part written already is now out of date
+        if (_dir_page != NOT_WRITING) _write_directory();
+    } else {
+        // TrackInfo pointers come from the index
+        uint8_t index = 0;
+        while (index < _tracks->size() && _tracks->at(index) != track) index++;
+        if (index < _tracks->size()) {
+            _count(&_plays[index]);
+            _rescan = true;
+        }
+    }
+
+    // a copy's erase can take tens of ms, longer than reading the card
+    if (!entry || loop || (_flash.readStatus() & FLASH_STATUS_WIP)) {
+        _stats.misses++;
+        return false;
+    }
+
+    _stats.hits++;
+    _playing = entry;
+    _position = 0;
+    return true;
+}
+
+bool FlashCache::contains(const TrackInfo *track) {
+    return _mounted && _find(track);
+}
+
+uint32_t FlashCache::_address(const FlashCacheEntry *entry, uint32_t sample) {
+    uint32_t sector = sample / SECTOR_SAMPLES;
+    uint8_t e = 0;
+    while (e < entry->num_extents - 1 && sector >= entry->extents[e].num_sectors) {
+        sector -= entry->extents[e++].num_sectors;
+    }
+    return (entry->extents[e].sector + sector) * SFLASH_SECTOR_SIZE + (sample % SECTOR_SAMPLES) * sizeof(int16_t);
+}
+
+WavePlayerPoll FlashCache::poll(int16_t *samples, uint32_t max_samples, uint32_t *num_samples) {
+    if (!_playing) return WavePlayerPoll::ERROR;
+    if (_position >= _playing->num_samples) return WavePlayerPoll::DONE;
+
+    while (*num_samples < max_samples && _position < _playing->num_samples) {
+        // one read per flash sector, they aren't necessarily next to each other
+        uint32_t count = min(max_samples - *num_samples, _playing->num_samples - _position);
+        count = min(count, SECTOR_SAMPLES - _position % SECTOR_SAMPLES);
+
+        uint32_t bytes = count * sizeof(int16_t);
+        if (_flash.readBuffer(_address(_playing, _position), (uint8_t *)&samples[*num_samples], bytes) != bytes) {
+            LOG_ERROR("FlashCache: Read failed at sample %u", _position);
+            return WavePlayerPoll::ERROR;
+        }
+        *num_samples += count;
+        _position += count;
+    }
+    return WavePlayerPoll::FILLED;
+}
+
+void FlashCache::service() {
+    if (!_mounted || (_flash.readStatus() & FLASH_STATUS_WIP)) return;
+
+    if (_dir_page != NOT_WRITING) {
+        _directory_step();
+    } else if (_copy.num_extents) {
+        _copy_step();
+    } else if (_rescan) {
+        _start_copy();
+    }
+}
+
+void FlashCache::pause() {
+    if (!_copy.num_extents) return;
+
+    _copier.stop();
+    _copy.num_extents = 0;
+    // the track is still the most played, so it's tried again next time
+    _rescan = true;
+}
+
+uint32_t FlashCache::_max_samples(const TrackInfo *track) {
+    const WaveFormat *format = &track->format;
+    if (!format->sample_rate || !format->num_channels || !format->bits_per_sample) return UINT32_MAX;
+
+    // ADPCM block headers only make this an overestimate
+    uint64_t frames = (uint64_t)format->data_size * 8 / (format->bits_per_sample * format->num_channels);
+    // and the resampler can give one more
+    return (uint32_t)min(frames * DAC_SAMPLE_RATE / format->sample_rate + 2, (uint64_t)UINT32_MAX);
+}
+
+void FlashCache::_start_copy() {
+    _rescan = false;
+
+    // the uncached track played most
+    int16_t best = -1;
+    for (uint8_t i = 0; i < _tracks->size(); i++) {
+        if (_plays[i] < FLASH_CACHE_PROMOTE_PLAYS || (best >= 0 && _plays[i] <= _plays[best])) continue;
+        if (_find(_tracks->at(i)) || _max_samples(_tracks->at(i)) > FLASH_CACHE_MAX_SAMPLES) continue;
+        best = i;
+    }
+    if (best < 0) return;
+
+    const TrackInfo *track = _tracks->at(best);
+    uint16_t num_sectors = (_max_samples(track) + SECTOR_SAMPLES - 1) / SECTOR_SAMPLES;
+
+    memset(&_copy, 0, sizeof(_copy));
+    _playing = NULL;
+    // evicted tracks leave the directory before the copy overwrites their sectors, see service()
+    if (!_allocate(&_copy, num_sectors, _plays[best])) {
+        _copy.num_extents = 0;
+        return;
+    }
+
+    if (!_copier.start(_sd, track, false)) {
+        LOG_ERROR("FlashCache: Failed to start copying track %u", best);
+        _copy.num_extents = 0;
+        _plays[best] = 0;
+        return;
+    }
+
+    _copy.first_sector = track->first_sector;
+    _copy.data_size = track->format.data_size;
+    _copy.sample_rate = track->format.sample_rate;
+    _copy.audio_format = track->format.audio_format;
+    _copy_index = best;
+    _copy_sectors = num_sectors;
+    _copy_samples = 0;
+    _copy_erased = 0;
+    _page_samples = 0;
+    _copy_ended = false;
+}
+
+void FlashCache::_copy_step() {
+    if (!_copy_ended && _page_samples < PAGE_SAMPLES) {
+        switch (_copier.poll(_page, PAGE_SAMPLES, &_page_samples)) {
+        case WavePlayerPoll::PENDING:
+            return;
+        case WavePlayerPoll::FILLED:
+            // a short page holds the end of the track
+            _copy_ended = _page_samples < PAGE_SAMPLES;
+            break;
+        case WavePlayerPoll::DONE:
+            _copy_ended = true;
+            break;
+        default:
+            LOG_ERROR("FlashCache: Failed copying track %u", _copy_index);
+            _plays[_copy_index] = 0;
+            pause();
+            _rescan = false;
+            return;
+        }
+    }
+
+    if (_page_samples > 0) {
+        // sectors are erased as the copy reaches them, each page waits for its erase to finish
+        if (_copy_samples / SECTOR_SAMPLES >= _copy_erased) {
+            if (_copy_erased == _copy_sectors) {
+                // longer than it could have been, so _max_samples() is wrong about this format
+                LOG_ERROR("FlashCache: Track %u is too long to copy", _copy_index);
+                _plays[_copy_index] = 0;
+                pause();
+                _rescan = false;
+                return;
+            }
+
+            _flash.eraseSector(_address(&_copy, _copy_samples) / SFLASH_SECTOR_SIZE);
+            _copy_erased++;
+            return;
+        }
+
+        _flash.writeBuffer(_address(&_copy, _copy_samples), (const uint8_t *)_page, _page_samples * sizeof(int16_t));
+        _copy_samples += _page_samples;
+        _page_samples = 0;
+        return;
+    }
+
+    if (_copy_ended) _finish_copy();
+}
+
+void FlashCache::_finish_copy() {
+    _copy.num_samples = _copy_samples;
+    _copy.plays = _plays[_copy_index];
+    _copy.used = ++_dir.clock;
+    _plays[_copy_index] = 0;
+
+    // give back the sectors the estimate had to spare
+    uint16_t needed = (_copy_samples + SECTOR_SAMPLES - 1) / SECTOR_SAMPLES;
+    for (uint8_t e = 0; e < _copy.num_extents; e++) {
+        if (needed == 0) {
+            _copy.num_extents = e;
+            break;
+        }
+        _copy.extents[e].num_sectors = min(_copy.extents[e].num_sectors, needed);
+        needed -= _copy.extents[e].num_sectors;
+    }
+    if (_copy.num_extents == 0) _copy.num_extents = 1;
+
+    memcpy(&_dir.entries[_dir.num_entries++], &_copy, sizeof(_copy));
+    _copy.num_extents = 0;
+    _stats.promotions++;
+    _write_directory();
+
+    // another track may be waiting its turn
+    _rescan = true;
+}
+
+bool FlashCache::_allocate(FlashCacheEntry *entry, uint16_t num_sectors, uint8_t plays) {
+    while (_dir.num_entries == FLASH_CACHE_MAX_ENTRIES || !_find_space(entry, num_sectors)) {
+        int8_t victim = _victim(plays);
+        if (victim < 0) return false;
+        _evict(victim);
+    }
+    return true;
+}
+
+bool FlashCache::_find_space(FlashCacheEntry *entry, uint16_t num_sectors) {
+    uint8_t used[(FLASH_CACHE_MAX_SECTORS + 7) / 8];
+    memset(used, 0, sizeof(used));
+    for (uint8_t i = 0; i < _dir.num_entries; i++) {
+        const FlashCacheEntry *other = &_dir.entries[i];
+        for (uint8_t e = 0; e < other->num_extents; e++) {
+            for (uint16_t s = 0; s < other->extents[e].num_sectors; s++) {
+                uint16_t sector = other->extents[e].sector + s;
+                used[sector / 8] |= 1 << (sector % 8);
+            }
+        }
+    }
+
+    // first fit, in as few runs as the free space allows
+    entry->num_extents = 0;
+    uint16_t sector = FIRST_DATA_SECTOR;
+    while (num_sectors > 0 && sector < _num_sectors) {
+        if (used[sector / 8] & (1 << (sector % 8))) {
+            sector++;
+            continue;
+        }
+        if (entry->num_extents == FLASH_CACHE_EXTENTS) return false;
+
+        FlashCacheExtent *extent = &entry->extents[entry->num_extents++];
+        extent->sector = sector;
+        extent->num_sectors = 0;
+        while (num_sectors > 0 && sector < _num_sectors && !(used[sector / 8] & (1 << (sector % 8)))) {
+            extent->num_sectors++;
+            num_sectors--;
+            sector++;
+        }
+    }
+    return num_sectors == 0;
+}
+
+int8_t FlashCache::_victim(uint8_t plays) {
+    int8_t victim = -1;
+    for (uint8_t i = 0; i < _dir.num_entries; i++) {
+        const FlashCacheEntry *entry = &_dir.entries[i];
+        if (entry->plays >= plays) continue;
+        if (victim < 0 || entry->plays < _dir.entries[victim].plays
+            || (entry->plays == _dir.entries[victim].plays && entry->used < _dir.entries[victim].used)) {
+            victim = i;
+        }
+    }
+    return victim;
+}
+
+void FlashCache::_evict(uint8_t index) {
+    _dir.num_entries--;
+    if (index != _dir.num_entries) {
+        memcpy(&_dir.entries[index], &_dir.entries[_dir.num_entries], sizeof(FlashCacheEntry));
+    }
+    _stats.evictions++;
+    _write_directory();
+}
+
+void FlashCache::_write_directory() {
+    if (_dir_page == NOT_WRITING) {
+        // into the other sector, which keeps the last directory until this one is complete
+        _dir.generation++;
+    }
+    // a write already under way starts over in the same sector, from _dir as it is by then
+    _dir_page = 0;
+    _dir_erased = false;
+}
+
+void FlashCache::_directory_step() {
+    uint32_t address = (_dir.generation & 1) * SFLASH_SECTOR_SIZE;
+
+    if (!_dir_erased) {
+        _dir.checksum = _checksum();
+        _flash.eraseSector(address / SFLASH_SECTOR_SIZE);
+        _dir_erased = true;
+        return;
+    }
+
+    uint32_t offset = _dir_page * SFLASH_PAGE_SIZE;
+    _flash.writeBuffer(address + offset, (const uint8_t *)&_dir + offset, min((uint32_t)sizeof(_dir) - offset, (uint32_t)SFLASH_PAGE_SIZE));
+    _dir_page++;
+    if (_dir_page * SFLASH_PAGE_SIZE >= sizeof(_dir)) _dir_page = NOT_WRITING;
+}
+
+#else
+
+FlashCache::FlashCache() {}
+bool FlashCache::begin(SdFs *, const TrackIndex *) { return false; }
+bool FlashCache::start(const TrackInfo *, bool) { return false; }
+bool FlashCache::contains(const TrackInfo *) { return false; }
+WavePlayerPoll FlashCache::poll(int16_t *, uint32_t, uint32_t *) { return WavePlayerPoll::ERROR; }
+void FlashCache::service() {}
+void FlashCache::pause() {}
+void FlashCache::clear() {}
+
+#endif
@@ -0,0 +1,214 @@
+#ifndef FLASH_CACHE_H_
+#define FLASH_CACHE_H_
+
+#include <stdint.h>
+#include <SdFat.h>
+
+#include "WavePlayer.h"
+#include "TrackIndex.h"
+
+/** Keep the most played tracks in the Express boards' onboard SPI flash, see FlashCache */
+#ifndef USE_FLASH_CACHE
+#define USE_FLASH_CACHE 1
+#endif
+
+#if USE_FLASH_CACHE
+#include <Adafruit_SPIFlash.h>
+#endif
+
+/** Max # of tracks held in flash */
+#ifndef FLASH_CACHE_MAX_ENTRIES
+#define FLASH_CACHE_MAX_ENTRIES 16
+#endif
+
+/** # of plays before a track is copied into flash */
+#ifndef FLASH_CACHE_PROMOTE_PLAYS
+#define FLASH_CACHE_PROMOTE_PLAYS 2
+#endif
+
+/** Longest track copied into flash, in DAC samples. Longer ones always play from the card, so one long message can't push out everything else */
+#ifndef FLASH_CACHE_MAX_SAMPLES
+#define FLASH_CACHE_MAX_SAMPLES (DAC_SAMPLE_RATE * 8ul)
+#endif
+
+/** Max # of separate runs of flash sectors a track is stored in */
+#ifndef FLASH_CACHE_EXTENTS
+#define FLASH_CACHE_EXTENTS 4
+#endif
+
+/** Max # of 4KB flash sectors used, the rest of a bigger chip is left alone */
+#ifndef FLASH_CACHE_MAX_SECTORS
+#define FLASH_CACHE_MAX_SECTORS 512
+#endif
+
+#define FLASH_CACHE_MAGIC 0x48434C46 // "FLCH"
+#define FLASH_CACHE_VERSION 1
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    // tracks copied into flash, and pushed out again to make room for others
+    uint32_t promotions;
+    uint32_t evictions;
+} FlashCacheStats;
+
+/** A run of flash sectors holding part of a track */
+typedef struct {
+    uint16_t sector;
+    uint16_t num_sectors;
+} FlashCacheExtent;
+
+/** A track held in flash */
+typedef struct {
+    // the file the samples were converted from, a file that changes on the card no longer matches
+    uint32_t first_sector;
+    uint32_t data_size;
+    uint32_t sample_rate;
+    uint16_t audio_format;
+    // plays while cached, the least played entry is evicted first
+    uint8_t plays;
+    uint8_t num_extents;
+    uint32_t num_samples;
+    // FlashCacheDirectory::clock at the last play, breaks ties in plays
+    uint32_t used;
+    FlashCacheExtent extents[FLASH_CACHE_EXTENTS];
+} FlashCacheEntry;
+
+/** What's in the cache, stored in flash sector 0 or 1, whichever holds the later valid generation */
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    // the samples are DAC codes, for this resolution and rate
+    uint8_t dac_bits;
+    uint8_t num_entries;
+    uint32_t dac_rate;
+    // bumped on every write of the directory
+    uint32_t generation;
+    // bumped on every play of a cached track
+    uint32_t clock;
+    FlashCacheEntry entries[FLASH_CACHE_MAX_ENTRIES];
+    // over everything above
+    uint32_t checksum;
+} FlashCacheDirectory;
+
+/**
+ * @brief Second tier below the SD card: the most played tracks, converted and stored in SPI flash.
+ *
+ * Every play of a file is counted. Once a track has been played FLASH_CACHE_PROMOTE_PLAYS times
+ * it's copied into flash as it would reach the DAC, already converted and resampled, by a player
+ * of its own. Playing it after that is a straight flash read into the sample block, with no SD
+ * access and no conversion, and the result is bit-identical to playing the file.
+ *
+ * Copying only happens through service(), which is called while the phone plays a tone and the
+ * card is otherwise idle, a 256-byte flash page at a time. It never waits on the flash: an erase
+ * or page program runs in the background, and service() returns until the flash is ready again.
+ * Playing a file abandons the copy, and it starts over the next time. A track that's dialed
+ * while the flash is still busy plays from the card, rather than wait out an erase.
+ *
+ * When flash is full, the tracks with the fewest plays are evicted (the least recently played
+ * first among equals), but only for a track with more plays than them. A track is stored in up
+ * to FLASH_CACHE_EXTENTS runs of sectors, so the free space left by evictions can be reused.
+ *
+ * The directory survives power loss. It's written to the two directory sectors in turn, before
+ * anything in an evicted track's sectors is overwritten and after a copied track is complete,
+ * and at boot the later valid one is used. Entries for files that are no longer on the card are
+ * dropped then too.
+ *
+ * poll() has the same contract as WavePlayer::poll(), so a cached track plays like any other.
+ */
+class FlashCache {
+public:
+    FlashCache();
+
+    /** Mount the cache on the onboard flash, false if there isn't any. Everything then plays from the card */
+    bool begin(SdFs *sd, const TrackIndex *tracks);
+
+    /**
+     * Count a play of track, and start playing it from flash if it's there. False on a miss, a looping
+     * play always misses, and so does one while the flash is still busy erasing or programming
+     */
+    bool start(const TrackInfo *track, bool loop);
+    /** track is held in flash */
+    bool contains(const TrackInfo *track);
+    /** Read samples until the block is full or the track ends */
+    WavePlayerPoll poll(int16_t *samples, uint32_t max_samples, uint32_t *num_samples);
+
+    /** Take the next step copying the most played track that isn't cached yet. Only call while nothing else reads the card */
+    void service();
+    /** Abandon any copy in progress, before anything else reads the card */
+    void pause();
+    /** Forget every cached track */
+    void clear();
+
+    FlashCacheStats stats() const { return _stats; }
+
+private:
+    static const uint16_t PAGE_SAMPLES = 128;
+    static const uint16_t SECTOR_SAMPLES = 2048;
+    // directory sectors, tracks go in the rest
+    static const uint16_t FIRST_DATA_SECTOR = 2;
+    static const uint8_t NOT_WRITING = 0xFF;
+
+#if USE_FLASH_CACHE
+    FlashCacheEntry *_find(const TrackInfo *track);
+    /** Byte address in flash of a sample of entry */
+    uint32_t _address(const FlashCacheEntry *entry, uint32_t sample);
+    /** Upper bound on the # of DAC samples a track converts to */
+    static uint32_t _max_samples(const TrackInfo *track);
+
+    void _start_copy();
+    void _copy_step();
+    void _finish_copy();
+    /** Find num_sectors free sectors for entry, evicting entries with fewer than plays if need be */
+    bool _allocate(FlashCacheEntry *entry, uint16_t num_sectors, uint8_t plays);
+    bool _find_space(FlashCacheEntry *entry, uint16_t num_sectors);
+    /** The entry evicted before one with this many plays, or -1 if none have fewer */
+    int8_t _victim(uint8_t plays);
+    void _evict(uint8_t index);
+    /** Count a play, halving every count once one saturates so old popularity fades */
+    void _count(uint8_t *plays);
+
+    bool _read_directory(uint8_t sector);
+    uint32_t _checksum();
+    void _write_directory();
+    void _directory_step();
+
+    Adafruit_FlashTransport_SPI _transport;
+    Adafruit_SPIFlash _flash;
+    bool _mounted = false;
+    uint16_t _num_sectors = 0;
+
+    SdFs *_sd = NULL;
+    const TrackIndex *_tracks = NULL;
+    // plays of each indexed track since boot, while it isn't cached
+    uint8_t _plays[TRACK_INDEX_MAX_TRACKS];
+    // a play was counted, so the most played uncached track may have changed
+    bool _rescan = false;
+
+    FlashCacheDirectory _dir;
+    // page of the directory programmed next, 0 after the erase, NOT_WRITING if it's written
+    uint8_t _dir_page = NOT_WRITING;
+    bool _dir_erased = false;
+
+    // the track being played
+    FlashCacheEntry *_playing = NULL;
+    uint32_t _position = 0;
+
+    // the track being copied, _copy.num_extents is 0 when there's none
+    StaticWavePlayer<1> _copier;
+    FlashCacheEntry _copy;
+    uint8_t _copy_index;
+    uint16_t _copy_sectors;
+    // samples written to flash, and # of the copy's sectors erased so far
+    uint32_t _copy_samples;
+    uint16_t _copy_erased;
+    int16_t _page[PAGE_SAMPLES];
+    uint32_t _page_samples;
+    // the last samples are in _page
+    bool _copy_ended;
+#endif
+
+    FlashCacheStats _stats = {};
+};
+
+#endif // FLASH_CACHE_H_
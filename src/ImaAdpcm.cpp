@@ -0,0 +1,93 @@
+#include "ImaAdpcm.h"
+
+static const int16_t STEP_TABLE[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767,
+};
+
+static const int8_t INDEX_TABLE[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8,
+    -1, -1, -1, -1, 2, 4, 6, 8,
+};
+
+/** One sample from a nibble, the predictor and step index are updated in place */
+static inline int32_t ima_sample(uint32_t nibble, int32_t *predictor, int32_t *index) {
+    int32_t step = STEP_TABLE[*index];
+
+    int32_t diff = step >> 3;
+    if (nibble & 4) diff += step;
+    if (nibble & 2) diff += step >> 1;
+    if (nibble & 1) diff += step >> 2;
+
+    int32_t p = (nibble & 8) ? *predictor - diff : *predictor + diff;
+    if (p > 32767) p = 32767;
+    else if (p < -32768) p = -32768;
+    *predictor = p;
+
+    int32_t i = *index + INDEX_TABLE[nibble];
+    *index = i < 0 ? 0 : (i > 88 ? 88 : i);
+
+    return p;
+}
+
+/** Decode the 8 nibbles in a 4-byte group, low nibble first */
+static inline void ima_group(const uint8_t *src, int32_t *out, int32_t *predictor, int32_t *index) {
+    int32_t p = *predictor, i = *index;
+    for (uint8_t b = 0; b < 4; ++b) {
+        uint32_t byte = src[b];
+        out[2 * b] = ima_sample(byte & 0x0F, &p, &i);
+        out[2 * b + 1] = ima_sample(byte >> 4, &p, &i);
+    }
+    *predictor = p;
+    *index = i;
+}
+
+bool ImaAdpcmDecoder::supported(uint16_t num_channels, uint16_t bits_per_sample, uint16_t block_align) {
+    if (bits_per_sample != 4 || num_channels < 1 || num_channels > 2) return false;
+
+    // a header and at least one group per channel, in whole groups
+    uint16_t unit = 4 * num_channels;
+    return block_align >= 2 * unit && block_align % unit == 0;
+}
+
+void ImaAdpcmDecoder::configure(uint8_t num_channels, uint16_t block_align) {
+    _num_channels = num_channels;
+    _units_per_block = block_align / (4 * num_channels);
+    _unit = 0;
+}
+
+uint32_t ImaAdpcmDecoder::decode(const uint8_t *src, int16_t *dst, uint32_t units) {
+    int16_t *start = dst;
+
+    for (; units > 0; --units) {
+        if (_unit == 0) {
+            // block header, the first sample is stored as is
+            int32_t sum = 0;
+            for (uint8_t c = 0; c < _num_channels; ++c) {
+                const uint8_t *header = &src[4 * c];
+                _predictor[c] = (int16_t)(header[0] | (header[1] << 8));
+                _index[c] = header[2] > 88 ? 88 : header[2];
+                sum += _predictor[c];
+            }
+            *dst++ = DacCode<DAC_BITS>::from_s16(_num_channels == 2 ? sum >> 1 : sum);
+        } else if (_num_channels == 1) {
+            int32_t s[IMA_ADPCM_UNIT_SAMPLES];
+            ima_group(src, s, &_predictor[0], &_index[0]);
+            for (uint8_t k = 0; k < IMA_ADPCM_UNIT_SAMPLES; ++k) *dst++ = DacCode<DAC_BITS>::from_s16(s[k]);
+        } else {
+            // 8 samples of the left channel, then 8 of the right
+            int32_t l[IMA_ADPCM_UNIT_SAMPLES], r[IMA_ADPCM_UNIT_SAMPLES];
+            ima_group(src, l, &_predictor[0], &_index[0]);
+            ima_group(src + 4, r, &_predictor[1], &_index[1]);
+            for (uint8_t k = 0; k < IMA_ADPCM_UNIT_SAMPLES; ++k) *dst++ = DacCode<DAC_BITS>::from_s16((l[k] + r[k]) >> 1);
+        }
+
+        src += 4 * _num_channels;
+        if (++_unit == _units_per_block) _unit = 0;
+    }
+
+    return dst - start;
+}
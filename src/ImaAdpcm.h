@@ -0,0 +1,48 @@
+#ifndef IMA_ADPCM_H_
+#define IMA_ADPCM_H_
+
+#include <stdint.h>
+
+#include "SampleConverter.h"
+
+#define WAVE_FORMAT_IMA_ADPCM 0x0011
+
+/** Most samples decoded from one unit, see ImaAdpcmDecoder */
+#define IMA_ADPCM_UNIT_SAMPLES 8
+
+/**
+ * @brief Streaming decoder for IMA ADPCM WAV data (format 0x11), 4 bits per sample.
+ *
+ * A block starts with a 4-byte header per channel (the first sample verbatim and the step
+ * index), followed by 4-byte groups of 8 nibbles per channel, interleaved for stereo. The
+ * decoder works in units of one 4-byte group per channel: the header unit gives 1 sample, every
+ * other unit gives IMA_ADPCM_UNIT_SAMPLES. The predictor and step index carry over between
+ * units, so a block can be decoded a few units at a time as its sectors land, and never has to
+ * be held whole. Stereo is mixed down to mono, and the output is DAC codes like the PCM kernels.
+ */
+class ImaAdpcmDecoder {
+public:
+    /** Check a WAV's IMA ADPCM format can be decoded */
+    static bool supported(uint16_t num_channels, uint16_t bits_per_sample, uint16_t block_align);
+
+    void configure(uint8_t num_channels, uint16_t block_align);
+
+    /** Start over at the beginning of a block */
+    void restart() { _unit = 0; }
+
+    /** Bytes per unit */
+    uint8_t unit_size() const { return 4 * _num_channels; }
+
+    /** Decode units from src into dst, which must have room for IMA_ADPCM_UNIT_SAMPLES per unit. Returns the # of samples */
+    uint32_t decode(const uint8_t *src, int16_t *dst, uint32_t units);
+
+private:
+    uint8_t _num_channels;
+    uint16_t _units_per_block;
+    // unit of the current block decoded next, 0 is the header
+    uint16_t _unit;
+    int32_t _predictor[2];
+    int32_t _index[2];
+};
+
+#endif // IMA_ADPCM_H_
@@ -0,0 +1,44 @@
+#include <Arduino.h>
+
+#include "io.h"
+#include "LatencyHistogram.h"
+
+HotPathLatency hot_path;
+
+void LatencyHistogram::reset() {
+    for (uint8_t i = 0; i < LATENCY_HISTOGRAM_BUCKETS; ++i) _counts[i] = 0;
+    _max = 0;
+}
+
+void LatencyHistogram::print(const char *name) const {
+    uint32_t total = 0;
+
+    cout << name << endl;
+    for (uint8_t i = 0; i < LATENCY_HISTOGRAM_BUCKETS; ++i) {
+        uint32_t count = _counts[i];
+        if (count == 0) continue;
+        total += count;
+
+        if (i == LATENCY_HISTOGRAM_BUCKETS - 1) {
+            cout << F("  >=") << (1ul << (i - 1));
+        } else {
+            cout << F("  <") << (1ul << i);
+        }
+        cout << F(" us: ") << count << endl;
+    }
+    cout << F("  count ") << total << F(" max ") << (uint32_t)_max << F(" us") << endl;
+}
+
+void print_hot_path_latency() {
+    hot_path.sd_first_byte.print("SD first byte");
+    hot_path.sd_sector.print("SD sector");
+    hot_path.convert.print("Convert per chunk");
+    hot_path.slack.print("DAC slack");
+}
+
+void reset_hot_path_latency() {
+    hot_path.sd_first_byte.reset();
+    hot_path.sd_sector.reset();
+    hot_path.convert.reset();
+    hot_path.slack.reset();
+}
@@ -0,0 +1,59 @@
+#ifndef LATENCY_HISTOGRAM_H_
+#define LATENCY_HISTOGRAM_H_
+
+#include <stdint.h>
+
+/** # of buckets per histogram. Bucket b counts times in [2^(b-1), 2^b) us, the last one also counts anything longer */
+#ifndef LATENCY_HISTOGRAM_BUCKETS
+#define LATENCY_HISTOGRAM_BUCKETS 20
+#endif
+
+/**
+ * @brief Fixed log2-bucket histogram of durations in microseconds.
+ *
+ * Recording is a count of leading zeros and an increment, cheap enough to leave on in the
+ * hot path and in interrupt handlers. Each histogram should only be recorded from one
+ * context, a reset or print from the main loop can miss a sample from an ISR, which is fine
+ * for statistics.
+ */
+class LatencyHistogram {
+public:
+    void record(uint32_t us) {
+        uint8_t bucket = us == 0 ? 0 : 32 - __builtin_clz(us);
+        if (bucket >= LATENCY_HISTOGRAM_BUCKETS) bucket = LATENCY_HISTOGRAM_BUCKETS - 1;
+
+        _counts[bucket]++;
+        if (us > _max) _max = us;
+    }
+
+    void reset();
+
+    /** Print the non-empty buckets as "<upper bound> us: count" lines, then the count and max */
+    void print(const char *name) const;
+
+private:
+    volatile uint32_t _counts[LATENCY_HISTOGRAM_BUCKETS] = {};
+    volatile uint32_t _max = 0;
+};
+
+/** Where the time goes while streaming a file, see README */
+typedef struct {
+    // SD read command to the data start token
+    LatencyHistogram sd_first_byte;
+    // each sector of a read, from the previous one landing (or the start token) to this one landing.
+    // with DMA, each sector of a chain is counted at the chain's average
+    LatencyHistogram sd_sector;
+    // CPU time spent converting and resampling each read chunk, not counting starting reads
+    LatencyHistogram convert;
+    // audio left queued for the DAC when a block is handed over, i.e. how close it came to an underrun
+    LatencyHistogram slack;
+} HotPathLatency;
+
+extern HotPathLatency hot_path;
+
+/** Dump every hot path histogram over serial */
+void print_hot_path_latency();
+/** Start the hot path histograms over, e.g. before trying another SD card */
+void reset_hot_path_latency();
+
+#endif // LATENCY_HISTOGRAM_H_
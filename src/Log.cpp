@@ -0,0 +1,138 @@
+#include <Arduino.h>
+
+#include "Log.h"
+
+static_assert((LOG_RECORDS & (LOG_RECORDS - 1)) == 0, "LOG_RECORDS must be a power of 2");
+
+static LogRecord records[LOG_RECORDS];
+// records are written at head and printed from tail, both only ever count up
+static uint16_t head = 0;
+static uint16_t tail = 0;
+// records that didn't fit since the last were printed
+static uint32_t dropped = 0;
+
+void log_write(const char *format, uintptr_t a, uintptr_t b, uintptr_t c) {
+    if ((uint16_t)(head - tail) == LOG_RECORDS) {
+        dropped++;
+        return;
+    }
+
+    LogRecord *record = &records[head % LOG_RECORDS];
+    record->time_us = micros();
+    record->format = format;
+    record->values[0] = a;
+    record->values[1] = b;
+    record->values[2] = c;
+    head++;
+}
+
+static char *put_number(char *out, char *end, uint32_t value, uint8_t base, uint8_t min_digits) {
+    char digits[10];
+    uint8_t n = 0;
+    do {
+        uint8_t digit = value % base;
+        digits[n++] = digit < 10 ? '0' + digit : 'a' + digit - 10;
+        value /= base;
+    } while (value > 0 || n < min_digits);
+
+    while (n > 0 && out < end) *out++ = digits[--n];
+    return out;
+}
+
+/** record as "[seconds.ms] message\n" in line, returns its length */
+static size_t format_record(const LogRecord *record, char *line) {
+    // room is kept for the newline
+    char *out = line, *end = line + LOG_LINE_MAX - 1;
+    uint8_t value = 0;
+
+    *out++ = '[';
+    out = put_number(out, end, record->time_us / 1000000, 10, 1);
+    *out++ = '.';
+    out = put_number(out, end, record->time_us / 1000 % 1000, 10, 3);
+    *out++ = ']';
+    *out++ = ' ';
+
+    for (const char *f = record->format; *f && out < end; f++) {
+        if (*f != '%' || f[1] == '\0') {
+            *out++ = *f;
+            continue;
+        }
+
+        f++;
+        if (*f == '%' || value == LOG_MAX_VALUES) {
+            *out++ = *f;
+            continue;
+        }
+
+        uintptr_t v = record->values[value++];
+        switch (*f) {
+        case 'd':
+            if ((int32_t)v < 0) {
+                *out++ = '-';
+                out = put_number(out, end, -(uint32_t)v, 10, 1);
+                break;
+            }
+            // fall through
+        case 'u':
+            out = put_number(out, end, (uint32_t)v, 10, 1);
+            break;
+        case 'x':
+            out = put_number(out, end, (uint32_t)v, 16, 1);
+            break;
+        case 's':
+            for (const char *s = (const char *)v; s && *s && out < end; s++) *out++ = *s;
+            break;
+        default:
+            *out++ = *f;
+            break;
+        }
+    }
+
+    *out++ = '\n';
+    return out - line;
+}
+
+/** The next record to print, or a note of how many were dropped once every kept one is printed. false if there's neither */
+static bool next_record(LogRecord *record) {
+    if (head != tail) {
+        *record = records[tail % LOG_RECORDS];
+        return true;
+    }
+    if (dropped == 0) return false;
+
+    record->time_us = micros();
+    record->format = "Log: dropped %u records, see LOG_RECORDS";
+    record->values[0] = dropped;
+    return true;
+}
+
+/** The record from next_record() is printed */
+static void pop_record() {
+    if (head != tail) {
+        tail++;
+    } else {
+        dropped = 0;
+    }
+}
+
+bool log_drain() {
+    LogRecord record;
+    if (!next_record(&record)) return false;
+
+    char line[LOG_LINE_MAX];
+    size_t len = format_record(&record, line);
+    if ((size_t)Serial.availableForWrite() < len) return false;
+
+    Serial.write((const uint8_t *)line, len);
+    pop_record();
+    return true;
+}
+
+void log_flush() {
+    LogRecord record;
+    char line[LOG_LINE_MAX];
+    while (next_record(&record)) {
+        Serial.write((const uint8_t *)line, format_record(&record, line));
+        pop_record();
+    }
+}
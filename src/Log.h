@@ -0,0 +1,90 @@
+#ifndef LOG_H_
+#define LOG_H_
+
+#include <stdint.h>
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+/** Most detailed level logged, the calls past it compile out. LOG_LEVEL_NONE leaves no logging at all, e.g. for release builds */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+/** # of records held until they're printed. Once it's full, new records are dropped and counted */
+#ifndef LOG_RECORDS
+#define LOG_RECORDS 32
+#endif
+
+/** Max # of values per record */
+#define LOG_MAX_VALUES 3
+
+/** Longest line printed for a record, the rest is cut off */
+#define LOG_LINE_MAX 96
+
+typedef struct {
+    uint32_t time_us;
+    // printf-style, only %u, %d, %x, %s and %% are understood. it's kept as a pointer, so it has to be a literal
+    const char *format;
+    uintptr_t values[LOG_MAX_VALUES];
+} LogRecord;
+
+/**
+ * @brief Deferred logging, for everything that can happen while audio plays.
+ *
+ * Printing to USB serial can block for milliseconds when the host is slow to take the data, and
+ * with the card's DMA armed or the DAC queue running low that's an underrun. A log call doesn't
+ * print: it stores the time, the format string's address and up to LOG_MAX_VALUES values in a
+ * ring of LOG_RECORDS records, which is a few stores. log_drain() is called from loop() when the
+ * DAC queue is full or nothing plays, and prints a record only when the serial port can take the
+ * whole line without waiting.
+ *
+ * Strings passed for %s are also kept as pointers, so they have to outlive the record, e.g. a
+ * literal or a filename from the track table.
+ *
+ * Records can only be written from the main loop, not from interrupt handlers. Messages from
+ * setup(), and output asked for over serial, go straight to cout.
+ */
+void log_write(const char *format, uintptr_t a, uintptr_t b, uintptr_t c);
+
+/** Print the oldest record if the serial port has room for it, false if there was nothing to print or no room */
+bool log_drain();
+/** Print every record, waiting on the serial port as long as it takes, e.g. before halting */
+void log_flush();
+
+template <typename A = uintptr_t, typename B = uintptr_t, typename C = uintptr_t>
+inline void log_record(const char *format, A a = 0, B b = 0, C c = 0) {
+    log_write(format, (uintptr_t)a, (uintptr_t)b, (uintptr_t)c);
+}
+
+// a call past LOG_LEVEL is never evaluated, but still counts as a use of its arguments
+#define LOG_DISCARD(...) ((void)sizeof((log_record(__VA_ARGS__), 0)))
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) log_record(__VA_ARGS__)
+#else
+#define LOG_ERROR(...) LOG_DISCARD(__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) log_record(__VA_ARGS__)
+#else
+#define LOG_WARN(...) LOG_DISCARD(__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) log_record(__VA_ARGS__)
+#else
+#define LOG_INFO(...) LOG_DISCARD(__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) log_record(__VA_ARGS__)
+#else
+#define LOG_DEBUG(...) LOG_DISCARD(__VA_ARGS__)
+#endif
+
+#endif // LOG_H_
@@ -0,0 +1,121 @@
+#include <Arduino.h>
+
+#include "Mixer.h"
+
+void Mixer::play(uint8_t voice, MixerSourceFn poll, void *ctx, uint16_t gain) {
+    Voice *v = &_voices[voice];
+    v->poll = poll;
+    v->ctx = ctx;
+    v->gain = gain;
+    v->num_samples = 0;
+    v->ended = false;
+}
+
+void Mixer::reset() {
+    _lead_filled = false;
+    for (uint8_t i = 1; i < MIXER_VOICES; ++i) _voices[i].num_samples = 0;
+}
+
+WavePlayerPoll Mixer::poll(int16_t *samples, uint32_t max_samples, uint32_t *num_samples) {
+    Voice *lead = &_voices[0];
+    if (!lead->poll) return WavePlayerPoll::DONE;
+
+    if (!_lead_filled) {
+        WavePlayerPoll result = lead->poll(lead->ctx, samples, max_samples, num_samples);
+        if (result != WavePlayerPoll::FILLED) return result;
+        _lead_filled = true;
+    }
+
+    // the lead may have ended partway through the block, overlays only need to match it
+    uint32_t n = *num_samples;
+    // room for every kernel mix_voices() could pick, even when fewer voices are built in
+    const int16_t *in[4] = { samples };
+    uint16_t gains[4] = { lead->gain };
+    uint8_t count = 1;
+
+    for (uint8_t i = 1; i < MIXER_VOICES; ++i) {
+        if (!_voices[i].poll) continue;
+        if (!_fill_overlay(i, n)) return WavePlayerPoll::PENDING;
+
+        in[count] = _block(i);
+        gains[count] = _voices[i].gain;
+        count++;
+    }
+
+    if (count > 1 || lead->gain != MIXER_UNITY_GAIN) {
+        mix_voices(samples, in, gains, count, n);
+    }
+
+    for (uint8_t i = 1; i < MIXER_VOICES; ++i) {
+        if (_voices[i].ended) stop(i);
+    }
+    reset();
+    return WavePlayerPoll::FILLED;
+}
+
+bool Mixer::_fill_overlay(uint8_t voice, uint32_t num_samples) {
+    Voice *v = &_voices[voice];
+    int16_t *block = _block(voice);
+
+    while (v->num_samples < num_samples) {
+        switch (v->poll(v->ctx, block, num_samples, &v->num_samples)) {
+        case WavePlayerPoll::PENDING:
+            return false;
+        case WavePlayerPoll::FILLED:
+            // a short block means the source ended, the next poll says so
+            break;
+        default:
+            // ended, or failed, either way it's silent from here on
+            for (uint32_t i = v->num_samples; i < num_samples; ++i) block[i] = (int16_t)DacCode<DAC_BITS>::BIAS;
+            v->num_samples = num_samples;
+            v->ended = true;
+            break;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Mixing DAC codes around the bias: bias + sum(g * (s - bias)) = sum(g * s) + bias * (1 - sum(g)),
+ * so the bias comes out of the loop as one constant. That leaves a load, a multiply and an add
+ * per voice, then a shift and a saturation check per sample, with everything in registers.
+ */
+template <uint8_t Voices>
+static void mix_kernel(int16_t *out, const int16_t *const *in, const uint16_t *gains, uint32_t num_samples) {
+    const int32_t BIAS = DacCode<DAC_BITS>::BIAS;
+    const int32_t MASK = DacCode<DAC_BITS>::MASK;
+
+    int32_t gain_sum = 0;
+    for (uint8_t v = 0; v < Voices; ++v) gain_sum += gains[v];
+    const int32_t offset = BIAS * (MIXER_UNITY_GAIN - gain_sum) + (1 << 14);
+
+    const int32_t g0 = gains[0];
+    const int32_t g1 = Voices > 1 ? gains[1] : 0;
+    const int32_t g2 = Voices > 2 ? gains[2] : 0;
+    const int32_t g3 = Voices > 3 ? gains[3] : 0;
+    const int16_t *s1 = Voices > 1 ? in[1] : NULL;
+    const int16_t *s2 = Voices > 2 ? in[2] : NULL;
+    const int16_t *s3 = Voices > 3 ? in[3] : NULL;
+
+    for (uint32_t i = 0; i < num_samples; ++i) {
+        int32_t acc = offset + g0 * out[i];
+        if (Voices > 1) acc += g1 * s1[i];
+        if (Voices > 2) acc += g2 * s2[i];
+        if (Voices > 3) acc += g3 * s3[i];
+
+        int32_t s = acc >> 15;
+        // one unsigned compare catches both ends
+        if ((uint32_t)s > (uint32_t)MASK) s = s < 0 ? 0 : MASK;
+        out[i] = (int16_t)s;
+    }
+}
+
+void mix_voices(int16_t *out, const int16_t *const *in, const uint16_t *gains, uint8_t count, uint32_t num_samples) {
+    switch (count) {
+    case 1: mix_kernel<1>(out, in, gains, num_samples); break;
+    case 2: mix_kernel<2>(out, in, gains, num_samples); break;
+    case 3: mix_kernel<3>(out, in, gains, num_samples); break;
+    case 4: mix_kernel<4>(out, in, gains, num_samples); break;
+    }
+}
@@ -0,0 +1,100 @@
+#ifndef MIXER_H_
+#define MIXER_H_
+
+#include <stdint.h>
+
+#include "AudioPlayer.h"
+#include "SampleConverter.h"
+#include "WavePlayer.h"
+
+/**
+ * # of voices mixed into each block, voice 0 included. Each voice past the lead holds a block of
+ * its own (2KB at the default AUDIO_BLOCK_SAMPLES), so only raise it when a build plays overlays
+ */
+#ifndef MIXER_VOICES
+#define MIXER_VOICES 1
+#endif
+
+/** Q15 gain of 1, gains go up to just under 2 and the mix saturates */
+#define MIXER_UNITY_GAIN 0x8000
+
+/** A sample source with the same poll() contract as WavePlayer */
+typedef WavePlayerPoll (*MixerSourceFn)(void *ctx, int16_t *samples, uint32_t max_samples, uint32_t *num_samples);
+
+/**
+ * @brief Mixes up to MIXER_VOICES sample sources into one block of DAC codes.
+ *
+ * Voice 0 leads: it's polled straight into the output block, its blocks set the length of each
+ * mixed block, and the mix ends when it does. The other voices are overlays, each polled into
+ * a block of its own until it has caught up with the lead, and dropped once it ends. Each voice
+ * has a Q15 gain, and the mix is saturated to the DAC range.
+ *
+ * With only the lead playing at unity gain, blocks pass through untouched.
+ */
+class Mixer {
+    static_assert(MIXER_VOICES >= 1 && MIXER_VOICES <= 4, "the mix kernel handles 1-4 voices");
+    static_assert(DAC_BITS + 16 + 2 < 32, "the mix must fit 32 bits");
+
+public:
+    /** Play source on voice from the next block it fills, replacing whatever it was playing */
+    void play(uint8_t voice, MixerSourceFn poll, void *ctx, uint16_t gain = MIXER_UNITY_GAIN);
+
+    template <class Source>
+    void play(uint8_t voice, Source *source, uint16_t gain = MIXER_UNITY_GAIN) {
+        play(voice, poll_source<Source>, source, gain);
+    }
+
+    void set_gain(uint8_t voice, uint16_t gain) { _voices[voice].gain = gain; }
+    void stop(uint8_t voice) { _voices[voice].poll = NULL; }
+    bool is_playing(uint8_t voice) const { return _voices[voice].poll != NULL; }
+
+    /** Forget the block being mixed, e.g. when the lead is restarted with an empty block */
+    void reset();
+
+    /**
+     * Poll every voice, and mix once they have all filled the block or ended. Same contract as
+     * WavePlayer::poll(), with the lead's block length and end.
+     */
+    WavePlayerPoll poll(int16_t *samples, uint32_t max_samples, uint32_t *num_samples);
+
+private:
+    template <class Source>
+    static WavePlayerPoll poll_source(void *ctx, int16_t *samples, uint32_t max_samples, uint32_t *num_samples) {
+        return ((Source *)ctx)->poll(samples, max_samples, num_samples);
+    }
+
+    /** Fill the overlay's block up to num_samples, false while it's waiting on data */
+    bool _fill_overlay(uint8_t voice, uint32_t num_samples);
+
+#if MIXER_VOICES > 1
+    int16_t *_block(uint8_t voice) { return _blocks[voice - 1]; }
+#else
+    int16_t *_block(uint8_t voice) { (void)voice; return NULL; }
+#endif
+
+    typedef struct {
+        MixerSourceFn poll;
+        void *ctx;
+        uint16_t gain;
+        // samples in block so far, overlays only
+        uint32_t num_samples;
+        // the source ended in this block, it's dropped once the block is mixed
+        bool ended;
+    } Voice;
+
+    Voice _voices[MIXER_VOICES] = {};
+    // the lead's block is done and the mix is waiting on overlays
+    bool _lead_filled = false;
+
+#if MIXER_VOICES > 1
+    int16_t _blocks[MIXER_VOICES - 1][AUDIO_BLOCK_SAMPLES] __attribute__ ((aligned (4)));
+#endif
+};
+
+/**
+ * out = sum(gain * in) over count voices, in DAC codes, saturated to the DAC range. The first
+ * voice is read from out. Exposed for benchmarking.
+ */
+void mix_voices(int16_t *out, const int16_t *const *in, const uint16_t *gains, uint8_t count, uint32_t num_samples);
+
+#endif // MIXER_H_
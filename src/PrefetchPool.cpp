@@ -0,0 +1,49 @@
+#include <Arduino.h>
+
+#include "Log.h"
+#include "PrefetchPool.h"
+
+bool PrefetchPool::add(SdFs *sd, const TrackInfo *track) {
+    if (_num_tracks == PREFETCH_POOL_TRACKS) return false;
+
+    // the sector the player reads first, see WavePlayer::start(). past the first cluster of a
+    // fragmented file that would take walking the FAT, and it isn't worth it for one sector
+    uint32_t data_sector = track->format.data_offset / SD_SECTOR_SIZE;
+    if (track->format.data_size == 0 || (!track->contiguous && data_sector >= sd->sectorsPerCluster())) return false;
+
+    _tracks[_num_tracks] = track;
+    _sectors[_num_tracks] = track->first_sector + data_sector;
+    _num_tracks++;
+    return true;
+}
+
+bool PrefetchPool::service(SdFs *sd) {
+    if (_num_read == _num_tracks) return false;
+
+    uint8_t *heads = AudioPlayer.idle_blocks();
+    if (!heads) return false;
+
+    WavePlayer::end_stream();
+    if (!sd->card()->readSector(_sectors[_num_read], heads + _num_read * SD_SECTOR_SIZE)) {
+        LOG_ERROR("PrefetchPool: Failed to read sector %u", _sectors[_num_read]);
+        // it'll be read when it's played, like any other
+        _tracks[_num_read] = NULL;
+    }
+    _num_read++;
+    return true;
+}
+
+void PrefetchPool::keep(const TrackInfo *track) {
+    // nothing has been queued since the sectors were read, so they're still there
+    uint8_t *heads = AudioPlayer.idle_blocks();
+
+    _kept_track = NULL;
+    for (uint8_t i = 0; heads && track && i < _num_read; i++) {
+        if (_tracks[i] == track) {
+            memcpy(_kept, heads + i * SD_SECTOR_SIZE, SD_SECTOR_SIZE);
+            _kept_track = track;
+            break;
+        }
+    }
+    _num_tracks = _num_read = 0;
+}
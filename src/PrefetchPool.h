@@ -0,0 +1,66 @@
+#ifndef PREFETCH_POOL_H_
+#define PREFETCH_POOL_H_
+
+#include <stdint.h>
+#include <SdFat.h>
+
+#include "AudioPlayer.h"
+#include "WavePlayer.h"
+
+/** # of tracks whose first sector can be held at once, enough for the ten numbers sharing a first digit */
+#ifndef PREFETCH_POOL_TRACKS
+#define PREFETCH_POOL_TRACKS 10
+#endif
+
+/**
+ * @brief The first sector of sample data of a few tracks, read ahead of when they're played.
+ *
+ * Once the first digit of a number is dialed, the second one is more than a second away, and
+ * the card has nothing else to do. The tracks it could turn out to be are queued with add(), and
+ * service() reads one of them per call from loop(), so the dialer keeps being checked between
+ * reads. When the number is complete, its track's head sector is handed to WavePlayer::start(),
+ * and the start of the voicemail plays without waiting on the card.
+ *
+ * One sector per track is read, not a whole WavePlayer chunk. It covers the card's command
+ * latency for the first read, while the rest of the first chunk is read in the background.
+ *
+ * Nothing plays between digits, so the candidates are read into the AudioPlayer queue's idle
+ * blocks (see AudioPlayer_::idle_blocks()) rather than RAM of their own. Once the number is
+ * complete, keep() copies its track's sector out before anything is queued again, and that one
+ * sector is all the pool holds.
+ */
+class PrefetchPool {
+    static_assert(PREFETCH_POOL_TRACKS * SD_SECTOR_SIZE <= AudioPlayer_::IDLE_BYTES, "PREFETCH_POOL_TRACKS sectors don't fit in the AudioPlayer queue");
+
+public:
+    /** Forget every track, e.g. once a new number has started being dialed */
+    void clear() { _num_tracks = _num_read = 0; _kept_track = NULL; }
+
+    /** Queue a track to be read, false if the pool is full or its first data sector can't be found without the FAT */
+    bool add(SdFs *sd, const TrackInfo *track);
+
+    /**
+     * Read the next queued track's head sector, false if there was nothing left to read or the
+     * AudioPlayer is in use. Only call while nothing else reads the card
+     */
+    bool service(SdFs *sd);
+
+    /** The number is complete: hold on to track's sector if it was read, and forget the rest. Call before queuing audio */
+    void keep(const TrackInfo *track);
+
+    /** track's first sector of sample data if it was kept, or NULL */
+    const uint8_t *find(const TrackInfo *track) const { return track && track == _kept_track ? _kept : NULL; }
+
+private:
+    const TrackInfo *_tracks[PREFETCH_POOL_TRACKS];
+    uint32_t _sectors[PREFETCH_POOL_TRACKS];
+    uint8_t _num_tracks = 0;
+    // tracks before this have been read, into the AudioPlayer's idle blocks
+    uint8_t _num_read = 0;
+
+    const TrackInfo *_kept_track = NULL;
+    // word aligned for the converters' word loops
+    uint8_t _kept[SD_SECTOR_SIZE] __attribute__ ((aligned (4)));
+};
+
+#endif // PREFETCH_POOL_H_
@@ -0,0 +1,44 @@
+#include "Resampler.h"
+
+bool Resampler::configure(uint32_t in_rate, uint32_t out_rate) {
+    if (in_rate < RESAMPLER_MIN_RATE || in_rate > RESAMPLER_MAX_RATE || out_rate == 0) {
+        return false;
+    }
+
+    _step = (uint32_t)((((uint64_t)in_rate << 16) + out_rate / 2) / out_rate);
+    // start exactly on the first input sample, so _prev is never read before it's been set
+    _pos = 1ul << 16;
+    _prev = 0;
+    return true;
+}
+
+uint32_t Resampler::process(const int16_t *in, uint32_t in_count, int16_t *out, uint32_t out_count, uint32_t *produced) {
+    if (in_count == 0) {
+        *produced = 0;
+        return 0;
+    }
+
+    // input index i maps to in[i - 1], index 0 is the carried-over _prev
+    uint32_t pos = _pos;
+    uint32_t n = 0;
+    uint32_t limit = in_count << 16;
+
+    while (n < out_count && pos < limit) {
+        uint32_t i = pos >> 16;
+        int32_t a = i == 0 ? _prev : in[i - 1];
+        int32_t b = in[i];
+        int32_t frac = (pos & 0xFFFF) >> 1;
+
+        out[n++] = (int16_t)(a + (((b - a) * frac) >> 15));
+        pos += _step;
+    }
+
+    // drop the input we've moved past, keeping the last one as the next left-hand sample
+    uint32_t consumed = pos >> 16;
+    if (consumed > in_count) consumed = in_count;
+    if (consumed > 0) _prev = in[consumed - 1];
+
+    _pos = pos - (consumed << 16);
+    *produced = n;
+    return consumed;
+}
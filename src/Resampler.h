@@ -0,0 +1,44 @@
+#ifndef RESAMPLER_H_
+#define RESAMPLER_H_
+
+#include <stdint.h>
+
+/** Rate the DAC is clocked at, every source is resampled to this */
+#ifndef DAC_SAMPLE_RATE
+#define DAC_SAMPLE_RATE 44100
+#endif
+
+#define RESAMPLER_MIN_RATE 4000
+#define RESAMPLER_MAX_RATE 96000
+
+/**
+ * @brief Integer-only linear interpolating resampler for DAC-ready mono samples.
+ *
+ * The read position is a Q16 index into the input stream, advanced by in_rate / out_rate per
+ * output sample. The last input sample of the previous batch is kept so interpolation is
+ * continuous across batches. Each output costs two loads, a multiply and a shift, which is
+ * cheap enough for the single-cycle multiplier on the M0+.
+ */
+class Resampler {
+public:
+    /** Set up for a new stream, false if the rate is out of range */
+    bool configure(uint32_t in_rate, uint32_t out_rate);
+
+    /** True when the rates match and samples can be passed straight through */
+    bool passthrough() const { return _step == (1ul << 16); }
+
+    /**
+     * Resample up to in_count samples into at most out_count samples.
+     * Returns the # of input samples consumed, the rest must be passed in again.
+     */
+    uint32_t process(const int16_t *in, uint32_t in_count, int16_t *out, uint32_t out_count, uint32_t *produced);
+
+private:
+    // Q16 input samples per output sample
+    uint32_t _step = 1ul << 16;
+    // Q16 position relative to _prev, which sits at index 0
+    uint32_t _pos;
+    int16_t _prev;
+};
+
+#endif // RESAMPLER_H_
@@ -0,0 +1,289 @@
+#ifndef SAMPLE_CONVERTER_H_
+#define SAMPLE_CONVERTER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/** Resolution of the DAC samples produced by the converters */
+#ifndef DAC_BITS
+#define DAC_BITS 10
+#endif
+
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+/** Not a WAV format tag, marks a DacFile.h container of ready-made DAC codes */
+#define WAVE_FORMAT_DAC 0xDAC0
+
+/**
+ * Converts frames of interleaved WAV data starting at src into unsigned DAC_BITS mono samples
+ * at dst. src and dst must not overlap.
+ */
+typedef void (*SampleConverterFn)(const uint8_t *src, int16_t *dst, uint32_t frames);
+
+/**
+ * Mapping from a signed 16-bit sample to an unsigned DacBits DAC code: (s >> (16 - DacBits)) + bias.
+ *
+ * The bias add is an XOR of the top bit of the DacBits-wide field, so two samples packed in one
+ * word convert with a single shift, mask and xor.
+ */
+template <uint8_t DacBits>
+struct DacCode {
+    static_assert(DacBits >= 8 && DacBits <= 16, "DAC resolution must be 8-16 bits");
+
+    static const uint32_t SHIFT = 16 - DacBits;
+    static const uint32_t MASK = (1ul << DacBits) - 1;
+    static const uint32_t BIAS = 1ul << (DacBits - 1);
+
+    static inline int16_t from_s16(int32_t s) {
+        return (int16_t)((s >> SHIFT) + BIAS);
+    }
+
+    /** Convert two signed 16-bit samples packed in a word */
+    static inline uint32_t from_s16_pair(uint32_t w) {
+        return ((w >> SHIFT) & (MASK | (MASK << 16))) ^ (BIAS | (BIAS << 16));
+    }
+};
+
+// -- Sample encodings, each decodes one channel sample to signed 16-bit
+
+struct PcmU8 {
+    static const uint8_t BYTES = 1;
+    static inline int32_t s16(const uint8_t *p) { return ((int32_t)p[0] - 128) << 8; }
+};
+
+struct PcmS16 {
+    static const uint8_t BYTES = 2;
+    static inline int32_t s16(const uint8_t *p) { return (int16_t)(p[0] | (p[1] << 8)); }
+};
+
+/** Packed 24-bit, truncated to its top 16 bits */
+struct PcmS24 {
+    static const uint8_t BYTES = 3;
+    static inline int32_t s16(const uint8_t *p) { return (int16_t)(p[1] | (p[2] << 8)); }
+};
+
+/**
+ * IEEE 754 single, clamped to [-1, 1). Decoded with integer ops only since the M0+ has no FPU:
+ * the mantissa with its implicit 1 is shifted down by the exponent to Q15.
+ */
+struct PcmF32 {
+    static const uint8_t BYTES = 4;
+    static inline int32_t s16(const uint8_t *p) {
+        uint32_t bits = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+        int32_t exponent = (bits >> 23) & 0xFF;
+        int32_t shift = 127 + 23 - 15 - exponent;
+
+        int32_t magnitude;
+        if (shift <= 8) magnitude = 32767;
+        else if (shift >= 24) magnitude = 0;
+        else magnitude = (int32_t)((bits & 0x7FFFFF) | 0x800000) >> shift;
+
+        if (magnitude > 32767) magnitude = 32767;
+        return (bits & 0x80000000) ? -magnitude : magnitude;
+    }
+};
+
+/** Word access to 4-byte aligned addresses, compiles to a single LDR/STR */
+static inline uint32_t load_word(const uint8_t *p) {
+    uint32_t w;
+    memcpy(&w, __builtin_assume_aligned(p, 4), 4);
+    return w;
+}
+
+static inline void store_word(int16_t *p, uint32_t w) {
+    memcpy(__builtin_assume_aligned(p, 4), &w, 4);
+}
+
+static inline bool is_word_aligned(const void *p) {
+    return ((uintptr_t)p & 3) == 0;
+}
+
+/**
+ * Generic kernel, 4x unrolled. Multi-channel frames are averaged down to mono.
+ * Specializations below handle the common layouts a word at a time.
+ */
+template <typename Format, uint8_t Channels, uint8_t DacBits>
+struct SampleKernel {
+    static const uint8_t FRAME = Format::BYTES * Channels;
+
+    static inline int32_t frame_s16(const uint8_t *p) {
+        if (Channels == 1) return Format::s16(p);
+        if (Channels == 2) return (Format::s16(p) + Format::s16(p + Format::BYTES)) >> 1;
+
+        int32_t sum = 0;
+        for (uint8_t c = 0; c < Channels; ++c) sum += Format::s16(p + c * Format::BYTES);
+        return sum / Channels;
+    }
+
+    static void convert(const uint8_t *src, int16_t *dst, uint32_t frames) {
+        for (; frames >= 4; frames -= 4) {
+            dst[0] = DacCode<DacBits>::from_s16(frame_s16(src));
+            dst[1] = DacCode<DacBits>::from_s16(frame_s16(src + FRAME));
+            dst[2] = DacCode<DacBits>::from_s16(frame_s16(src + 2 * FRAME));
+            dst[3] = DacCode<DacBits>::from_s16(frame_s16(src + 3 * FRAME));
+            src += 4 * FRAME;
+            dst += 4;
+        }
+
+        while (frames--) {
+            *dst++ = DacCode<DacBits>::from_s16(frame_s16(src));
+            src += FRAME;
+        }
+    }
+};
+
+/** 16-bit mono: 2 samples per word load, converted with one shift/mask/xor */
+template <uint8_t DacBits>
+struct SampleKernel<PcmS16, 1, DacBits> {
+    static void convert(const uint8_t *src, int16_t *dst, uint32_t frames) {
+        // the word loop needs both pointers aligned, which is the case for everything past the header
+        if (!is_word_aligned(src) && frames > 0) {
+            *dst++ = DacCode<DacBits>::from_s16(PcmS16::s16(src));
+            src += 2;
+            frames--;
+        }
+
+        if (is_word_aligned(dst)) {
+            for (; frames >= 8; frames -= 8) {
+                uint32_t w0 = load_word(src), w1 = load_word(src + 4), w2 = load_word(src + 8), w3 = load_word(src + 12);
+                store_word(dst, DacCode<DacBits>::from_s16_pair(w0));
+                store_word(dst + 2, DacCode<DacBits>::from_s16_pair(w1));
+                store_word(dst + 4, DacCode<DacBits>::from_s16_pair(w2));
+                store_word(dst + 6, DacCode<DacBits>::from_s16_pair(w3));
+                src += 16;
+                dst += 8;
+            }
+        }
+
+        while (frames--) {
+            *dst++ = DacCode<DacBits>::from_s16(PcmS16::s16(src));
+            src += 2;
+        }
+    }
+};
+
+/** 16-bit stereo: one word load per frame, both halves summed before the shift */
+template <uint8_t DacBits>
+struct SampleKernel<PcmS16, 2, DacBits> {
+    static const uint32_t SHIFT = DacCode<DacBits>::SHIFT + 1;
+    static const int32_t BIAS = DacCode<DacBits>::BIAS;
+
+    static inline int16_t downmix(uint32_t w) {
+        return (int16_t)((((int32_t)(int16_t)w + ((int32_t)w >> 16)) >> SHIFT) + BIAS);
+    }
+
+    static void convert(const uint8_t *src, int16_t *dst, uint32_t frames) {
+        if (is_word_aligned(src)) {
+            for (; frames >= 4; frames -= 4) {
+                uint32_t w0 = load_word(src), w1 = load_word(src + 4), w2 = load_word(src + 8), w3 = load_word(src + 12);
+                dst[0] = downmix(w0);
+                dst[1] = downmix(w1);
+                dst[2] = downmix(w2);
+                dst[3] = downmix(w3);
+                src += 16;
+                dst += 4;
+            }
+        }
+
+        while (frames--) {
+            *dst++ = (int16_t)(((PcmS16::s16(src) + PcmS16::s16(src + 2)) >> SHIFT) + BIAS);
+            src += 4;
+        }
+    }
+};
+
+/** 8-bit unsigned mono: 4 samples per word load, u8 << (DacBits - 8) is already the DAC code */
+template <uint8_t DacBits>
+struct SampleKernel<PcmU8, 1, DacBits> {
+    static const uint32_t SHIFT = DacBits - 8;
+
+    static void convert(const uint8_t *src, int16_t *dst, uint32_t frames) {
+        while (!is_word_aligned(src) && frames > 0) {
+            *dst++ = (int16_t)(*src++ << SHIFT);
+            frames--;
+        }
+
+        if (is_word_aligned(dst)) {
+            for (; frames >= 4; frames -= 4) {
+                uint32_t w = load_word(src);
+                store_word(dst, ((w & 0xFF) | ((w << 8) & 0xFF0000)) << SHIFT);
+                store_word(dst + 2, (((w >> 16) & 0xFF) | ((w >> 8) & 0xFF0000)) << SHIFT);
+                src += 4;
+                dst += 4;
+            }
+        }
+
+        while (frames--) {
+            *dst++ = (int16_t)(*src++ << SHIFT);
+        }
+    }
+};
+
+/** 24-bit mono: 4 samples from 3 word loads, the top 2 bytes of each repacked into 2 words */
+template <uint8_t DacBits>
+struct SampleKernel<PcmS24, 1, DacBits> {
+    static void convert(const uint8_t *src, int16_t *dst, uint32_t frames) {
+        if (is_word_aligned(src) && is_word_aligned(dst)) {
+            for (; frames >= 4; frames -= 4) {
+                uint32_t w0 = load_word(src), w1 = load_word(src + 4), w2 = load_word(src + 8);
+                uint32_t s01 = ((w0 >> 8) & 0xFFFF) | (w1 << 16);
+                uint32_t s23 = (w1 >> 24) | ((w2 & 0xFF) << 8) | (w2 & 0xFFFF0000);
+                store_word(dst, DacCode<DacBits>::from_s16_pair(s01));
+                store_word(dst + 2, DacCode<DacBits>::from_s16_pair(s23));
+                src += 12;
+                dst += 4;
+            }
+        }
+
+        while (frames--) {
+            *dst++ = DacCode<DacBits>::from_s16(PcmS24::s16(src));
+            src += 3;
+        }
+    }
+};
+
+/** Samples that are already DAC codes only need copying */
+static inline void copy_dac_codes(const uint8_t *src, int16_t *dst, uint32_t frames) {
+    memcpy(dst, src, frames * sizeof(int16_t));
+}
+
+template <uint8_t DacBits>
+SampleConverterFn sample_converter(uint16_t audio_format, uint16_t bits_per_sample, uint16_t num_channels) {
+    if (audio_format == WAVE_FORMAT_DAC) {
+        return bits_per_sample == 16 && num_channels == 1 ? copy_dac_codes : NULL;
+    }
+
+    if (audio_format == WAVE_FORMAT_IEEE_FLOAT) {
+        if (bits_per_sample != 32) return NULL;
+        if (num_channels == 1) return SampleKernel<PcmF32, 1, DacBits>::convert;
+        if (num_channels == 2) return SampleKernel<PcmF32, 2, DacBits>::convert;
+        return NULL;
+    }
+
+    if (audio_format != WAVE_FORMAT_PCM) return NULL;
+
+    switch (bits_per_sample) {
+    case 8:
+        if (num_channels == 1) return SampleKernel<PcmU8, 1, DacBits>::convert;
+        if (num_channels == 2) return SampleKernel<PcmU8, 2, DacBits>::convert;
+        break;
+    case 16:
+        if (num_channels == 1) return SampleKernel<PcmS16, 1, DacBits>::convert;
+        if (num_channels == 2) return SampleKernel<PcmS16, 2, DacBits>::convert;
+        break;
+    case 24:
+        if (num_channels == 1) return SampleKernel<PcmS24, 1, DacBits>::convert;
+        if (num_channels == 2) return SampleKernel<PcmS24, 2, DacBits>::convert;
+        break;
+    }
+
+    return NULL;
+}
+
+/** Pick the kernel for a WAV format at the configured DAC_BITS, or NULL if it isn't supported */
+inline SampleConverterFn select_sample_converter(uint16_t audio_format, uint16_t bits_per_sample, uint16_t num_channels) {
+    return sample_converter<DAC_BITS>(audio_format, bits_per_sample, num_channels);
+}
+
+#endif // SAMPLE_CONVERTER_H_
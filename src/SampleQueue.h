@@ -0,0 +1,121 @@
+#ifndef SAMPLE_QUEUE_H_
+#define SAMPLE_QUEUE_H_
+
+#include <stdint.h>
+#include <atomic>
+
+/** Occupancy watermarks, in blocks, since the queue was last reset */
+typedef struct {
+    // most blocks queued right after a push
+    uint32_t high_water;
+    // fewest blocks left queued right after a pop, i.e. the closest we came to an underrun
+    uint32_t low_water;
+} SampleQueueStats;
+
+/**
+ * @brief Lock-free single-producer/single-consumer ring of DAC sample blocks.
+ *
+ * The main loop produces: it fills the block from write_block() and publishes it with push().
+ * The DMA ISR consumes: front() is the block being played, and pop() hands it back once it's
+ * done. Each index is only ever written by one side, and is published with release/acquire
+ * ordering so the block contents are visible before the index moves. No interrupt masking is
+ * needed, a plain load/store of a word is atomic on the M0+.
+ *
+ * Indices run freely and are masked on access, so Depth must be a power of 2.
+ */
+template <uint8_t Depth, uint32_t BlockSamples>
+class SampleQueue {
+    static_assert(Depth >= 2 && (Depth & (Depth - 1)) == 0, "queue depth must be a power of 2");
+
+public:
+    static const uint8_t DEPTH = Depth;
+    static const uint32_t BLOCK_SAMPLES = BlockSamples;
+
+    /** Empty the queue. Only safe while the consumer is stopped */
+    void reset() {
+        _head.store(0, std::memory_order_relaxed);
+        _tail.store(0, std::memory_order_relaxed);
+        _high_water = 0;
+        _low_water = Depth;
+    }
+
+    uint32_t count() const {
+        return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);
+    }
+
+    bool empty() const { return count() == 0; }
+    bool full() const { return count() >= Depth; }
+
+    /** Blocks never move, so a consumer can map them up front (e.g. one DMA descriptor per block) */
+    int16_t *block(uint8_t slot) { return _blocks[slot]; }
+    /** Slot write_block() will hand out next */
+    uint8_t write_slot() const { return _head.load(std::memory_order_relaxed) & (Depth - 1); }
+    /** Slot of the front block */
+    uint8_t read_slot() const { return _tail.load(std::memory_order_relaxed) & (Depth - 1); }
+
+    // -- producer
+
+    /** The next block to fill, or NULL if every block is queued */
+    int16_t *write_block() {
+        uint32_t head = _head.load(std::memory_order_relaxed);
+        if (head - _tail.load(std::memory_order_acquire) >= Depth) return NULL;
+        return _blocks[head & (Depth - 1)];
+    }
+
+    /** Publish the block from write_block() holding num_samples samples */
+    void push(uint32_t num_samples) {
+        uint32_t head = _head.load(std::memory_order_relaxed);
+        _lengths[head & (Depth - 1)] = num_samples;
+        _head.store(head + 1, std::memory_order_release);
+
+        uint32_t queued = head + 1 - _tail.load(std::memory_order_acquire);
+        if (queued > _high_water) _high_water = queued;
+    }
+
+    /** Samples in every queued block, including the front block's already played ones. Producer side */
+    uint32_t queued_samples() const {
+        uint32_t head = _head.load(std::memory_order_relaxed);
+        uint32_t samples = 0;
+        for (uint32_t i = _tail.load(std::memory_order_acquire); i != head; ++i) samples += _lengths[i & (Depth - 1)];
+        return samples;
+    }
+
+    // -- consumer
+
+    /** The oldest queued block, or NULL if the queue is empty */
+    const int16_t *front(uint32_t *num_samples) const {
+        uint32_t tail = _tail.load(std::memory_order_relaxed);
+        if (_head.load(std::memory_order_acquire) == tail) return NULL;
+
+        *num_samples = _lengths[tail & (Depth - 1)];
+        return _blocks[tail & (Depth - 1)];
+    }
+
+    /** Release the front block back to the producer */
+    void pop() {
+        uint32_t tail = _tail.load(std::memory_order_relaxed) + 1;
+        _tail.store(tail, std::memory_order_release);
+
+        // running dry is either the end of the stream or an underrun, neither is a watermark
+        uint32_t queued = _head.load(std::memory_order_acquire) - tail;
+        if (queued > 0 && queued < _low_water) _low_water = queued;
+    }
+
+    /** Watermarks since the last reset */
+    SampleQueueStats stats() const { return { _high_water, _low_water }; }
+
+private:
+    int16_t _blocks[Depth][BlockSamples] __attribute__ ((aligned (4)));
+    uint32_t _lengths[Depth];
+
+    // next block the producer will publish
+    std::atomic<uint32_t> _head { 0 };
+    // block the consumer is playing
+    std::atomic<uint32_t> _tail { 0 };
+
+    // each watermark is only written by one side
+    volatile uint8_t _high_water = 0;
+    volatile uint8_t _low_water = Depth;
+};
+
+#endif // SAMPLE_QUEUE_H_
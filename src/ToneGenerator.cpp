@@ -0,0 +1,112 @@
+#include "ToneGenerator.h"
+
+typedef struct {
+    uint16_t freq[2];
+    uint16_t on_ms, off_ms;
+    // # of cadence periods a non-looping tone plays for
+    uint8_t periods;
+} ToneSpec;
+
+static const ToneSpec TONES[] = {
+    // Tone::DIAL, continuous, so the period is only how long a non-looping dial tone lasts
+    { { 350, 440 }, 1000, 0, 1 },
+    // Tone::RINGBACK
+    { { 440, 480 }, 2000, 4000, 2 },
+    // Tone::BUSY
+    { { 480, 620 }, 500, 500, 4 },
+};
+
+/** One cycle of sin() in Q15, with the first entry repeated at the end so interpolation never wraps */
+static const int16_t SINE[257] = {
+    0, 804, 1608, 2410, 3212, 4011, 4808, 5602, 6393, 7179, 7962, 8739,
+    9512, 10278, 11039, 11793, 12539, 13279, 14010, 14732, 15446, 16151, 16846, 17530,
+    18204, 18868, 19519, 20159, 20787, 21403, 22005, 22594, 23170, 23731, 24279, 24811,
+    25329, 25832, 26319, 26790, 27245, 27683, 28105, 28510, 28898, 29268, 29621, 29956,
+    30273, 30571, 30852, 31113, 31356, 31580, 31785, 31971, 32137, 32285, 32412, 32521,
+    32609, 32678, 32728, 32757, 32767, 32757, 32728, 32678, 32609, 32521, 32412, 32285,
+    32137, 31971, 31785, 31580, 31356, 31113, 30852, 30571, 30273, 29956, 29621, 29268,
+    28898, 28510, 28105, 27683, 27245, 26790, 26319, 25832, 25329, 24811, 24279, 23731,
+    23170, 22594, 22005, 21403, 20787, 20159, 19519, 18868, 18204, 17530, 16846, 16151,
+    15446, 14732, 14010, 13279, 12539, 11793, 11039, 10278, 9512, 8739, 7962, 7179,
+    6393, 5602, 4808, 4011, 3212, 2410, 1608, 804, 0, -804, -1608, -2410,
+    -3212, -4011, -4808, -5602, -6393, -7179, -7962, -8739, -9512, -10278, -11039, -11793,
+    -12539, -13279, -14010, -14732, -15446, -16151, -16846, -17530, -18204, -18868, -19519, -20159,
+    -20787, -21403, -22005, -22594, -23170, -23731, -24279, -24811, -25329, -25832, -26319, -26790,
+    -27245, -27683, -28105, -28510, -28898, -29268, -29621, -29956, -30273, -30571, -30852, -31113,
+    -31356, -31580, -31785, -31971, -32137, -32285, -32412, -32521, -32609, -32678, -32728, -32757,
+    -32767, -32757, -32728, -32678, -32609, -32521, -32412, -32285, -32137, -31971, -31785, -31580,
+    -31356, -31113, -30852, -30571, -30273, -29956, -29621, -29268, -28898, -28510, -28105, -27683,
+    -27245, -26790, -26319, -25832, -25329, -24811, -24279, -23731, -23170, -22594, -22005, -21403,
+    -20787, -20159, -19519, -18868, -18204, -17530, -16846, -16151, -15446, -14732, -14010, -13279,
+    -12539, -11793, -11039, -10278, -9512, -8739, -7962, -7179, -6393, -5602, -4808, -4011,
+    -3212, -2410, -1608, -804, 0,
+};
+
+void ToneGenerator::start(Tone tone, bool loop) {
+    const ToneSpec *spec = &TONES[(uint8_t)tone];
+
+    for (uint8_t i = 0; i < 2; ++i) {
+        _step[i] = (uint32_t)(((uint64_t)spec->freq[i] << 32) / DAC_SAMPLE_RATE);
+        _phase[i] = 0;
+    }
+
+    _on = (uint32_t)spec->on_ms * (DAC_SAMPLE_RATE / 100) / 10;
+    _period = _on + (uint32_t)spec->off_ms * (DAC_SAMPLE_RATE / 100) / 10;
+    _position = 0;
+    _periods_left = loop ? 0 : spec->periods;
+    _done = false;
+}
+
+WavePlayerPoll ToneGenerator::poll(int16_t *samples, uint32_t max_samples, uint32_t *num_samples) {
+    uint32_t n = *num_samples;
+
+    while (n < max_samples && !_done) {
+        if (_position == _period) {
+            _position = 0;
+            if (_periods_left > 0 && --_periods_left == 0) {
+                _done = true;
+                break;
+            }
+        }
+
+        // up to the end of whichever half of the cadence we're in
+        uint32_t end = _position < _on ? _on : _period;
+        uint32_t count = max_samples - n;
+        if (count > end - _position) count = end - _position;
+
+        if (_position < _on) {
+            _synthesize(&samples[n], count);
+        } else {
+            for (uint32_t i = 0; i < count; ++i) samples[n + i] = (int16_t)DacCode<DAC_BITS>::BIAS;
+        }
+
+        n += count;
+        _position += count;
+    }
+
+    // like a file, a tone that ends partway through a block hands back the short block first
+    bool filled = n > *num_samples || !_done;
+    *num_samples = n;
+    return filled ? WavePlayerPoll::FILLED : WavePlayerPoll::DONE;
+}
+
+void ToneGenerator::_synthesize(int16_t *samples, uint32_t count) {
+    uint32_t phase0 = _phase[0], phase1 = _phase[1];
+    const uint32_t step0 = _step[0], step1 = _step[1];
+
+    while (count--) {
+        // top 8 bits of phase pick the entry, the next 8 interpolate to the one after it
+        const int16_t *a = &SINE[phase0 >> 24];
+        const int16_t *b = &SINE[phase1 >> 24];
+        int32_t s0 = a[0] + (((a[1] - a[0]) * (int32_t)((phase0 >> 16) & 0xFF)) >> 8);
+        int32_t s1 = b[0] + (((b[1] - b[0]) * (int32_t)((phase1 >> 16) & 0xFF)) >> 8);
+
+        *samples++ = DacCode<DAC_BITS>::from_s16(((s0 + s1) * TONE_AMPLITUDE) >> 15);
+
+        phase0 += step0;
+        phase1 += step1;
+    }
+
+    _phase[0] = phase0;
+    _phase[1] = phase1;
+}
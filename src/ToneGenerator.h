@@ -0,0 +1,60 @@
+#ifndef TONE_GENERATOR_H_
+#define TONE_GENERATOR_H_
+
+#include <stdint.h>
+
+#include "Resampler.h"
+#include "WavePlayer.h"
+
+/** Peak level of each of the two tones, in signed 16-bit. Both together must stay below full scale */
+#ifndef TONE_AMPLITUDE
+#define TONE_AMPLITUDE 8192
+#endif
+
+/** Call progress tones, with North American precise tone frequencies and cadences */
+enum class Tone {
+    // 350 + 440 Hz, continuous
+    DIAL = 0,
+    // 440 + 480 Hz, 2s on 4s off
+    RINGBACK,
+    // 480 + 620 Hz, 0.5s on 0.5s off
+    BUSY
+};
+
+/**
+ * @brief Fixed-point direct digital synthesis of dual-tone call progress signals.
+ *
+ * Each tone is a 32-bit phase accumulator stepping through a 256 entry sine table, with the
+ * next 8 bits of phase linearly interpolating between entries. There's no SD I/O at all, so
+ * the card is free for whatever gets played next.
+ *
+ * It's a sample source like WavePlayer, and poll() has the same contract, so a block can be
+ * filled from either one. A looping tone never ends, otherwise it stops after the tone's
+ * cadence has played a few times.
+ */
+class ToneGenerator {
+public:
+    void start(Tone tone, bool loop);
+
+    /**
+     * Synthesize samples until the block is full or the tone ends, this never waits.
+     * *num_samples is the # of samples already in the block, and is advanced by what was generated.
+     */
+    WavePlayerPoll poll(int16_t *samples, uint32_t max_samples, uint32_t *num_samples);
+
+private:
+    void _synthesize(int16_t *samples, uint32_t count);
+
+    // Q32 fraction of a cycle per output sample
+    uint32_t _step[2];
+    uint32_t _phase[2];
+
+    // cadence, in samples: the tone sounds for the first _on of every _period
+    uint32_t _on, _period;
+    uint32_t _position;
+    // cadence periods left before a non-looping tone ends, 0 if it loops
+    uint8_t _periods_left;
+    bool _done = true;
+};
+
+#endif // TONE_GENERATOR_H_
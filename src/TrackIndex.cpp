@@ -0,0 +1,145 @@
+#include <Arduino.h>
+#include <ctype.h>
+#include <string.h>
+
+#include "io.h"
+#include "TrackIndex.h"
+
+/** name is want, or the .DAC file made from it (see DacFile.h) */
+static bool same_track(const char *name, const char *want) {
+    if (strcasecmp(name, want) == 0) return true;
+
+    const char *ext = strrchr(want, '.');
+    size_t base = ext ? ext - want : strlen(want);
+    return strncasecmp(name, want, base) == 0 && strcasecmp(&name[base], ".DAC") == 0;
+}
+
+static bool is_number_file(const char *name) {
+    return isdigit(name[0]) && isdigit(name[1]) && same_track(&name[2], ".WAV");
+}
+
+bool TrackIndex::build(SdFs *sd, const char *const *clips, uint8_t num_clips) {
+    uint64_t time = micros();
+
+    if (num_clips > TRACK_INDEX_MAX_CLIPS) {
+        cout << F("TrackIndex: Too many clips ") << (uint32_t)num_clips << endl;
+        return false;
+    }
+
+    _num_tracks = 0;
+    _clip_names = clips;
+    _num_clips = num_clips;
+    memset(_slots, NO_TRACK, sizeof(_slots));
+
+    FsFile root, file;
+    if (!root.open("/")) {
+        cout << F("TrackIndex: Failed to open root directory") << endl;
+        return false;
+    }
+
+    uint8_t buf[SD_SECTOR_SIZE];
+    // every name we look for is short, so anything that doesn't fit can be skipped
+    char name[24];
+    uint32_t num_files = 0;
+
+    while (file.openNext(&root, O_RDONLY)) {
+        num_files++;
+
+        int16_t slot;
+        if (!file.isDir() && file.getName(name, sizeof(name)) > 0 && (slot = _slot_of(name)) >= 0) {
+            if (!_add(sd, &file, slot, buf)) {
+                cout << F("TrackIndex: Skipping ") << name << endl;
+            }
+        }
+
+        file.close();
+    }
+    root.close();
+
+    cout << F("TrackIndex: indexed ") << (uint32_t)_num_tracks << F(" of ") << num_files << F(" files in ")
+        << (uint32_t)(micros() - time) << F(" us, using ") << (uint32_t)sizeof(TrackIndex) << F(" bytes") << endl;
+
+    return true;
+}
+
+const TrackInfo *TrackIndex::number(uint8_t number) const {
+    if (number >= TRACK_INDEX_NUMBERS || _slots[number] == NO_TRACK) return NULL;
+    return &_tracks[_slots[number]];
+}
+
+const TrackInfo *TrackIndex::find(const char *name) const {
+    int16_t slot = _slot_of(name);
+    if (slot < 0 || _slots[slot] == NO_TRACK) return NULL;
+    return &_tracks[_slots[slot]];
+}
+
+int16_t TrackIndex::_slot_of(const char *name) const {
+    if (is_number_file(name)) {
+        return (name[0] - '0') * 10 + (name[1] - '0');
+    }
+
+    for (uint8_t i = 0; i < _num_clips; ++i) {
+        if (same_track(name, _clip_names[i])) return TRACK_INDEX_NUMBERS + i;
+    }
+
+    return -1;
+}
+
+typedef struct {
+    FsFile *file;
+    uint8_t *buf;
+    // the part of the file in buf
+    uint32_t pos, len;
+} HeaderWindow;
+
+/** Header reads come out of the last sector's worth read, only a header longer than that reads more */
+static bool read_header_window(void *ctx, uint32_t offset, void *dst, uint32_t len) {
+    HeaderWindow *window = (HeaderWindow *)ctx;
+
+    if (offset < window->pos || offset - window->pos > window->len || len > window->len - (offset - window->pos)) {
+        int n;
+        if (!window->file->seekSet(offset) || (n = window->file->read(window->buf, SD_SECTOR_SIZE)) < (int)len) {
+            return false;
+        }
+        window->pos = offset;
+        window->len = n;
+    }
+
+    memcpy(dst, &window->buf[offset - window->pos], len);
+    return true;
+}
+
+bool TrackIndex::_add(SdFs *sd, FsFile *file, uint8_t slot, uint8_t *buf) {
+    TrackInfo track;
+    track.first_sector = file->firstSector();
+    if (track.first_sector == 0) return false;
+
+    uint32_t b, e;
+    track.contiguous = file->contiguousRange(&b, &e);
+
+    // the header is almost always in the first sector, check it now so playback can skip straight
+    // to the samples
+    if (!sd->card()->readSector(track.first_sector, buf)) {
+        cout << F("TrackIndex: Failed to read sector ") << track.first_sector << endl;
+        return false;
+    }
+
+    HeaderWindow window = { file, buf, 0, SD_SECTOR_SIZE };
+    if (!WavePlayer::parse_header(read_header_window, &window, file->fileSize(), &track.format)) return false;
+
+    uint8_t index = _slots[slot];
+    if (index == NO_TRACK) {
+        if (_num_tracks == TRACK_INDEX_MAX_TRACKS) {
+            cout << F("TrackIndex: Index is full") << endl;
+            return false;
+        }
+        index = _num_tracks++;
+    } else if (track.format.audio_format != WAVE_FORMAT_DAC || _tracks[index].format.audio_format == WAVE_FORMAT_DAC) {
+        // both a WAV and the .DAC made from it are on the card, the .DAC plays without converting
+        return true;
+    }
+
+    _tracks[index] = track;
+    _slots[slot] = index;
+    return true;
+}
@@ -0,0 +1,64 @@
+#ifndef TRACK_INDEX_H_
+#define TRACK_INDEX_H_
+
+#include <stdint.h>
+#include <SdFat.h>
+
+#include "WavePlayer.h"
+
+/** Max # of files held in the index, numbers and clips combined */
+#ifndef TRACK_INDEX_MAX_TRACKS
+#define TRACK_INDEX_MAX_TRACKS 64
+#endif
+
+/** Max # of named clips that can be indexed */
+#ifndef TRACK_INDEX_MAX_CLIPS
+#define TRACK_INDEX_MAX_CLIPS 32
+#endif
+
+/** # of dialable numbers, 00-99 */
+#define TRACK_INDEX_NUMBERS 100
+
+/**
+ * @brief In-RAM index of every playable file on the card, built once at boot.
+ *
+ * The root directory is scanned a single time for NN.WAV voicemail files and a fixed list of
+ * named clips. Each file's first sector, contiguity and WAV format are recorded, so starting a
+ * track later needs no directory search, FAT walk for contiguity, or header read: the first
+ * sector read is already sample data.
+ *
+ * Numbers map straight to their slot, clips are matched against the (short) clip list. A .DAC
+ * file (see DacFile.h) stands in for the WAV of the same name, and is preferred if both exist.
+ */
+class TrackIndex {
+public:
+    /** Scan the root directory for NN.WAV files and the num_clips names in clips */
+    bool build(SdFs *sd, const char *const *clips, uint8_t num_clips);
+
+    /** The file for a dialed number 0-99, or NULL if there isn't one */
+    const TrackInfo *number(uint8_t number) const;
+    /** The file with this name, either NN.WAV or one of the clips, or NULL if it wasn't found */
+    const TrackInfo *find(const char *name) const;
+
+    uint8_t size() const { return _num_tracks; }
+    /** Every indexed file in turn, i < size() */
+    const TrackInfo *at(uint8_t i) const { return &_tracks[i]; }
+
+private:
+    static const uint8_t NO_TRACK = 0xFF;
+
+    /** The slot a file name is indexed under (numbers first, then clips), or -1 if it isn't one we want */
+    int16_t _slot_of(const char *name) const;
+    bool _add(SdFs *sd, FsFile *file, uint8_t slot, uint8_t *buf);
+
+    TrackInfo _tracks[TRACK_INDEX_MAX_TRACKS];
+    uint8_t _num_tracks = 0;
+
+    // index into _tracks for each number and then each clip, NO_TRACK if there's no file
+    uint8_t _slots[TRACK_INDEX_NUMBERS + TRACK_INDEX_MAX_CLIPS];
+
+    const char *const *_clip_names = NULL;
+    uint8_t _num_clips = 0;
+};
+
+#endif // TRACK_INDEX_H_
@@ -1,58 +1,67 @@
-#include <io.h>
-
+#include "Log.h"
+#include "LatencyHistogram.h"
 #include "WavePlayer.h"
 
 static bool wait_for_sector_start();
+#if USE_DMA && WAVEPLAYER_CHECK_CRC
+// CRCCTRL.CRCSRC value of DMA channel 0, the other channels follow on from it
+#define CRCSRC_CHANNEL_0 0x20
+static uint16_t crc16_ccitt(uint16_t crc, const uint8_t *data, size_t len);
+static uint16_t crc16_skip_sector(uint16_t crc);
+#endif
 static uint8_t spiReceive();
 static void wav_tx_dma_callback(Adafruit_ZeroDMA* dma);
 static void wav_rx_dma_callback(Adafruit_ZeroDMA* dma);
+uint32_t clusterStartSector(SdFs* fs, uint32_t cluster);
+uint32_t clusterOfSector(SdFs* fs, uint32_t sector);
 
 volatile uint8_t num_dma_callbacks = 0;
 
-static size_t active_player_count = 0;
-static WavePlayer* active_players[16];
+// the players that exist, a slot is free again once its player is destroyed
+static WavePlayer* active_players[WAVEPLAYER_MAX_PLAYERS];
 
-WavePlayer::WavePlayer(size_t buffer_size)
-    : _dma_rx_buf_size(buffer_size)
-{
-    // buffer size MUST be a multiple of the SD_SECTOR_SIZE (in bytes)
-    if (buffer_size % SD_SECTOR_SIZE != 0) {
-        _status = WavePlayerStatus::ERROR;
-        return;
-    }
+uint8_t WavePlayer::_dma_tx_byte = 0xFF;
 
-    _max_sectors = buffer_size / SD_SECTOR_SIZE;
+// the player whose multi-block read (CMD18) is open on the card, if any
+static WavePlayer* stream_owner = NULL;
 
-    _dma_rx_buf = (uint8_t*)malloc(buffer_size * 2);
-    _dma_tmp_buf = (uint8_t*)malloc(2);
-
-    _dma_tx_buf = (uint8_t*)malloc(1);
-    _dma_tx_buf[0] = 0xFF;
-
-    _dma_rx_bufs[0] = _dma_rx_buf;
-    _dma_rx_bufs[1] = _dma_rx_buf + buffer_size;
+WavePlayer::WavePlayer(uint8_t num_sectors, uint8_t *read_buf, uint8_t *tmp_buf, DmacDescriptor **desc_rx)
+    : _max_sectors(num_sectors),
+#if USE_DMA
+      desc_rx(desc_rx),
+#endif
+      _dma_rx_buf(read_buf),
+      _dma_tmp_buf(tmp_buf)
+{
+#if !USE_DMA
+    (void)desc_rx;
+#endif
 
-    // register the active player so we can map its DMA callback
-    active_players[_id = active_player_count++] = this;
+    // register the active player in a free slot so we can map its DMA callback
+    for (_id = 0; _id < WAVEPLAYER_MAX_PLAYERS && active_players[_id]; ++_id);
+    if (_id < WAVEPLAYER_MAX_PLAYERS) active_players[_id] = this;
 }
 
 WavePlayer::~WavePlayer() {
-    free(_dma_tx_buf);
-    free(_dma_tmp_buf);
-    free(_dma_rx_buf);
-
 #if USE_DMA
     _free_dma();
 #endif
 
     // unmap this player from the active list--we don't care that it was
-    active_players[_id] = NULL;
+    if (_id < WAVEPLAYER_MAX_PLAYERS) active_players[_id] = NULL;
+    if (stream_owner == this) stream_owner = NULL;
 }
 
 bool WavePlayer::init() {
+    if (_id >= WAVEPLAYER_MAX_PLAYERS) {
+        LOG_ERROR("WavePlayer: More than %u players, see WAVEPLAYER_MAX_PLAYERS", WAVEPLAYER_MAX_PLAYERS);
+        _status = WavePlayerStatus::ERROR;
+        return false;
+    }
+
 #if USE_DMA
     if (!_setup_dma()) {
-        cout << F("WavePlayer: Failed to set up DMA descriptors") << endl;
+        LOG_ERROR("WavePlayer: Failed to set up DMA descriptors");
         _status = WavePlayerStatus::ERROR;
         return false;
     }
@@ -66,340 +75,932 @@ typedef struct {
     char riff[4];
     uint32_t file_size;
     char wave[4];
-    char fmt_[4];
-    uint16_t subchunk_1_size;
+} __attribute__ ((packed)) RiffHeader;
+
+typedef struct {
+    char id[4];
+    uint32_t size;
+} __attribute__ ((packed)) RiffChunkHeader;
+
+typedef struct {
     uint16_t audio_format;
     uint16_t num_channels;
     uint32_t sample_rate;
     uint32_t byte_rate;
     uint16_t block_align;
     uint16_t bits_per_sample;
-    char data[4];
-    uint32_t data_size;
-} WaveFileHeader __attribute__ ((packed));
+} __attribute__ ((packed)) WaveFmtChunk;
 
-bool WavePlayer::start(SdFs *sd, FsFile *file, bool loop, int16_t **samples, uint32_t *num_samples) {
+bool WavePlayer::start(SdFs *sd, FsFile *file, bool loop) {
     if (!file->isOpen()) {
-        cout << F("WavePlayer: Cannot start file that is not open!") << endl;
+        LOG_ERROR("WavePlayer: Cannot start file that is not open!");
         return false;
     }
 
+    // check if the file is contiguous
+    uint32_t b, e;
+    bool contiguous = file->contiguousRange(&b, &e);
+
+    LOG_DEBUG("WavePlayer file is contiguous: %u", contiguous);
+
+    // until the header says otherwise, the data runs to the end of the file
+    if (!_begin(sd, file->firstSector(), contiguous, file->fileSize(), loop)) return false;
+
+    // the first chunk holds the header, which decides how the rest of it gets converted. it's
+    // parsed by poll() once it lands, so starting a file never waits on the card
+    if (!_start_next_read(_dma_rx_buf, _max_sectors)) {
+        LOG_ERROR("WavePlayer: No sectors to read");
+        return false;
+    }
+    _header_pending = true;
+
+    return true;
+}
+
+bool WavePlayer::start(SdFs *sd, const TrackInfo *track, bool loop, const uint8_t *head) {
+    const WaveFormat &format = track->format;
+    if (!_begin(sd, track->first_sector, track->contiguous, format.data_offset + format.data_size, loop)) return false;
+
+    // the header was checked when the track was indexed, so the first read is all samples
+    if (!_apply_format(format)) return false;
+    _header_pending = false;
+    _seek(format.data_offset);
+
+    if (head) {
+        // as if a one sector read had landed in it
+        _read_buf = (uint8_t *)head;
+        _read_pos = _skip;
+        _skip = 0;
+        _read_len = min((uint32_t)SD_SECTOR_SIZE, _data_end - (uint32_t)_sector_index * SD_SECTOR_SIZE);
+        _sector_index++;
+        _sectors_to_read = 1;
+        _num_sectors_read = 1;
+        return true;
+    }
+
+    // a DAC file's first read waits for poll(), so it can land straight in the block
+    if (!_direct && !_start_next_read(_dma_rx_buf, _max_sectors)) {
+        LOG_ERROR("WavePlayer: No sectors to read");
+        return false;
+    }
+
+    return true;
+}
+
+bool WavePlayer::_begin(SdFs *sd, uint32_t first_sector, bool contiguous, uint32_t file_size, bool loop) {
     if (_status != WavePlayerStatus::READY) {
-        cout << F("WavePlayer: Cannot start file, requires state ") << (uint32_t)WavePlayerStatus::READY << F(" but player was in state ") << (uint32_t)_status << endl;
+        LOG_ERROR("WavePlayer: Cannot start file, requires state %u but player was in state %u", WavePlayerStatus::READY, _status);
         return false;
     }
 
     _sd = sd;
-    _file = file;
+    _first_sector = first_sector;
+    _contiguous = contiguous;
     _loop = loop;
     _sector_index = 0;
+    _skip = 0;
 
-    // check if the file is contiguous
-    uint32_t b, e;
-    _contiguous = _file->contiguousRange(&b, &e);
+    _file_sectors = (int32_t)((file_size + (SD_SECTOR_SIZE - 1)) / SD_SECTOR_SIZE);
+    _num_extents = 0;
+    _extent_index = 0;
+    _next_cluster = 0;
 
-    cout << F("WavePlayer file is contiguous: ") << _contiguous << endl;
+    if (!_contiguous) {
+        uint8_t fat_type = _sd->fatType();
+        if (fat_type != FAT_TYPE_FAT16 && fat_type != FAT_TYPE_FAT32 && fat_type != FAT_TYPE_EXFAT) {
+            LOG_ERROR("WavePlayer: Unsupported FAT type %u", fat_type);
+            return false;
+        }
 
-    uint32_t first_sector, num_sectors;
-    _get_next_chunk(&first_sector, &num_sectors);
+        // map the first stretch of the cluster chain up front so chunk lookups never walk the FAT
+        uint64_t map_time = micros();
+        _fat_cache_sector = 0;
+        if (!_load_extents(clusterOfSector(_sd, _first_sector), 0)) {
+            LOG_ERROR("WavePlayer: Failed to map file extents");
+            return false;
+        }
 
-    if (num_sectors == 0) {
-        cout << F("WavePlayer: No sectors to read") << endl;
-        return false;
+        LOG_INFO("WavePlayer: mapped %u extents in %u us", _num_extents, micros() - map_time);
     }
 
-    if (!_start_read_chunk(first_sector, num_sectors)) {
-        cout << F("WavePlayer: Failed to read chunk, aborting") << endl;
+    _read_len = 0;
+    _read_pos = 0;
+    _carry_len = 0;
+    _convert_time = 0;
+    _data_end = file_size;
+    _direct = false;
+    _done = false;
+#if USE_DMA
+    // each file starts out trusting the card with whole chunks
+    _chain_limit = _max_sectors;
+#endif
+
+    return true;
+}
+
+bool WavePlayer::parse_header(WaveHeaderReadFn read, void *ctx, uint32_t file_size, WaveFormat *format) {
+    union {
+        DacFileHeader dac;
+        RiffHeader riff;
+        RiffChunkHeader chunk;
+        WaveFmtChunk fmt;
+        uint32_t fact_samples;
+    } h;
+
+    if (!read(ctx, 0, &h, sizeof(h.dac))) {
+        LOG_ERROR("WavePlayer: File is too short");
         return false;
     }
 
-    // wait until we have read the first sector of the file
-    Timeout timeout(10000ul);
-    while (_num_sectors_read < 1) {
-        if (timeout.timed_out()) {
-            cout << F("WavePlayer: timed out reading first chunk") << endl;
+    if (memcmp(h.dac.magic, DAC_FILE_MAGIC, sizeof(h.dac.magic)) == 0) {
+        const DacFileHeader *dac = &h.dac;
+
+        // the samples were scaled for one DAC resolution, they can't be played at another
+        if (dac->version != DAC_FILE_VERSION || dac->dac_bits != DAC_BITS) {
+            LOG_ERROR("WavePlayer: Unsupported DAC file version %u, %u bits", dac->version, dac->dac_bits);
             return false;
         }
-        yield();
+
+        if (dac->sample_rate < RESAMPLER_MIN_RATE || dac->sample_rate > RESAMPLER_MAX_RATE) {
+            LOG_ERROR("WavePlayer: Invalid sample rate %u", dac->sample_rate);
+            return false;
+        }
+
+        format->sample_rate = dac->sample_rate;
+        format->audio_format = WAVE_FORMAT_DAC;
+        format->num_channels = 1;
+        format->bits_per_sample = 16;
+        format->block_align = sizeof(int16_t);
+        format->data_offset = DAC_FILE_DATA_OFFSET;
+        format->data_size = min(dac->num_samples * (uint32_t)sizeof(int16_t),
+            file_size > DAC_FILE_DATA_OFFSET ? file_size - DAC_FILE_DATA_OFFSET : 0);
+
+        // fall back to looping the whole file if the loop points don't make sense
+        format->loop_start = dac->loop_start * sizeof(int16_t);
+        format->loop_end = dac->loop_end * sizeof(int16_t);
+        if (format->loop_end > format->data_size || format->loop_start >= format->loop_end) {
+            format->loop_start = 0;
+            format->loop_end = format->data_size;
+        }
+
+        return true;
     }
 
-    cout << F("WavePlayer: read first chunk") << endl;
-
-    WaveFileHeader *header = reinterpret_cast<WaveFileHeader *>(_dma_rx_bufs[0]);
-    cout << F("WAVE HEADER") << endl;
-    cout << F("  RIFF: ") << header->riff[0] << header->riff[1] << header->riff[2] << header->riff[3] << endl;
-    cout << F("  FILE_SIZE: ") << header->file_size << endl;
-    cout << F("  WAVE: ") << header->wave[0] << header->wave[1] << header->wave[2] << header->wave[3] << endl;
-    cout << F("  FMT: ") << header->fmt_[0] << header->fmt_[1] << header->fmt_[2] << header->fmt_[3] << endl;
-    cout << F("  SUBCHUNK_1_SIZE: ") << header->subchunk_1_size << endl;
-    cout << F("  AUDIO_FORMAT: ") << header->audio_format << endl;
-    cout << F("  NUM_CHANNELS: ") << header->num_channels << endl;
-    cout << F("  SAMPLE_RATE: ") << header->sample_rate << endl;
-    cout << F("  BYTE_RATE: ") << header->byte_rate << endl;
-    cout << F("  BLOCK_ALIGN: ") << header->block_align << endl;
-    cout << F("  BITS_PER_SAMPLES: ") << header->bits_per_sample << endl;
-    cout << F("  DATA: ") << header->data[0] << header->data[1] << header->data[2] << header->data[3] << endl;
-    cout << F("  DATA_SIZE: ") << header->data_size << endl;
-
-    // validate that the file is indeed a RIFF WAV 
-    if (header->riff[0] != 'R' || header->riff[1] != 'I' || header->riff[2] != 'F' || header->riff[3] != 'F'
-        || header->wave[0] != 'W' || header->wave[1] != 'A' || header->wave[2] != 'V' || header->wave[3] != 'E'
-    ) {
-        cout << F("WavePlayer: File is not a WAV file") << endl;
+    // validate that the file is indeed a RIFF WAV
+    if (memcmp(h.riff.riff, "RIFF", 4) != 0 || memcmp(h.riff.wave, "WAVE", 4) != 0) {
+        LOG_ERROR("WavePlayer: File is not a WAV file");
         return false;
     }
 
-    if (header->num_channels != 1) {
-        cout << F("WavePlayer: File must have 1 channel") << endl;
-        return false;
+    // walk the chunks up to the sample data. fmt has to come before it, fact is optional and
+    // anything else (LIST, bext, JUNK, ...) is skipped over
+    bool have_fmt = false;
+    uint32_t fact_samples = 0;
+    uint32_t pos = sizeof(RiffHeader);
+    uint32_t data_size;
+
+    while (true) {
+        // data_offset is 16 bits to keep the track index small, which is plenty for any header
+        if (pos > UINT16_MAX - sizeof(RiffChunkHeader) || file_size - pos < sizeof(RiffChunkHeader)) {
+            LOG_ERROR("WavePlayer: No data chunk");
+            return false;
+        }
+
+        if (!read(ctx, pos, &h.chunk, sizeof(h.chunk))) goto read_err;
+        uint32_t size = h.chunk.size;
+        pos += sizeof(RiffChunkHeader);
+
+        if (memcmp(h.chunk.id, "data", 4) == 0) {
+            data_size = size;
+            break;
+        }
+
+        if (memcmp(h.chunk.id, "fmt ", 4) == 0) {
+            // WAVE_FORMAT_EXTENSIBLE and ADPCM both add to the end of the PCM fmt, the start is the same
+            if (size < sizeof(WaveFmtChunk) || !read(ctx, pos, &h.fmt, sizeof(h.fmt))) goto read_err;
+
+            format->sample_rate = h.fmt.sample_rate;
+            format->audio_format = h.fmt.audio_format;
+            format->num_channels = h.fmt.num_channels;
+            format->bits_per_sample = h.fmt.bits_per_sample;
+            format->block_align = h.fmt.block_align;
+            have_fmt = true;
+        } else if (memcmp(h.chunk.id, "fact", 4) == 0 && size >= sizeof(uint32_t)) {
+            // # of samples per channel, compressed formats need it to know where the last block ends
+            if (!read(ctx, pos, &h.fact_samples, sizeof(h.fact_samples))) goto read_err;
+            fact_samples = h.fact_samples;
+        }
+
+        // chunks are padded to an even # of bytes
+        if (size >= file_size - pos) {
+            LOG_ERROR("WavePlayer: No data chunk");
+            return false;
+        }
+        pos += size + (size & 1);
     }
 
-    if (header->sample_rate != 44100) {
-        cout << F("WavePlayer: Invalid sample rate ") << header->sample_rate << endl;
+    if (!have_fmt) {
+        LOG_ERROR("WavePlayer: No fmt chunk before the data");
         return false;
     }
 
-    if (header->bits_per_sample != 16) {
-        cout << F("WavePlayer: Invalid Bit Rate ") << header->bits_per_sample << endl;
+    // anything not at the DAC rate goes through the resampler
+    if (format->sample_rate < RESAMPLER_MIN_RATE || format->sample_rate > RESAMPLER_MAX_RATE) {
+        LOG_ERROR("WavePlayer: Invalid sample rate %u", format->sample_rate);
         return false;
     }
 
-    uint64_t time = micros();
+    // the data chunk's size may run past the end of a truncated file, or be 0 or ~0 from a
+    // writer that never went back to fill it in
+    format->data_offset = pos;
+    if (data_size == 0 || data_size > file_size - pos) data_size = file_size - pos;
+
+    if (format->audio_format == WAVE_FORMAT_IMA_ADPCM) {
+        if (!ImaAdpcmDecoder::supported(format->num_channels, format->bits_per_sample, format->block_align)) {
+            LOG_ERROR("WavePlayer: Unsupported ADPCM format, %u channels, %u bits, block align %u",
+                format->num_channels, format->bits_per_sample, format->block_align);
+            return false;
+        }
 
-    // once we've parsed the header, convert the rest of the samples in the header
-    _convert(sizeof(WaveFileHeader), (SD_SECTOR_SIZE - sizeof(WaveFileHeader)) / 2);
+        // the last block is padded out to a whole block, fact says how many of its samples are
+        // real. cut it at the unit with the last one, the rest of that unit still plays
+        uint32_t unit = 4 * format->num_channels;
+        uint32_t block_samples = (format->block_align / unit - 1) * IMA_ADPCM_UNIT_SAMPLES + 1;
+        if (fact_samples > 0) {
+            uint32_t rest = fact_samples % block_samples;
+            uint32_t bytes = (fact_samples / block_samples) * format->block_align;
+            if (rest > 0) bytes += (1 + (rest - 1 + IMA_ADPCM_UNIT_SAMPLES - 1) / IMA_ADPCM_UNIT_SAMPLES) * unit;
+            data_size = min(data_size, bytes);
+        }
 
-    // convert any additional sectors read in the DMA
-    for (uint32_t i = 1; i < num_sectors; ++i) {
-        // wait for this sector to be read
-        timeout.reset();
-        while (_num_sectors_read <= i) {
-            if (timeout.timed_out()) {
-                cout << F("WavePlayer: timed out waiting for sector ") << i << endl;
-                goto err;
-            }
+        // only whole units can be decoded
+        data_size -= data_size % unit;
+    } else {
+        if (!select_sample_converter(format->audio_format, format->bits_per_sample, format->num_channels)) {
+            LOG_ERROR("WavePlayer: Unsupported sample format %u, %u channels, %u bits",
+                format->audio_format, format->num_channels, format->bits_per_sample);
+            return false;
+        }
 
-            yield();
+        if (format->block_align != format->num_channels * (format->bits_per_sample / 8)
+            || format->block_align > WAVEPLAYER_MAX_FRAME_SIZE) {
+            LOG_ERROR("WavePlayer: Invalid block align %u", format->block_align);
+            return false;
         }
 
-        // convert the next sector
-        _convert(i * SD_SECTOR_SIZE, SD_SECTOR_SIZE / 2);
+        // stop on the last whole frame, so a looping file wraps around on a frame boundary
+        data_size -= data_size % format->block_align;
     }
 
-    cout << F("WavePlayer: Converted ") << (num_sectors * SD_SECTOR_SIZE - sizeof(WaveFileHeader)) / 2 << F(" samples in ")
-        << micros() - time << F(" us") << endl;
+    // stop at the end of the sample data rather than the end of the sector, so the next track
+    // can follow on from the last real sample
+    format->data_size = data_size;
+    format->loop_start = 0;
+    format->loop_end = format->data_size;
+
+    return true;
 
-    _sector_index += num_sectors;
+read_err:
+    LOG_ERROR("WavePlayer: Failed to read chunk at %u", pos);
+    return false;
+}
 
-    // output the start of the appropriate sample buf & number of usable samples at the address for 
-    // use with playback DMA
-    *samples = reinterpret_cast<int16_t*>(&_dma_rx_bufs[0][sizeof(WaveFileHeader)]);
-    *num_samples = (num_sectors * SD_SECTOR_SIZE - sizeof(WaveFileHeader)) / 2;
+bool WavePlayer::_apply_format(const WaveFormat &format) {
+    if (!_resampler.configure(format.sample_rate, DAC_SAMPLE_RATE)) return false;
+    _stage_pos = _stage_len = 0;
+
+    if (format.audio_format == WAVE_FORMAT_IMA_ADPCM) {
+        // ADPCM is decoded a unit at a time, the decoder keeps track of where it is in a block
+        _converter = NULL;
+        _adpcm.configure(format.num_channels, format.block_align);
+        _frame_size = _adpcm.unit_size();
+        _frame_samples = IMA_ADPCM_UNIT_SAMPLES;
+    } else {
+        // pick the conversion kernel once for the whole file
+        _converter = select_sample_converter(format.audio_format, format.bits_per_sample, format.num_channels);
+        if (!_converter) return false;
+
+        _frame_size = format.block_align;
+        _frame_samples = 1;
+    }
+
+    _data_offset = format.data_offset;
+    _loop_offset = format.data_offset + format.loop_start;
+    _data_end = format.data_offset + (_loop ? format.loop_end : format.data_size);
+    if (_read_len > _data_end) _read_len = _data_end;
+
+    // ready-made DAC codes at the DAC rate need no conversion at all
+    _direct = format.audio_format == WAVE_FORMAT_DAC && _resampler.passthrough();
 
     return true;
+}
 
-err:
-    return false;
+typedef struct {
+    const uint8_t *buf;
+    uint32_t len;
+} HeaderBuffer;
+
+/** Header reads for a file whose start is already in memory */
+static bool read_header_buffer(void *ctx, uint32_t offset, void *dst, uint32_t len) {
+    const HeaderBuffer *header = (const HeaderBuffer *)ctx;
+    if (offset > header->len || len > header->len - offset) return false;
+
+    memcpy(dst, &header->buf[offset], len);
+    return true;
 }
 
-void WavePlayer::_swap_buffers() {
-    uint8_t *tmp = _dma_rx_bufs[0];
-    _dma_rx_bufs[0] = _dma_rx_bufs[1];
-    _dma_rx_bufs[1] = tmp;
+bool WavePlayer::_parse_header() {
+    // before the header is parsed, the data end is the end of the file. the whole header has to
+    // be in the first read, the track index has no such limit since it can read more of the file
+    WaveFormat format;
+    HeaderBuffer header = { _dma_rx_buf, _read_len };
+    if (!parse_header(read_header_buffer, &header, _data_end, &format)) return false;
+
+    if (format.audio_format != WAVE_FORMAT_DAC) {
+        LOG_DEBUG("WAVE HEADER: format %u, %u channels, %u Hz", format.audio_format, format.num_channels, format.sample_rate);
+        LOG_DEBUG("  block align %u, %u bits per sample", format.block_align, format.bits_per_sample);
+        LOG_DEBUG("  data at %u, %u bytes", format.data_offset, format.data_size);
+    }
+
+    if (!_apply_format(format)) return false;
+
+    // the first read started at the top of the file, skip ahead to the samples
+    if (_data_offset < _read_len) {
+        _read_pos = _data_offset;
+    } else {
+        _read_pos = _read_len;
+        _seek(_data_offset);
+    }
+
+    return true;
 }
 
-uint32_t clusterStartSector(SdFat32* fat, uint32_t cluster) {
-    return fat->dataStartSector() + ((cluster - 2) << fat->sectorsPerClusterShift()); 
+uint32_t clusterStartSector(SdFs* fs, uint32_t cluster) {
+    return fs->dataStartSector() + ((cluster - 2) << __builtin_ctz(fs->sectorsPerCluster()));
 }
 
-uint32_t clusterOfSector(SdFat32* fat, uint32_t sector) {
-    return 2 + ((sector - fat->dataStartSector()) >> fat->sectorsPerClusterShift());
+uint32_t clusterOfSector(SdFs* fs, uint32_t sector) {
+    return 2 + ((sector - fs->dataStartSector()) >> __builtin_ctz(fs->sectorsPerCluster()));
 }
 
-void WavePlayer::_get_next_chunk(uint32_t *sector_out, uint32_t *num_sectors_out) {
+void WavePlayer::_get_next_chunk(uint32_t max_sectors, uint32_t *sector_out, uint32_t *num_sectors_out) {
     if (_contiguous) {
         // if the WHOLE file is contiguous, we can just calculate based on sector indices
+        *sector_out = _first_sector + _sector_index;
+        *num_sectors_out = max(0, min((int32_t)max_sectors, _file_sectors - _sector_index));
+        return;
+    }
 
-        // # of sectors is file size rounded UP
-        int32_t total_file_sectors = (int32_t)((_file->fileSize() + (SD_SECTOR_SIZE - 1)) / SD_SECTOR_SIZE);
-        *sector_out = _file->firstSector() + _sector_index;
-        *num_sectors_out = max(0, min(_max_sectors, total_file_sectors - _sector_index));
-    } 
-    else {
-        // if the file is NOT contiguous, we can only use 
-        uint32_t first_sector = _file->firstSector();
-        uint32_t sec_per_cluster = _sd->sectorsPerCluster();
-
-        if (_sd->fatType() == FAT_TYPE_FAT32) {
-            SdFat32 *sdfat = (SdFat32*)_sd;
-
-            uint32_t cur_cluster = clusterOfSector(sdfat, first_sector);
-            // # of clusters to advance
-            uint32_t num_clusters = _sector_index / sec_per_cluster;
-            for (uint32_t i = 0; i < num_clusters; ++i) {
-                if (!sdfat->dbgFat(cur_cluster, &cur_cluster)) {
-                    *sector_out = 0;
-                    *num_sectors_out = 0;
-                    return;
-                }
-            }
+    // if the file is NOT contiguous, look the position up in the extent map
+    if (_sector_index >= _file_sectors) goto err;
 
-            *sector_out = clusterStartSector(sdfat, cur_cluster) + ((first_sector + _sector_index) % sec_per_cluster);
-            *num_sectors_out = max(0, min(sec_per_cluster, _max_sectors));
-        } else {
-            cout << F("Unsupported FAT type: ") << endl;
-            _sd->printFatType(&Serial);
-            goto err;
+    // rewound (e.g. looping) behind the current extent, look from the start of the cached window,
+    // or remap from the start of the chain if it's behind that too
+    if (_num_extents > 0 && (uint32_t)_sector_index < _extents[_extent_index].file_sector) _extent_index = 0;
+    if (_num_extents == 0 || _sector_index < (int32_t)_extents[0].file_sector) {
+        if (!_load_extents(clusterOfSector(_sd, _first_sector), 0)) goto err;
+    }
+
+    // reads are sequential, so this only ever steps forward by one extent per chunk
+    while ((uint32_t)_sector_index >= _extents[_extent_index].file_sector + _extents[_extent_index].num_sectors) {
+        if (_extent_index + 1 < _num_extents) {
+            _extent_index++;
+            continue;
         }
+
+        // ran off the end of the cached window, continue mapping from where it left off
+        if (_next_cluster == 0) goto err;
+
+        const SectorExtent &last = _extents[_num_extents - 1];
+        if (!_load_extents(_next_cluster, last.file_sector + last.num_sectors)) goto err;
     }
 
+    {
+        const SectorExtent &ext = _extents[_extent_index];
+        uint32_t offset = _sector_index - ext.file_sector;
+        int32_t run = (int32_t)(ext.num_sectors - offset);
+
+        *sector_out = ext.sector + offset;
+        *num_sectors_out = max(0, min((int32_t)max_sectors, min(run, _file_sectors - _sector_index)));
+    }
     return;
 
 err:
+    *sector_out = 0;
     *num_sectors_out = 0;
 }
 
-bool WavePlayer::read_and_convert(int16_t **samples, uint32_t *num_samples) {
-    // first swap buffers before we start the next read, since we ALWAYS read info _dma_rx_bufs[0]
-    _swap_buffers();
+bool WavePlayer::_load_extents(uint32_t cluster, uint32_t file_sector) {
+    // walking the FAT reads the card
+    end_stream();
+    uint32_t sec_per_cluster = _sd->sectorsPerCluster();
 
-    // find which sector to read a contiguous chunk for
-    // TODO: deal with partial sectors (e.g. EOF)
-    uint32_t sector = 0, ns = 0;
-    _get_next_chunk(&sector, &ns);
+    _num_extents = 0;
+    _extent_index = 0;
+    _next_cluster = 0;
 
-    // if there are no more sectors left to read in the file, indicate that the playback should stop
-    if (ns == 0) return false;
+    SectorExtent *ext = NULL;
+    while ((int32_t)file_sector < _file_sectors) {
+        uint32_t sector = clusterStartSector(_sd, cluster);
 
-    // if we're starting from sector 0, then we need to skip the header. this happens when we are looping
-    uint32_t skip_bytes = _sector_index == 0 ? sizeof(WaveFileHeader) : 0;
+        // merge physically adjacent clusters into a single run
+        if (ext && ext->sector + ext->num_sectors == sector) {
+            ext->num_sectors += sec_per_cluster;
+        } else {
+            if (_num_extents == WAVEPLAYER_MAX_EXTENTS) {
+                // table is full, pick up from this cluster on the next refill
+                _next_cluster = cluster;
+                break;
+            }
 
-    // start a DMA for that sector
-    if (!_start_read_chunk(sector, ns)) {
-        cout << F("WavePlayer: Failed to read chunk, aborting") << endl;
-        return false;
+            ext = &_extents[_num_extents++];
+            ext->sector = sector;
+            ext->file_sector = file_sector;
+            ext->num_sectors = sec_per_cluster;
+        }
+
+        file_sector += sec_per_cluster;
+        if ((int32_t)file_sector >= _file_sectors) break;
+
+        int8_t fat_status = _fat_next(cluster, &cluster);
+        if (fat_status < 0) {
+            LOG_ERROR("WavePlayer: Failed to read FAT entry");
+            return false;
+        }
+
+        // end of chain
+        if (fat_status == 0) break;
     }
-    
-    // convert sector-by sector as the DMA progresses in the background
-    Timeout timeout(1000000ul);
-    for (uint32_t i = 0; i < ns; ++i) {
-        // wait for this sector to be read
-        while (_num_sectors_read <= i) {
-            if (timeout.timed_out()) {
-                cout << F("WavePlayer: timed out waiting for sector ") << i << endl;
-                goto err;
+
+    return _num_extents > 0;
+}
+
+int8_t WavePlayer::_fat_next(uint32_t cluster, uint32_t *next) {
+    uint8_t fat_type = _sd->fatType();
+
+    // FAT16 entries are 2 bytes, FAT32 and exFAT entries 4
+    uint32_t offset = fat_type == FAT_TYPE_FAT16 ? cluster * 2 : cluster * 4;
+    uint32_t sector = _sd->fatStartSector() + offset / SD_SECTOR_SIZE;
+
+    if (sector != _fat_cache_sector) {
+        if (!_sd->card()->readSector(sector, _fat_cache)) return -1;
+        _fat_cache_sector = sector;
+    }
+
+    const uint8_t *entry = &_fat_cache[offset % SD_SECTOR_SIZE];
+    uint32_t value;
+    bool end_of_chain;
+    if (fat_type == FAT_TYPE_FAT16) {
+        uint16_t value16;
+        memcpy(&value16, entry, sizeof(value16));
+        value = value16;
+        end_of_chain = value >= 0xFFF8;
+    } else if (fat_type == FAT_TYPE_FAT32) {
+        // only the low 28 bits are the cluster
+        memcpy(&value, entry, sizeof(value));
+        value &= 0x0FFFFFFF;
+        end_of_chain = value >= 0x0FFFFFF8;
+    } else {
+        memcpy(&value, entry, sizeof(value));
+        end_of_chain = value == 0xFFFFFFFF;
+    }
+
+    if (end_of_chain) return 0;
+    // free, reserved or bad clusters can't be part of a file
+    if (value < 2 || value > _sd->clusterCount() + 1) return -1;
+
+    *next = value;
+    return 1;
+}
+
+bool WavePlayer::read_and_convert(int16_t *samples, uint32_t max_samples, uint32_t *num_samples) {
+    *num_samples = 0;
+
+    WavePlayerPoll result;
+    while ((result = poll(samples, max_samples, num_samples)) == WavePlayerPoll::PENDING) {
+        yield();
+    }
+
+    // if there are no more samples left in the file, indicate that the playback should stop
+    return result == WavePlayerPoll::FILLED;
+}
+
+WavePlayerPoll WavePlayer::poll(int16_t *samples, uint32_t max_samples, uint32_t *num_samples) {
+    _poll_start_time = micros();
+    _io_time = 0;
+
+    WavePlayerPoll result = _poll(samples, max_samples, num_samples);
+
+    // time spent starting reads is the card's, the rest is conversion
+    _convert_time += micros() - _poll_start_time - _io_time;
+    return result;
+}
+
+WavePlayerPoll WavePlayer::_poll(int16_t *samples, uint32_t max_samples, uint32_t *num_samples) {
+    if (_header_pending) {
+        int8_t ready = _bytes_ready(_read_len);
+        if (ready == 0) return WavePlayerPoll::PENDING;
+        if (ready < 0 || !_parse_header()) {
+            _done = true;
+            return WavePlayerPoll::ERROR;
+        }
+
+        _header_pending = false;
+    }
+
+    if (_direct) return _poll_direct(samples, max_samples, num_samples);
+
+    uint32_t n = *num_samples;
+    WavePlayerPoll result = WavePlayerPoll::FILLED;
+
+    while (n < max_samples) {
+        uint32_t converted;
+
+        if (_resampler.passthrough() && _stage_pos == _stage_len && max_samples - n >= _frame_samples) {
+            // source is already at the DAC rate, convert straight into the sample buffer
+            result = _convert_frames(&samples[n], max_samples - n, &converted);
+            if (result != WavePlayerPoll::FILLED) break;
+            n += converted;
+            continue;
+        }
+
+        // otherwise convert a batch into the staging buffer and resample it from there. an ADPCM
+        // unit that won't fit in the end of the block is staged too, and copied out in pieces
+        if (_stage_pos == _stage_len) {
+            result = _convert_frames(_stage, WAVEPLAYER_STAGE_LEN, &converted);
+            if (result != WavePlayerPoll::FILLED) break;
+            _stage_pos = 0;
+            _stage_len = converted;
+        }
+
+        uint32_t produced;
+        if (_resampler.passthrough()) {
+            produced = min(_stage_len - _stage_pos, max_samples - n);
+            memcpy(&samples[n], &_stage[_stage_pos], produced * sizeof(int16_t));
+            _stage_pos += produced;
+        } else {
+            _stage_pos += _resampler.process(&_stage[_stage_pos], _stage_len - _stage_pos,
+                &samples[n], max_samples - n, &produced);
+        }
+        n += produced;
+    }
+
+    *num_samples = n;
+
+    if (n == max_samples) return WavePlayerPoll::FILLED;
+    // hand back whatever made it into the block before the end of the file
+    if (result == WavePlayerPoll::DONE && n > 0) return WavePlayerPoll::FILLED;
+    return result;
+}
+
+uint32_t WavePlayer::_decode(const uint8_t *src, int16_t *dst, uint32_t frames) {
+    if (!_converter) return _adpcm.decode(src, dst, frames);
+
+    _converter(src, dst, frames);
+    return frames;
+}
+
+WavePlayerPoll WavePlayer::_convert_frames(int16_t *samples, uint32_t max_samples, uint32_t *num_samples) {
+    if (_done) return WavePlayerPoll::DONE;
+
+    int8_t ready;
+
+    // finish a frame that was split across the end of the previous read
+    if (_carry_len > 0) {
+        uint32_t rest = _frame_size - _carry_len;
+        if ((ready = _bytes_ready(rest)) <= 0) goto not_ready;
+
+        memcpy(&_carry[_carry_len], _read_buf, rest);
+        *num_samples = _decode(_carry, samples, 1);
+        _read_pos = rest;
+        _carry_len = 0;
+
+        return WavePlayerPoll::FILLED;
+    }
+
+    if (_read_len - _read_pos < _frame_size) {
+        // read buffer is used up, keep any partial frame for the next read
+        uint32_t remaining = _read_len - _read_pos;
+        if (remaining > 0) {
+            if ((ready = _bytes_ready(_read_len)) <= 0) goto not_ready;
+            memcpy(_carry, &_read_buf[_read_pos], remaining);
+            _carry_len = remaining;
+        }
+
+        _end_read_chunk();
+
+        // the last read stopped at the end of the sample data, so there's nothing past it to convert
+        if (!_start_next_read(_dma_rx_buf, _max_sectors)) {
+            _done = true;
+            _carry_len = 0;
+            return WavePlayerPoll::DONE;
+        }
+
+        // give the caller a turn while the new read gets going
+        return WavePlayerPoll::PENDING;
+    }
+
+    // convert sector-by-sector as the read progresses in the background
+    if ((ready = _bytes_ready(_read_pos + _frame_size)) <= 0) goto not_ready;
+
+    {
+        uint32_t landed = min((uint32_t)_sectors_landed() * SD_SECTOR_SIZE, _read_len);
+        uint32_t frames = min((landed - _read_pos) / _frame_size, max_samples / _frame_samples);
+
+        *num_samples = _decode(&_read_buf[_read_pos], samples, frames);
+        _read_pos += frames * _frame_size;
+    }
+    return WavePlayerPoll::FILLED;
+
+not_ready:
+    if (ready == 0) return WavePlayerPoll::PENDING;
+    _done = true;
+    return WavePlayerPoll::ERROR;
+}
+
+WavePlayerPoll WavePlayer::_poll_direct(int16_t *samples, uint32_t max_samples, uint32_t *num_samples) {
+    uint32_t n = *num_samples;
+    WavePlayerPoll result = WavePlayerPoll::FILLED;
+
+    while (n < max_samples) {
+        if (_read_pos >= _read_len) {
+            if (_done) {
+                result = WavePlayerPoll::DONE;
+                break;
             }
 
-            yield();
+            _end_read_chunk();
+
+            // whole sectors that fit in the rest of the block are read straight into it. once a
+            // file has been spliced in partway through a block, one sector per block straddles
+            // the end of it, only that one goes through the read buffer
+            uint32_t room = (max_samples - n) * sizeof(int16_t) / SD_SECTOR_SIZE;
+            bool started = room > 0
+                ? _start_next_read((uint8_t *)&samples[n], room)
+                : _start_next_read(_dma_rx_buf, 1);
+            if (!started) {
+                _done = true;
+                result = WavePlayerPoll::DONE;
+                break;
+            }
+
+            result = WavePlayerPoll::PENDING;
+            break;
         }
 
-        // convert the next sector
-        _convert(i * SD_SECTOR_SIZE, SD_SECTOR_SIZE / 2);
+        int8_t ready = _bytes_ready(_read_pos + sizeof(int16_t));
+        if (ready <= 0) {
+            if (ready < 0) _done = true;
+            result = ready < 0 ? WavePlayerPoll::ERROR : WavePlayerPoll::PENDING;
+            break;
+        }
+
+        uint32_t landed = min((uint32_t)_sectors_landed() * SD_SECTOR_SIZE, _read_len);
+        uint32_t count = min((landed - _read_pos) / (uint32_t)sizeof(int16_t), max_samples - n);
+
+        // a read into the block has already landed where it belongs, unless it started partway
+        // into a sector (a loop start), then it only has to be shifted down
+        const uint8_t *src = &_read_buf[_read_pos];
+        if (src != (const uint8_t *)&samples[n]) memmove(&samples[n], src, count * sizeof(int16_t));
+
+        n += count;
+        _read_pos += count * sizeof(int16_t);
     }
 
-    _end_read_chunk();
+    *num_samples = n;
 
-    _sector_index += ns;
-    if (_loop && _sector_index >= ((_file->fileSize() + SD_SECTOR_SIZE - 1) / SD_SECTOR_SIZE)) {
-        _sector_index = 0;
+    if (n == max_samples) return WavePlayerPoll::FILLED;
+    // hand back whatever made it into the block before the end of the file
+    if (result == WavePlayerPoll::DONE && n > 0) return WavePlayerPoll::FILLED;
+    return result;
+}
+
+void WavePlayer::_seek(uint32_t offset) {
+    _sector_index = offset / SD_SECTOR_SIZE;
+    _skip = offset % SD_SECTOR_SIZE;
+    _carry_len = 0;
+    // seeks only ever land on the start of the data, which is the start of an ADPCM block
+    _adpcm.restart();
+}
+
+bool WavePlayer::_start_next_read(uint8_t *buf, uint32_t max_sectors) {
+    uint32_t data_sectors = (_data_end + (SD_SECTOR_SIZE - 1)) / SD_SECTOR_SIZE;
+    if (_loop && (uint32_t)_sector_index >= data_sectors) {
+        _seek(_loop_offset);
+    }
+
+    // find which sector to read a contiguous chunk for, nothing past the sample data is worth reading
+    uint32_t sector = 0, ns = 0;
+    if ((uint32_t)_sector_index < data_sectors) {
+        _get_next_chunk(min(max_sectors, (uint32_t)_max_sectors), &sector, &ns);
+    }
+
+    // if there are no more sectors left to read in the file, indicate that the playback should stop
+    if (ns == 0) {
+        if (stream_owner == this) end_stream();
+        return false;
     }
 
-    // TODO handle partial sectors, e.g. EOF
-    *samples = reinterpret_cast<int16_t*>(&_dma_rx_bufs[0][skip_bytes]);
-    *num_samples = (ns * SD_SECTOR_SIZE - skip_bytes) / 2;
+    // start a DMA for that sector
+    _read_buf = buf;
+    _read_timeout.reset();
+    uint32_t start_time = micros();
+    bool started = _start_read_chunk(sector, ns);
+    _io_time += micros() - start_time;
+    if (!started) {
+        LOG_ERROR("WavePlayer: Failed to read chunk, aborting");
+        return false;
+    }
+
+    // skip the start of the first sector after a seek, e.g. the header when looping
+    _read_pos = _skip;
+    _skip = 0;
+
+    // the last read of the data may end partway through a sector
+    _read_len = min(ns * SD_SECTOR_SIZE, _data_end - (uint32_t)_sector_index * SD_SECTOR_SIZE);
+    _sector_index += ns;
     return true;
+}
 
-err:
-    return false;
+int8_t WavePlayer::_bytes_ready(uint32_t bytes) {
+    bytes = min(bytes, _read_len);
+
+    if ((uint32_t)_sectors_landed() * SD_SECTOR_SIZE >= bytes) return 1;
+
+#if USE_DMA
+    // the DMA stopped partway through the read, see player_dma_callback()
+    if (_dma_next != DmaNext::DATA && _num_sectors_read < _sectors_to_read && !_resume_dma()) return -1;
+#endif
+
+    if (_read_timeout.timed_out()) {
+        LOG_ERROR("WavePlayer: timed out waiting for sector %u", bytes / SD_SECTOR_SIZE);
+        return -1;
+    }
+
+    return 0;
 }
 
-void WavePlayer::_convert(uint32_t offset_bytes, uint32_t sample_count) {
-    // cout << F("Converting ") << dec << sample_count << F(" samples from offset ") << offset_bytes << endl; 
-    int16_t *pcm_samples = reinterpret_cast<int16_t*>(&_dma_rx_bufs[0][offset_bytes]);
-    for (uint32_t i = 0; i < sample_count; ++i) {
-        pcm_samples[i] = (pcm_samples[i] >> 6) + 512;
+uint8_t WavePlayer::_sectors_landed() {
+#if USE_DMA && !WAVEPLAYER_CHECK_CRC
+    // the chain only interrupts once it's done. until then the RX channel's write-back descriptor
+    // shows where it has got to: a sector's data block writes into the read buffer, the blocks
+    // after it into _dma_tmp_buf. with CRC checking, nothing counts until the whole chain has
+    noInterrupts();
+    uint8_t landed = _num_sectors_read;
+    if (_chain_running) {
+        uintptr_t dst = ((DmacDescriptor *)DMAC->WRBADDR.reg)[dma_rx.getChannel()].DSTADDR.reg;
+        uintptr_t tmp = (uintptr_t)_dma_tmp_buf;
+        uintptr_t buf = (uintptr_t)_read_buf + SD_SECTOR_SIZE * _chain_base;
+        uint8_t done = 0;
+        if (dst > tmp && dst <= tmp + 4 * _chain_len) {
+            done = (dst - tmp - 1) / 4 + 1;
+        } else if (dst > buf && dst <= buf + SD_SECTOR_SIZE * _chain_len) {
+            done = (dst - buf) / SD_SECTOR_SIZE - 1;
+        }
+
+        // past a slip the chain reads the gap in as data, so a sector only counts if the one
+        // before it ended in its start token
+        uint8_t framed = done ? 1 : 0;
+        while (framed < done && _dma_tmp_buf[4 * (framed - 1) + 3] == DATA_START_SECTOR) framed++;
+        landed += framed;
     }
+    interrupts();
+    return landed;
+#else
+    return _num_sectors_read;
+#endif
 }
 
 void WavePlayer::_end_read_chunk() {
-    //cout << F("Ending chunk read") << endl;
-    //_free_dma();
+    // the chunk is used up, charge it with the part of this poll() up to now
+    uint32_t now = micros();
+    if (_read_len > 0) hot_path.convert.record(_convert_time + (now - _poll_start_time - _io_time));
+    _convert_time = 0;
+    _poll_start_time = now;
+    _io_time = 0;
+}
+
+void WavePlayer::stop() {
+#if USE_DMA
+    dma_tx.abort();
+    dma_rx.abort();
+    _chain_running = false;
+#endif
+
+    if (stream_owner == this) end_stream();
+    _read_len = 0;
+    _read_pos = 0;
+    _done = true;
+}
+
+void WavePlayer::end_stream() {
+    if (!stream_owner) return;
+
+    // CMD12, the card stops sending wherever it had got to
+    stream_owner->_sd->card()->readStop();
+    stream_owner = NULL;
+}
+
+bool WavePlayer::_open_stream(uint32_t sector, bool *resumed) {
+    // sequential chunks, i.e. every chunk of a contiguous file, keep reading from the same command.
+    // the card only sends as the bus is clocked, so it waits between chunks for free
+    *resumed = stream_owner == this && _stream_sector == sector;
+    if (*resumed) return true;
+
+    end_stream();
+    if (!_sd->card()->readStart(sector)) return false;
+
+    stream_owner = this;
+    _stream_sector = sector;
+    return true;
 }
 
 bool WavePlayer::_start_read_chunk(uint32_t sector, uint32_t ns) {
+    uint32_t start_time = micros();
+    bool resumed;
+
 #if USE_DMA
     ZeroDMAstatus dma_status = DMA_STATUS_OK;
 
-    if (!_sd->card()->readStart(sector)) {
-        cout << F("WavePlayer: Failed to start read of sector ") << sector << endl;
+    // the last sector went wrong, the card's read can't be carried on from it
+    if (stream_owner == this && _dma_next == DmaNext::REOPEN) end_stream();
+
+    if (!_open_stream(sector, &resumed)) {
+        LOG_ERROR("WavePlayer: Failed to start read of sector %u", sector);
         goto err;
     }
 
-    if (!wait_for_sector_start()) {
-        cout << F("WavePlayer: Failed to get sector start after readStart") << endl;
+    // a read that carries on may have had its start token come in with the last CRC
+    if (!(resumed && _dma_next == DmaNext::DATA) && !wait_for_sector_start()) {
+        LOG_ERROR("WavePlayer: Failed to get sector start after readStart");
         goto err;
     }
 
-    cout << F("Starting read of ") << ns << F(" sectors at sector ") << sector << endl;
+    // a read that carries on only waits for its next sector, so only a new command counts
+    _sector_time = micros();
+    if (!resumed) hot_path.sd_first_byte.record(_sector_time - start_time);
 
-    // if (sector != _file->firstSector()) {
-    //     // read a full sector
-    //     cout << hex << uppercase;
-    //     for (int i = 0; i < 516 * 4; ++i) {
-    //         if (i % 16 == 0) cout << endl;
-    //         cout << (uint32_t)spiReceive() << F(" ");
-    //     }
-    // }
+    LOG_DEBUG("WavePlayer: Starting read of %u sectors at sector %u", ns, sector);
 
-    // point the sector DMA to the END of the first 
-
-    // if (dma_tx.print != DMA_STATUS_OK) {
-    //     cout << F("")
-    // }
-    
-    desc_tx->BTCNT.bit.BTCNT = SD_SECTOR_SIZE + 4;
-
-    desc_rx[0]->BTCNT.bit.BTCNT = 2;
-    desc_rx[1]->BTCNT.bit.BTCNT = SD_SECTOR_SIZE;
-    desc_rx[1]->DSTADDR.bit.DSTADDR
-        = (uint32_t)(&_dma_rx_bufs[0][SD_SECTOR_SIZE]);
-    desc_rx[2]->BTCNT.bit.BTCNT = 2;
+#if WAVEPLAYER_CHECK_CRC
+    // there's one CRC engine for every channel, so point it at this player's RX for each read.
+    // its CRC16 is the CCITT polynomial the card uses
+    DMAC->CTRL.bit.CRCENABLE = 0;
+    DMAC->CRCCTRL.reg = DMAC_CRCCTRL_CRCBEATSIZE_BYTE | DMAC_CRCCTRL_CRCPOLY_CRC16
+        | DMAC_CRCCTRL_CRCSRC(CRCSRC_CHANNEL_0 + dma_rx.getChannel());
+    DMAC->CTRL.bit.CRCENABLE = 1;
+#endif
 
-    // how many sectors to read
+    // how many sectors to read, the read stays open after them
     _sectors_to_read = ns;
+    _stream_sector = sector;
     // clear the # of sectors read
     _num_sectors_read = 0;
+    _sector_retries = 0;
+    _dma_next = DmaNext::DATA;
 
-    // start the RX job
-    dma_status = dma_rx.startJob();
+    dma_status = _start_chain(min(ns, (uint32_t)_chain_limit));
     if (dma_status != DMA_STATUS_OK) {
-        cout << F("WavePlayer: Failed to start RX job, status: ") << (uint32_t)dma_status << endl;
+        LOG_ERROR("WavePlayer: Failed to start sector DMA, status: %u", dma_status);
         goto err;
     }
 
-    dma_status = dma_tx.startJob();
-    if (dma_status != DMA_STATUS_OK) {
-        cout << F("WavePlayer: Failed to start TX job, status: ") << (uint32_t)dma_status << endl;
-        goto err;
-    }
-    
-    cout << F("WavePlayer: Finished chunk setup, triggering TX") << endl;
-
-    // trigger the TX job which will trigger the RX job until completion
-    dma_tx.trigger();
-
     return true;
 
 err:
+    end_stream();
     _status = WavePlayerStatus::ERROR;
     return false;
 #else
-    //cout << F("WavePlayer: Reading ") << ns << F(" sectors from ") << sector << F(" into ") << hex << (uint32_t)_dma_rx_bufs[0] << dec << endl;
-    if (!_sd->card()->readSectors(sector, _dma_rx_bufs[0], ns)) {
-        cout << F("WavePlayer: Failed to read ") << ns << F(" sectors from sector ") << sector << endl;
+    if (!_open_stream(sector, &resumed)) {
+        LOG_ERROR("WavePlayer: Failed to start read of sector %u", sector);
         return false;
     }
 
+    // a blocking read can't tell the start token from the data, so the first byte is just the command
+    uint32_t time = micros();
+    if (!resumed) hot_path.sd_first_byte.record(time - start_time);
+
+    for (uint32_t i = 0; i < ns; ++i) {
+        uint8_t retries = 0;
+        while (!_sd->card()->readData(&_read_buf[i * SD_SECTOR_SIZE])) {
+            // e.g. a bad CRC, with SdFat's USE_SD_CRC. the card has already moved past the sector,
+            // so the read is sent again from it
+            end_stream();
+            if (retries++ == WAVEPLAYER_READ_RETRIES || !_open_stream(sector + i, &resumed)) {
+                LOG_ERROR("WavePlayer: Failed to read %u sectors from sector %u", ns, sector);
+                end_stream();
+                return false;
+            }
+            _read_retries++;
+        }
+
+        uint32_t now = micros();
+        hot_path.sd_sector.record(now - time);
+        time = now;
+    }
+
+    _stream_sector = sector + ns;
     _num_sectors_read = ns;
     return true;
 #endif
@@ -407,18 +1008,147 @@ err:
 
 #if USE_DMA
 void WavePlayer::player_dma_callback() {
-    _num_sectors_read++;
-    if (_num_sectors_read >= _sectors_to_read) return;
+    uint8_t ns = _chain_len;
+    _chain_running = false;
+
+    // each sector's CRC and the 2 bytes read after it, normally the gap and the next sector's
+    // start token. past a slip the rest of the chain is out of step with the card
+    uint8_t framed = 1;
+    while (framed < ns && _dma_tmp_buf[4 * (framed - 1) + 3] == DATA_START_SECTOR) framed++;
+    uint8_t good = framed;
+
+#if WAVEPLAYER_CHECK_CRC
+    // the engine ran over the whole chain. a good sector and its CRC leave it at 0, so all that's
+    // left is the CRC of the 2 bytes after each sector, carried on over the sectors that follow
+    uint16_t expected = 0;
+    for (uint8_t k = 0; k < ns; ++k) {
+        expected = crc16_ccitt(crc16_skip_sector(expected), &_dma_tmp_buf[4 * k + 2], 2);
+    }
+    if (DMAC->CRCCHKSUM.reg != expected) {
+        // there's no telling which sector it was, so the whole chain is read again, and shorter
+        // chains lose less to the next one
+        good = 0;
+        _read_retries += ns;
+        _sector_retries++;
+        _chain_limit = max(framed < ns ? framed : ns / 2, 1);
+    } else {
+        _sector_retries = 0;
+    }
+#endif
+
+    if (good) {
+        uint32_t now = micros();
+        uint32_t per_sector = (now - _sector_time) / good;
+        for (uint8_t k = 0; k < good; ++k) hot_path.sd_sector.record(per_sector);
+        _sector_time = now;
+    }
+
+    _stream_sector += good;
+    _num_sectors_read += good;
+
+    if (good < ns) {
+        // the card is somewhere past the last good sector, the main loop sends the read again
+        // from it, see _resume_dma(). stop the chain short of where the card fell behind
+        if (framed < ns) _chain_limit = framed;
+        _dma_next = DmaNext::REOPEN;
+        return;
+    }
+
+    // a clean chain earns back a sector
+    if (_chain_limit < _max_sectors) _chain_limit++;
+
+    const uint8_t *next = &_dma_tmp_buf[4 * (ns - 1) + 2];
+    if (next[1] == DATA_START_SECTOR) {
+        _dma_next = DmaNext::DATA;
+    } else if (next[0] == 0xFF && next[1] == 0xFF) {
+        // the card is slower to the next sector than one byte, the main loop waits it out
+        _dma_next = DmaNext::TOKEN;
+    } else {
+        // an error token, or the framing slipped
+        _dma_next = DmaNext::REOPEN;
+    }
 
-    // advance the sector pointer
-    desc_rx[1]->DSTADDR.bit.DSTADDR
-        = (uint32_t)(_dma_rx_bufs[0] + SD_SECTOR_SIZE * (_num_sectors_read + 1));
+    if (_num_sectors_read >= _sectors_to_read || _dma_next != DmaNext::DATA) return;
 
-    // restart the jobs to read the next sector
-    dma_tx.startJob();
-    dma_rx.startJob();
+    // the chain was cut short of the read, carry on with the rest
+    if (_start_chain(min(_sectors_to_read - _num_sectors_read, (int)_chain_limit)) != DMA_STATUS_OK) {
+        _dma_next = DmaNext::REOPEN;
+    }
+}
+
+ZeroDMAstatus WavePlayer::_start_chain(uint8_t ns) {
+    uint8_t base = _num_sectors_read;
+
+    // the DMAC wants the end of each destination
+    for (uint8_t k = 0; k < ns; ++k) {
+        desc_rx[3 * k]->DSTADDR.reg = (uintptr_t)(_read_buf + SD_SECTOR_SIZE * (base + k + 1));
+    }
+
+    // end the chain after sector ns - 1, putting back the link the last chain was cut at
+    if (_chain_cut != ns - 1) {
+        if (_chain_cut + 1 < _max_sectors) {
+            desc_rx[3 * _chain_cut + 2]->DESCADDR.reg = (uintptr_t)desc_rx[3 * _chain_cut + 3];
+        }
+        desc_rx[3 * ns - 1]->DESCADDR.reg = 0;
+        _chain_cut = ns - 1;
+    }
+    desc_tx->BTCNT.reg = ns * (SD_SECTOR_SIZE + 4);
+
+#if WAVEPLAYER_CHECK_CRC
+    DMAC->CRCSTATUS.reg = DMAC_CRCSTATUS_CRCBUSY;
+    DMAC->CRCCHKSUM.reg = 0;
+#else
+    // clear what the last chain left in the write-back descriptor, see _sectors_landed()
+    ((DmacDescriptor *)DMAC->WRBADDR.reg)[dma_rx.getChannel()].DSTADDR.reg = 0;
+#endif
 
-    dma_tx.trigger();
+    _chain_base = base;
+    _chain_len = ns;
+    _chain_running = true;
+
+    // RX first so it's waiting on the first byte back. TX clocks the bus from the moment it's
+    // enabled, the SPI data register is empty
+    ZeroDMAstatus dma_status = dma_rx.startJob();
+    if (dma_status == DMA_STATUS_OK) dma_status = dma_tx.startJob();
+    if (dma_status != DMA_STATUS_OK) {
+        dma_rx.abort();
+        _chain_running = false;
+    }
+    return dma_status;
+}
+
+bool WavePlayer::_resume_dma() {
+    bool resumed;
+    ZeroDMAstatus dma_status;
+
+    if (_sector_retries > WAVEPLAYER_READ_RETRIES) {
+        LOG_ERROR("WavePlayer: Sectors from %u failed their CRC %u times", _stream_sector, _sector_retries);
+        goto err;
+    }
+
+    // the card has moved past a bad sector, so the read is sent again from it
+    if (stream_owner == this && _dma_next == DmaNext::REOPEN) end_stream();
+
+    if (!_open_stream(_stream_sector, &resumed) || !wait_for_sector_start()) {
+        LOG_ERROR("WavePlayer: Failed to pick the read back up at sector %u", _stream_sector);
+        goto err;
+    }
+
+    _sector_time = micros();
+    _dma_next = DmaNext::DATA;
+
+    dma_status = _start_chain(min(_sectors_to_read - _num_sectors_read, (int)_chain_limit));
+    if (dma_status != DMA_STATUS_OK) {
+        LOG_ERROR("WavePlayer: Failed to start sector DMA, status: %u", dma_status);
+        goto err;
+    }
+
+    return true;
+
+err:
+    end_stream();
+    _status = WavePlayerStatus::ERROR;
+    return false;
 }
 
 void WavePlayer::_free_dma() {
@@ -429,85 +1159,87 @@ void WavePlayer::_free_dma() {
 }
 
 bool WavePlayer::_setup_dma() {
-    ZeroDMAstatus dma_status = dma_tx.allocate();
+    ZeroDMAstatus dma_status;
+
+    // init() runs again after an error, start over from free channels rather than adding to them
+    _free_dma();
+
+    dma_status = dma_tx.allocate();
     if (dma_status != DMA_STATUS_OK) {
-        cout << F("WavePlayer: Couldn't allocate TX DMA, status: ") << dma_status << endl;
+        LOG_ERROR("WavePlayer: Couldn't allocate TX DMA, status: %u", dma_status);
         goto err;
     }
 
-    dma_tx.setTrigger(SPI.getDMAC_ID_RX());
+    // DMA trigger is the SPI data register being empty, so TX keeps a byte ready behind the one
+    // on the wire. the count is set for each chain
+    dma_tx.setTrigger(SPI.getDMAC_ID_TX());
     dma_tx.setAction(DMA_TRIGGER_ACTON_BEAT);
     desc_tx = dma_tx.addDescriptor(
-        (void*)(&_dma_tx_buf[0]),
+        (void*)(&_dma_tx_byte),
         (void*)(SPI.getDataRegister()),
-        SD_SECTOR_SIZE + 4,
+        _max_sectors * (SD_SECTOR_SIZE + 4),
         DMA_BEAT_SIZE_BYTE,
         false,
         false);
     if (!desc_tx) {
-        cout << F("WavePlayer: Failed adding DMAC descriptor to TX channel.") << endl;
+        LOG_ERROR("WavePlayer: Failed adding DMAC descriptor to TX channel.");
         goto err;
     }
     dma_tx.setCallback(wav_tx_dma_callback);
 
-    cout << F("Registered DMA channel ") << (uint32_t)dma_tx.getChannel() << F(" as TX") << endl; 
+    LOG_DEBUG("WavePlayer: Registered DMA channel %u as TX", dma_tx.getChannel());
 
-    // -- Set up RX descriptor
+    // -- Set up RX descriptors
     dma_status = dma_rx.allocate();
     if (dma_status != DMA_STATUS_OK) {
-        cout << F("WavePlayer: Couldn't allocate RX DMA, status: ") << dma_status << endl;
+        LOG_ERROR("WavePlayer: Couldn't allocate RX DMA, status: %u", dma_status);
         goto err;
     }
     // DMA trigger is SPI receive
-    dma_rx.setTrigger(SPI.getDMAC_ID_TX());
+    dma_rx.setTrigger(SPI.getDMAC_ID_RX());
     // transfer 1 beat at a time
     dma_rx.setAction(DMA_TRIGGER_ACTON_BEAT);
-    desc_rx[0] = dma_rx.addDescriptor(
-        (void*)(SPI.getDataRegister()),
-        (void*)(&_dma_tmp_buf[0]),
-        2,
-        DMA_BEAT_SIZE_BYTE,
-        false,
-        true);
-    if (!desc_rx[0]) {
-        cout << F("WavePlayer: Failed adding DMAC descriptor 0 to RX channel.") << endl;
-        goto err;
-    }
 
-    desc_rx[1] = dma_rx.addDescriptor(
-        // DMA from the SPI data register
-        (void*)(SPI.getDataRegister()),
-        // leave dst null for now--we'll set this before we start the job
-        (void*)(&_dma_rx_bufs[0][0]),
-        // transfer 1 sector
-        SD_SECTOR_SIZE,
-        // 1 byte at a time
-        DMA_BEAT_SIZE_BYTE,
-        // do NOT increment src (stay at the spi register)
-        false,
-        // DO increment dst, so we read into successive bytes
-        true);
-    if (!desc_rx[1]) {
-        cout << F("WavePlayer: Failed adding DMAC descriptor 1 to RX channel.") << endl;
-        goto err;
-    }
-
-    desc_rx[2] = dma_rx.addDescriptor(
-        (void*)(SPI.getDataRegister()),
-        (void*)(&_dma_tmp_buf[0]),
-        2,
-        DMA_BEAT_SIZE_BYTE,
-        false,
-        true);
-    // desc_rx[2]->BTCTRL.reg |= DMAC_BTCTRL_BLOCKACT_INT;
-    if (!desc_rx[2]) {
-        cout << F("WavePlayer: Failed adding DMAC descriptor 2 to RX channel.") << endl;
-        goto err;
+    for (uint8_t i = 0; i < _max_sectors; ++i) {
+        // 1 sector from the SPI data register into successive bytes of the read buffer. the
+        // destination is set before each chain starts
+        desc_rx[3 * i] = dma_rx.addDescriptor(
+            (void*)(SPI.getDataRegister()),
+            (void*)(&_dma_rx_buf[i * SD_SECTOR_SIZE]),
+            SD_SECTOR_SIZE,
+            DMA_BEAT_SIZE_BYTE,
+            false,
+            true);
+
+        // the sector's CRC
+        desc_rx[3 * i + 1] = dma_rx.addDescriptor(
+            (void*)(SPI.getDataRegister()),
+            (void*)(&_dma_tmp_buf[4 * i]),
+            2,
+            DMA_BEAT_SIZE_BYTE,
+            false,
+            true);
+
+        // and what follows it, which lets the next sector carry on without a round trip through the CPU
+        desc_rx[3 * i + 2] = dma_rx.addDescriptor(
+            (void*)(SPI.getDataRegister()),
+            (void*)(&_dma_tmp_buf[4 * i + 2]),
+            2,
+            DMA_BEAT_SIZE_BYTE,
+            false,
+            true);
+
+        if (!desc_rx[3 * i] || !desc_rx[3 * i + 1] || !desc_rx[3 * i + 2]) {
+            LOG_ERROR("WavePlayer: Failed adding DMAC descriptors for sector %u to RX channel.", i);
+            goto err;
+        }
     }
+    // the chain as built ends after the last sector
+    _chain_cut = _max_sectors - 1;
 
     dma_rx.setCallback(wav_rx_dma_callback);
 
-    cout << F("Registered DMA channel ") << (uint32_t)dma_rx.getChannel() << F(" as RX") << endl; 
+    LOG_DEBUG("WavePlayer: Registered DMA channel %u as RX", dma_rx.getChannel());
 
     return true;
 
@@ -538,6 +1270,30 @@ static bool wait_for_sector_start() {
     return true;
 }
 
+#if USE_DMA && WAVEPLAYER_CHECK_CRC
+/** The CRC16 an SD card sends after each sector (CCITT polynomial, starting from 0), carried on from crc */
+static uint16_t crc16_ccitt(uint16_t crc, const uint8_t *data, size_t len) {
+    while (len--) {
+        crc ^= (uint16_t)*data++ << 8;
+        for (uint8_t i = 0; i < 8; ++i) crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+/** crc carried on over the 514 bytes of a sector and its CRC, i.e. crc * x^(514 * 8) mod the CCITT polynomial */
+static uint16_t crc16_skip_sector(uint16_t crc) {
+    // x^(514 * 8) mod x^16 + x^12 + x^5 + 1
+    const uint16_t x_sector = 0x90C2;
+
+    uint16_t product = 0;
+    for (int8_t i = 15; i >= 0; --i) {
+        product = product & 0x8000 ? (product << 1) ^ 0x1021 : product << 1;
+        if (crc >> i & 1) product ^= x_sector;
+    }
+    return product;
+}
+#endif
+
 static void wav_tx_dma_callback(Adafruit_ZeroDMA* dma) {
     (void)dma;
 }
@@ -548,7 +1304,7 @@ static void wav_rx_dma_callback(Adafruit_ZeroDMA* dma) {
     num_dma_callbacks++;
 
     WavePlayer *player = NULL;
-    for (uint8_t i = 0; i < active_player_count; ++i) {
+    for (uint8_t i = 0; i < WAVEPLAYER_MAX_PLAYERS; ++i) {
         if (active_players[i] == NULL) continue;
 
         if (active_players[i]->owns_dma(dma)) {
@@ -7,18 +7,108 @@
 #include <SPI.h>
 #include <SdFat.h>
 
+#include "SampleConverter.h"
+#include "Resampler.h"
+#include "DacFile.h"
+#include "ImaAdpcm.h"
+
 #ifndef USE_DMA
 #define USE_DMA 0
 #endif
 
 #define SD_SECTOR_SIZE 512
 
+/** Max # of contiguous sector runs cached for a fragmented file. The table is refilled from the FAT when exhausted */
+#ifndef WAVEPLAYER_MAX_EXTENTS
+#define WAVEPLAYER_MAX_EXTENTS 16
+#endif
+
 enum class WavePlayerStatus {
     NOTINITIALIZED = 0,
     READY,
     ERROR
 };
 
+/** Progress of WavePlayer::poll() */
+enum class WavePlayerPoll {
+    // waiting on the card, call again later with the same block
+    PENDING = 0,
+    // the block is full, or holds the last samples of the file
+    FILLED,
+    // the file has ended and nothing more was converted
+    DONE,
+    ERROR
+};
+
+/** How long a sector read may be outstanding before it's treated as failed */
+#ifndef WAVEPLAYER_READ_TIMEOUT_US
+#define WAVEPLAYER_READ_TIMEOUT_US 1000000ul
+#endif
+
+/**
+ * Check each sector's CRC16 in the DMAC's CRC engine as it's read, and read it again if it doesn't
+ * match. DMA builds only, blocking builds get the same from SdFat's USE_SD_CRC, in software.
+ */
+#ifndef WAVEPLAYER_CHECK_CRC
+#define WAVEPLAYER_CHECK_CRC 0
+#endif
+
+/** # of times a sector that failed to read (e.g. a bad CRC) is asked for again before the read fails */
+#ifndef WAVEPLAYER_READ_RETRIES
+#define WAVEPLAYER_READ_RETRIES 3
+#endif
+
+/** # of converted source samples staged ahead of the resampler */
+#ifndef WAVEPLAYER_STAGE_LEN
+#define WAVEPLAYER_STAGE_LEN 128
+#endif
+
+/** # of WavePlayers that can exist at once, each one takes a slot to route its DMA interrupts */
+#ifndef WAVEPLAYER_MAX_PLAYERS
+#define WAVEPLAYER_MAX_PLAYERS 4
+#endif
+
+/** Largest WAV frame (block align) that can be played */
+#define WAVEPLAYER_MAX_FRAME_SIZE 8
+
+/** How to play a WAV file, from its header */
+typedef struct {
+    uint32_t sample_rate;
+    // # of bytes of sample data, clamped to the file
+    uint32_t data_size;
+    // a looping file wraps from loop_end back to loop_start, both in bytes from the first sample
+    uint32_t loop_start;
+    uint32_t loop_end;
+    // byte offset of the first sample in the file, the start of the data chunk's body
+    uint16_t data_offset;
+    uint16_t audio_format;
+    // bytes per frame, or per compressed block for ADPCM
+    uint16_t block_align;
+    uint8_t num_channels;
+    uint8_t bits_per_sample;
+} WaveFormat;
+
+/** Read len bytes of a file's header at offset into dst, false if they can't be read */
+typedef bool (*WaveHeaderReadFn)(void *ctx, uint32_t offset, void *dst, uint32_t len);
+
+/** Everything needed to start a file without going through the directory or reading its header */
+typedef struct {
+    uint32_t first_sector;
+    WaveFormat format;
+    // all of the file's clusters are in one run
+    bool contiguous;
+} TrackInfo;
+
+/** A run of physically contiguous sectors belonging to the current file */
+typedef struct {
+    // first sector of the run on the card
+    uint32_t sector;
+    // file-relative index of the first sector in the run
+    uint32_t file_sector;
+    // # of sectors in the run
+    uint32_t num_sectors;
+} SectorExtent;
+
 class Timeout { 
 public:
     Timeout(uint64_t delay) : _delay(delay) {
@@ -41,32 +131,60 @@ private:
  * @brief DMA-based Wave file player using SdFat raw sector volume APIs and Adafruit_ZeroDMA to read from the Sd card.
  * 
  * Usage:
- * 1. instantiate with some buffer size. This will allocate double that size since we double-buffer
- * WavePlayer player(1024);
+ * 1. instantiate a StaticWavePlayer with the # of sectors to read at a time. Its read buffer is
+ *    part of the object, the DAC samples are converted into blocks owned by the caller (the
+ *    AudioPlayer queue)
+ * StaticWavePlayer<2> player;
  * 
  * file.open("00.wav", FILE_READ);
- * player.open(&file);
+ * player.start(&sd, &file, false);
  * 
- * when PLAY completes a chunk
- *      - swap buffers, start the next chunk playing
- *      - call start_next_read()
- *      - call CONVERT on the most recently read chunk
- *      - IDLE until PLAY completes this chunk
+ * while the AudioPlayer has a free block
+ *      - call poll() on it from loop(). It converts whatever sectors have landed, starts the
+ *        next read when the last one is used up, and returns PENDING rather than waiting on
+ *        the card, so the rest of loop() keeps running during reads
+ *      - once it returns FILLED, enqueue the block for playback and start on the next one
  */
 class WavePlayer {
 public:
-    WavePlayer(size_t buffer_size);
     ~WavePlayer();
 
     WavePlayerStatus status() { return _status; };
 
     bool init();
 
-    // load a WAV and load its first chunk of data
-    bool start(SdFs* sd, FsFile* file, bool loop, int16_t **samples, uint32_t *num_samples);
+    // open a WAV and start reading its first chunk of data, the header is checked by the first poll()
+    bool start(SdFs* sd, FsFile* file, bool loop);
+    // start a file that has already been located and checked (see TrackIndex). head, if not NULL, is
+    // its first sector of sample data already read (see PrefetchPool), it's converted from there
+    // while the read of the rest gets going, and has to stay put until the first poll() is done with it
+    bool start(SdFs* sd, const TrackInfo* track, bool loop, const uint8_t *head = NULL);
+    /** Abandon the current file, ending the card's multi-block read if this player has it open */
+    void stop();
+
+    /**
+     * End the multi-block read a player left open on the card. Anything else that talks to the
+     * card must call this first, between reads.
+     */
+    static void end_stream();
 
-    /** Do a DMA-based read and simultaneous conversion of the next chunk of data. */
-    bool read_and_convert(int16_t **samples, uint32_t *num_samples);
+    /** # of sectors that had to be read again, e.g. after a CRC error */
+    uint32_t read_retries() const { return _read_retries; }
+
+    /**
+     * Walk the chunks of a WAV (or DAC file) header and fill in how to play it. Only the chunk
+     * headers, fmt and fact are read, through read, so the header can be any length.
+     */
+    static bool parse_header(WaveHeaderReadFn read, void *ctx, uint32_t file_size, WaveFormat *format);
+
+    /**
+     * Convert as much as is available into samples, without waiting on the card.
+     * *num_samples is the # of samples already in the block, and is advanced by what was converted.
+     */
+    WavePlayerPoll poll(int16_t *samples, uint32_t max_samples, uint32_t *num_samples);
+
+    /** Blocking read and conversion of up to max_samples into samples, false once the file has ended. */
+    bool read_and_convert(int16_t *samples, uint32_t max_samples, uint32_t *num_samples);
 
 #if USE_DMA
     /** Check if this player owns a specific DMA channel */
@@ -76,67 +194,205 @@ public:
 
     void player_dma_callback();
 #endif
+protected:
+    /**
+     * Play through storage owned by a StaticWavePlayer: a read buffer of num_sectors sectors,
+     * 4 bytes per sector of DMA scratch and 3 RX descriptor pointers per sector
+     */
+    WavePlayer(uint8_t num_sectors, uint8_t *read_buf, uint8_t *tmp_buf, DmacDescriptor **desc_rx);
+
 private:
 #if USE_DMA
     bool _setup_dma();
     void _free_dma();
+    /** Start the DMA of the next ns sectors of the current read as one chain, the first one's start token already read */
+    ZeroDMAstatus _start_chain(uint8_t ns);
+    /** Pick a read back up after the DMA stopped short of a start token or on a bad sector */
+    bool _resume_dma();
 #endif
+    /** # of sectors of the current read that have landed in the read buffer */
+    uint8_t _sectors_landed();
 
-    void _swap_buffers();
-    /** Find the next contiguous set of at most _max_sectors */
-    void _get_next_chunk(uint32_t *sector_out, uint32_t *num_sectors_out);
-    void _convert(uint32_t offset, uint32_t count);
+    /** Find the next contiguous set of at most max_sectors */
+    void _get_next_chunk(uint32_t max_sectors, uint32_t *sector_out, uint32_t *num_sectors_out);
+    /** Fill the extent table by walking the FAT chain from a cluster which begins at file sector file_sector */
+    bool _load_extents(uint32_t cluster, uint32_t file_sector);
+    /** Read a FAT16, FAT32 or exFAT entry: 1 with the next cluster in *next, 0 at the end of the chain, -1 on error */
+    int8_t _fat_next(uint32_t cluster, uint32_t *next);
+    /** Reset the read state for a new file */
+    bool _begin(SdFs *sd, uint32_t first_sector, bool contiguous, uint32_t file_size, bool loop);
+    /** Validate the WAV header at the start of the read buffer and set up conversion for it */
+    bool _parse_header();
+    /** Set up conversion and resampling for a file's format */
+    bool _apply_format(const WaveFormat &format);
+    /** Convert up to max_samples of whatever has landed in the read buffer, starting the next read when it's used up */
+    WavePlayerPoll _convert_frames(int16_t *samples, uint32_t max_samples, uint32_t *num_samples);
+    /** Convert whole frames from src into dst, returns the # of samples */
+    uint32_t _decode(const uint8_t *src, int16_t *dst, uint32_t frames);
+    /** poll() without the timing */
+    WavePlayerPoll _poll(int16_t *samples, uint32_t max_samples, uint32_t *num_samples);
+    /** Fill a block from a DAC file, reading whole sectors straight into it where they fit */
+    WavePlayerPoll _poll_direct(int16_t *samples, uint32_t max_samples, uint32_t *num_samples);
+    /** Make the next read start at a byte offset into the file */
+    void _seek(uint32_t offset);
+    /** Start reading at most max_sectors of the file into buf, false at EOF or on error */
+    bool _start_next_read(uint8_t *buf, uint32_t max_sectors);
+    /** 1 if the read buffer holds at least `bytes` bytes of the current chunk, 0 if not yet, -1 if the read timed out */
+    int8_t _bytes_ready(uint32_t bytes);
     bool _start_read_chunk(uint32_t sector, uint32_t ns);
     void _end_read_chunk();
+    /** Have the card's multi-block read at sector, carrying on with this player's open one if it's already there */
+    bool _open_stream(uint32_t sector, bool *resumed);
 
+    // slot in the table of players the DMA interrupt is routed through
     uint8_t _id;
     WavePlayerStatus _status = WavePlayerStatus::NOTINITIALIZED;
     uint8_t _max_sectors;
     
+#if USE_DMA
+    /** What the card sends after the last sector that landed */
+    enum class DmaNext : uint8_t {
+        // the next sector's data, its start token came in with the previous CRC
+        DATA,
+        // more of the gap before the start token
+        TOKEN,
+        // nothing worth carrying on from, the read has to be sent again from _stream_sector
+        REOPEN
+    };
+    volatile DmaNext _dma_next = DmaNext::TOKEN;
+    // times the chain starting at _stream_sector has failed its CRC
+    volatile uint8_t _sector_retries = 0;
+    // a chain is in flight, starting at sector _chain_base of the read and _chain_len sectors long
+    volatile bool _chain_running = false;
+    volatile uint8_t _chain_base;
+    volatile uint8_t _chain_len;
+    // the sector whose trailing descriptor currently ends the RX chain
+    uint8_t _chain_cut;
+    // most sectors per chain, cut back when the card's gaps or bit errors spoil long chains
+    volatile uint8_t _chain_limit;
+#endif
+    volatile uint32_t _read_retries = 0;
+
     volatile uint8_t _sectors_to_read;
     // # of sectors read in the current DMA transaction
     volatile uint8_t _num_sectors_read;
+    // when the last sector of the current read landed, or its start token arrived
+    volatile uint32_t _sector_time;
+
+    // hot path timing, see LatencyHistogram.h: when the current poll() started, time it spent
+    // starting reads, and conversion time so far for the current chunk
+    uint32_t _poll_start_time;
+    uint32_t _io_time;
+    uint32_t _convert_time;
 
     SdFs *_sd;
-    // current file
-    FsFile *_file;
+    // next sector of the multi-block read, while this player has one open
+    volatile uint32_t _stream_sector;
+    // first sector of the current file
+    uint32_t _first_sector;
     // file is contiguous
     bool _contiguous;
     // current file position (in sectors)
     int32_t _sector_index;
+    // total # of sectors in the file, rounded up
+    int32_t _file_sectors;
+
+    /**
+     * Extent map for non-contiguous files. Holds up to WAVEPLAYER_MAX_EXTENTS runs of the chain
+     * starting at _extents[0].file_sector, so each chunk is resolved without re-walking the FAT.
+     */
+    SectorExtent _extents[WAVEPLAYER_MAX_EXTENTS];
+    uint8_t _num_extents;
+    // extent containing _sector_index
+    uint8_t _extent_index;
+    // cluster following the last cached extent, 0 if the table reaches the end of the chain
+    uint32_t _next_cluster;
+    // the FAT sector the chain was last walked through, read straight from the card. 0 if none,
+    // the FAT never starts at sector 0
+    uint8_t _fat_cache[SD_SECTOR_SIZE];
+    uint32_t _fat_cache_sector;
     bool _loop;
 
+    // per-file sample conversion, selected from the WAV header. NULL for ADPCM, which is stateful
+    SampleConverterFn _converter;
+    ImaAdpcmDecoder _adpcm;
+    // bytes per interleaved frame (block align), or per ADPCM unit
+    uint8_t _frame_size;
+    // most samples a single frame converts to
+    uint8_t _frame_samples;
+    // byte offset of the first sample in the file, and the end of the sample data (loop end if looping)
+    uint32_t _data_offset;
+    uint32_t _data_end;
+    // byte offset in the file a looping file carries on from
+    uint32_t _loop_offset;
+    // samples are DAC codes at the DAC rate, and are read into the block without conversion
+    bool _direct;
+
+    // where the current read is landing, the read buffer or a sample block
+    uint8_t *_read_buf;
+    // # of bytes of the current read requested, and how far conversion has consumed it
+    uint32_t _read_len;
+    uint32_t _read_pos;
+    // bytes of the next read's first sector to skip, set by _seek()
+    uint32_t _skip;
+    Timeout _read_timeout { WAVEPLAYER_READ_TIMEOUT_US };
+    // the first read hasn't been checked as a WAV header yet
+    bool _header_pending;
+    // no more reads, the file has ended or failed
+    bool _done;
+    // a frame split across two reads is reassembled here
+    uint8_t _carry[WAVEPLAYER_MAX_FRAME_SIZE];
+    uint8_t _carry_len;
+
+    // sources not at DAC_SAMPLE_RATE are converted into _stage, then resampled into the sample buffer
+    Resampler _resampler;
+    int16_t _stage[WAVEPLAYER_STAGE_LEN];
+    uint32_t _stage_len;
+    uint32_t _stage_pos;
+
 #if USE_DMA
     /* Wave player uses 2 DMA channels, one for TX and one for RX */
     Adafruit_ZeroDMA dma_tx, dma_rx;
 
-    /* 1 TX descriptor with size SECTOR SIZE + 4 */
+    /* 1 TX descriptor, SECTOR SIZE + 4 bytes for every sector of the chain */
     DmacDescriptor *desc_tx;
 
-    /* 3 RX descriptors in a chain/loop 
-        0 - 2-byte sector header writing into _dma_tmp_buf
-        1 - 512-byte sector writing into the _dma_rx_buf
-        2 - 2-byte CRC writing into _dma_tmp_buf
+    /* 3 RX descriptors per sector for _max_sectors sectors, in one chain cut to the length of each read
+        3k     - sector k's 512 bytes, writing into the read buffer
+        3k + 1 - its 2-byte CRC, writing into _dma_tmp_buf + 4k
+        3k + 2 - the 2 bytes after it, the gap and sector k + 1's start token, into _dma_tmp_buf + 4k + 2
     */
-    DmacDescriptor *desc_rx[3];
+    DmacDescriptor **desc_rx;
 #endif
 
-    /** 
-     * malloc-based RX buffers (actually 1 continguous buffer with an extra pointer)
-     * 
-     * we ALWAYS use _dma_rx_buf[0] for load + convert, and _dma_rx_buf[1] for playback
-     * 0 - Load + Convert
-     * 2 - Play
-     * */
-    uint8_t *_dma_rx_bufs[2];
-    size_t _dma_rx_buf_size;
-
-    /* 1-byte TX buf */
-    uint8_t *_dma_tx_buf;
-    /* 2-byte tmp DMA buffer */
-    uint8_t *_dma_tmp_buf;
-    /* full RX buf allocaton (double the buf size) */
+    /* raw sectors read from the card */
     uint8_t *_dma_rx_buf;
+
+    /* the 0xFF TX clocks out for every byte, shared by every player */
+    static uint8_t _dma_tx_byte;
+    /* 4 bytes per sector of tmp DMA buffer, each sector's CRC and what follows it */
+    uint8_t *_dma_tmp_buf;
+};
+
+/**
+ * A WavePlayer reading NumSectors sectors at a time. The read buffer and DMA scratch are part of
+ * the object, so a global player shows up at its full size in the linker map and never touches
+ * the heap.
+ */
+template <uint8_t NumSectors>
+class StaticWavePlayer : public WavePlayer {
+    static_assert(NumSectors >= 1, "WavePlayer needs at least 1 sector to read into");
+    // a whole chunk is clocked by one TX block, see WavePlayer::_start_chain(), and its count is 16 bits
+    static_assert(NumSectors * (SD_SECTOR_SIZE + 4) <= 0xFFFF, "WavePlayer chunk is too large for one DMA chain");
+
+public:
+    StaticWavePlayer() : WavePlayer(NumSectors, _read_storage, _tmp_storage, _desc_rx_storage) {}
+
+private:
+    // word aligned for the converters' word loops
+    uint8_t _read_storage[NumSectors * SD_SECTOR_SIZE] __attribute__ ((aligned (4)));
+    uint8_t _tmp_storage[4 * NumSectors] __attribute__ ((aligned (4)));
+    DmacDescriptor *_desc_rx_storage[3 * NumSectors];
 };
 
 #endif // WAVEPLAYER_H_
\ No newline at end of file
@@ -11,33 +11,48 @@
 #include <Adafruit_ZeroDMA.h>
 
 #include "io.h"
+#include "Log.h"
+#include "LatencyHistogram.h"
 #include "WavePlayer.h"
+#include "TrackIndex.h"
+#include "ToneGenerator.h"
+#include "FlashCache.h"
+#include "PrefetchPool.h"
 
 #include "Dialer.h"
 
 #include "AudioPlayer.h"
+#include "Mixer.h"
 
 // DECLARATIONS
 void fatal(const char *message, uint8_t r, uint8_t g, uint8_t b, uint16_t blink_delay);
 
 void initSD();
 
+struct AudioQueueItem;
+
 void enqueue(const char *filename, bool loop);
+void enqueue(Tone tone, bool loop);
 void play(const char *filename);
-void start_playing(const char *filename, bool loop);
+void start_playing(const AudioQueueItem *item);
+void open_track(const AudioQueueItem *item);
+void prime();
 bool tick();
+WavePlayerPoll poll_program(void *ctx, int16_t *samples, uint32_t max_samples, uint32_t *num_samples);
+void serial_command();
 void stop();
 
 // DEFINITIONS
 #define CPU_HZ 48000000
-#define SAMPLE_RATE 44100
 
 #define GREEN_LED_BUILTIN 8
 
-#define DAC_BITS 10
-
 #define SD_CS_PIN 4
-#define SD_CONFIG SdSpiConfig(SD_CS_PIN, DEDICATED_SPI, SD_SCK_MHZ(12))
+/** SPI clock for the card. Bit errors past 12MHz are only caught with CRC checking, see WAVEPLAYER_CHECK_CRC */
+#ifndef SD_SCK_MAX_MHZ
+#define SD_SCK_MAX_MHZ 12
+#endif
+#define SD_CONFIG SdSpiConfig(SD_CS_PIN, DEDICATED_SPI, SD_SCK_MHZ(SD_SCK_MAX_MHZ))
 
 #define NUM_SECTORS 4
 #define SD_READ_CHUNK_SIZE (NUM_SECTORS * SD_SECTOR_SIZE)
@@ -45,7 +60,6 @@ void stop();
 #define DIALER_PIN A1
 
 // Filenames + digit templates
-const char *DIALTONE_FILENAME = "dialtone.wav";
 const char *RING_FILENAME = "ring.wav";
 const char *RING_REMIX_FILENAME = "ringremix.wav";
 
@@ -55,16 +69,35 @@ const char *INTERCEPT_PRE = "JB-pre.WAV";
 const char *INTERCEPT_POST = "JB-post.WAV";
 char intercept_digits[2][17] = { "JB-X-neutral.WAV", "JB-X-falling.WAV" };
 
+// every file other than NN.WAV that can be played, indexed at boot
+const char *const SYSTEM_CLIPS[] = {
+    RING_FILENAME, RING_REMIX_FILENAME, INTERCEPT_PRE, INTERCEPT_POST,
+    "JB-0-neutral.WAV", "JB-1-neutral.WAV", "JB-2-neutral.WAV", "JB-3-neutral.WAV", "JB-4-neutral.WAV",
+    "JB-5-neutral.WAV", "JB-6-neutral.WAV", "JB-7-neutral.WAV", "JB-8-neutral.WAV", "JB-9-neutral.WAV",
+    "JB-0-falling.WAV", "JB-1-falling.WAV", "JB-2-falling.WAV", "JB-3-falling.WAV", "JB-4-falling.WAV",
+    "JB-5-falling.WAV", "JB-6-falling.WAV", "JB-7-falling.WAV", "JB-8-falling.WAV", "JB-9-falling.WAV",
+};
+
 // GLOBALS
 // Adafruit_NeoPixel neopixel_err(1, NEOPIXEL_BUILTIN, NEO_GRB + NEO_KHZ800);
-WavePlayer player(SD_SECTOR_SIZE *NUM_SECTORS);
+StaticWavePlayer<NUM_SECTORS> player;
 
 SdFs sd;
-FsFile file;
+TrackIndex tracks;
+// the most played tracks, converted into the onboard flash
+FlashCache cache;
+// the start of each number the one being dialed could turn out to be
+PrefetchPool prefetch;
+// call progress tones are synthesized rather than read from the card
+ToneGenerator tone;
+// the queued tracks lead the mix, see poll_program()
+Mixer mixer;
 int32_t dial_index = 0;
 
-typedef struct {
+typedef struct AudioQueueItem {
+    // file to play, or NULL to play tone
     const char *filename;
+    Tone tone;
     bool loop;
 } AudioQueueItem;
 
@@ -72,6 +105,30 @@ typedef struct {
 uint32_t audio_index, audio_tracks;
 AudioQueueItem audio_queue[MAX_QUEUE_LEN];
 
+void enqueue(Tone tone, bool loop) {
+    audio_queue[(audio_index + audio_tracks) % MAX_QUEUE_LEN] = {
+        NULL,
+        tone,
+        loop
+    };
+    audio_tracks++;
+
+    if (audio_tracks > MAX_QUEUE_LEN) {
+        fatal("Too many audio tracks enqueued", 255, 0, 0, 500);
+    }
+}
+
+bool next_track(AudioQueueItem *item);
+
+// a new file is filling the sample queue, playback starts once it's full
+bool priming = false;
+uint64_t prime_start_time;
+// # of samples converted into the block being filled so far
+uint32_t block_samples = 0;
+// where the block is being filled from
+enum class ProgramSource { CARD, FLASH, TONE };
+ProgramSource source = ProgramSource::TONE;
+
 // ------------------------------------------------------------------------------
 void setup()
 {
@@ -94,6 +151,14 @@ void setup()
 
     initSD();
 
+    if (!tracks.build(&sd, SYSTEM_CLIPS, sizeof(SYSTEM_CLIPS) / sizeof(SYSTEM_CLIPS[0])))
+    {
+        fatal("FATAL: Failed to index SD card", 255, 0, 0, 500);
+    }
+
+    // without flash everything plays from the card
+    cache.begin(&sd, &tracks);
+
     if (!Dialer.init(DIALER_PIN))
     {
         fatal("FATAL: Failed to initialize Dialer", 255, 0, 0, 500);
@@ -104,67 +169,140 @@ void setup()
         fatal("FATAL: Failed to initialize AudioPlayer", 255, 0, 0, 500);
     }
 
+    mixer.play(0, poll_program, NULL);
+
     // loop dialtone until interrupted by dialing
-    start_playing(DIALTONE_FILENAME, true);
+    AudioQueueItem dialtone = { NULL, Tone::DIAL, true };
+    start_playing(&dialtone);
 }
 
 void loop() {
-    if (AudioPlayer.is_playing() && AudioPlayer.ready()) {
-        tick();
+    if (priming) {
+        prime();
+    } else if (AudioPlayer.is_playing() && AudioPlayer.ready()) {
+        // past the end of the stream, the DAC stops once the queue drains
+        if (!tick()) AudioPlayer.finish();
     } else if (!AudioPlayer.is_playing() && audio_tracks > 0) {
-        start_playing(audio_queue[audio_index].filename, audio_queue[audio_index].loop);
-        audio_index = (audio_index + 1) % MAX_QUEUE_LEN;
-        audio_tracks--;
+        AudioQueueItem item;
+        next_track(&item);
+        start_playing(&item);
     }
 
+    // the card is idle while a tone plays or between digits. reading ahead for the number being
+    // dialed comes first, then copying the next track into flash
+    if (!priming && (source == ProgramSource::TONE || !AudioPlayer.is_playing()) && !prefetch.service(&sd))
+    {
+        cache.service();
+    }
+
+    // with the DAC queue full or nothing playing, there's time to print a log line
+    if (!priming && !(AudioPlayer.is_playing() && AudioPlayer.ready())) log_drain();
+
+    serial_command();
+
     uint32_t dialed_number;
     if (Dialer.check_dialed(&dialed_number))
     {
-        cout << F("Dialed: ") << dialed_number << endl;
+        LOG_INFO("Dialed: %u", dialed_number);
         number_filename[dial_index] = intercept_digits[dial_index][3] = (char)('0' + (dialed_number % 10));
         dial_index++;
 
         stop();
 
+        if (dial_index == 1) {
+            // the second digit is at least a second away, read the start of every number it can make meanwhile
+            cache.pause();
+            prefetch.clear();
+            for (uint8_t n = 0; n < 10; n++) {
+                const TrackInfo *candidate = tracks.number((dialed_number % 10) * 10 + n);
+                if (candidate && !cache.contains(candidate)) prefetch.add(&sd, candidate);
+            }
+        }
+
         if (dial_index == 2) {
             dial_index = 0;
 
-            if (sd.exists(number_filename)) {
-                enqueue(RING_FILENAME, false);
+            // before anything is queued over the sectors read ahead
+            prefetch.keep(tracks.find(number_filename));
+
+            if (tracks.find(number_filename)) {
+                if (tracks.find(RING_FILENAME)) {
+                    enqueue(RING_FILENAME, false);
+                } else {
+                    enqueue(Tone::RINGBACK, false);
+                }
                 enqueue(number_filename, false);
-                enqueue(DIALTONE_FILENAME, true);
-            } else {
+                enqueue(Tone::DIAL, true);
+            } else if (tracks.find(INTERCEPT_PRE)) {
                 enqueue(INTERCEPT_PRE, false);
                 enqueue(intercept_digits[0], false);
                 enqueue(intercept_digits[1], false);
                 enqueue(INTERCEPT_POST, false);
-                enqueue(DIALTONE_FILENAME, true);
+                enqueue(Tone::DIAL, true);
+            } else {
+                // no intercept message on the card, a busy signal will have to do
+                enqueue(Tone::BUSY, false);
+                enqueue(Tone::DIAL, true);
             }
         }
     }
 }
 
+/** h dumps the hot path latency histograms and underrun counters over serial, r starts them over, f empties the flash cache */
+void serial_command()
+{
+    if (Serial.available() <= 0)
+        return;
+
+    switch (Serial.read())
+    {
+    case 'h': {
+        print_hot_path_latency();
+        AudioUnderrunStats underruns = AudioPlayer.underrun_stats();
+        cout << F("Underruns ") << underruns.underruns << F(", concealed ")
+            << underruns.concealed_samples << F(" samples") << endl;
+        cout << F("SD sectors read again ") << player.read_retries() << endl;
+        FlashCacheStats cached = cache.stats();
+        cout << F("Flash cache hits ") << cached.hits << F(", misses ") << cached.misses << F(", promotions ")
+            << cached.promotions << F(", evictions ") << cached.evictions << endl;
+        break;
+    }
+    case 'r':
+        reset_hot_path_latency();
+        cout << F("Latency histograms reset") << endl;
+        break;
+    case 'f':
+        cache.clear();
+        cout << F("Flash cache emptied") << endl;
+        break;
+    }
+}
+
 void play(const char *filename, bool loop)
 {
-    start_playing(filename, loop);
+    AudioQueueItem item = { filename, Tone::DIAL, loop };
+    start_playing(&item);
+
+    while (priming)
+        prime();
 
     while (AudioPlayer.is_playing())
     {
-        // wait until ready for a tick
-        while (!AudioPlayer.ready())
-            yield();
-
-        if (!tick())
+        if (AudioPlayer.ready() && !tick())
         {
-            cout << F("Finished playback") << endl;
+            AudioPlayer.finish();
+            LOG_INFO("Finished playback");
             break;
         }
+
+        yield();
     }
 }
 
 void enqueue(const char *filename, bool loop) {
-    audio_queue[audio_index + audio_tracks] = { 
+    audio_queue[(audio_index + audio_tracks) % MAX_QUEUE_LEN] = { 
         filename,
+        Tone::DIAL,
         loop
     };
     audio_tracks++;
@@ -174,18 +312,44 @@ void enqueue(const char *filename, bool loop) {
     }
 }
 
-void start_playing(const char *filename, bool loop)
+bool next_track(AudioQueueItem *item)
 {
-    AudioPlayer.stop();
+    if (audio_tracks == 0)
+        return false;
+
+    *item = audio_queue[audio_index];
+    audio_index = (audio_index + 1) % MAX_QUEUE_LEN;
+    audio_tracks--;
+    return true;
+}
+
+void open_track(const AudioQueueItem *item)
+{
+    if (!item->filename)
+    {
+        LOG_INFO("Playing tone: %u", item->tone);
+        tone.start(item->tone, item->loop);
+        source = ProgramSource::TONE;
+        return;
+    }
 
-    cout << F("Playing file: ") << filename << endl;
-    // open the file
-    if (!file.open(filename, FILE_READ))
+    // the number and intercept names are rewritten by the next digit, which is long after this is printed
+    LOG_INFO("Playing file: %s", item->filename);
+    const TrackInfo *track = tracks.find(item->filename);
+    if (!track)
     {
         fatal("File doesn't exist", 255, 0, 0, 1000);
     }
 
-    if (!player.init())
+    // the card is about to be read for this file, or the copy would get in its way
+    cache.pause();
+    if (cache.start(track, item->loop))
+    {
+        source = ProgramSource::FLASH;
+        return;
+    }
+
+    if (player.status() != WavePlayerStatus::READY && !player.init())
     {
         fatal("Error initializing waveplaer", 255, 0, 0, 500);
     }
@@ -195,41 +359,114 @@ void start_playing(const char *filename, bool loop)
         fatal("Error initializing waveplayer", 255, 0, 0, 500);
     }
 
-    cout << F("Initialized WavePlayer") << endl;
-
-    int16_t *samples;
-    uint32_t num_samples;
-    if (!player.start(&sd, &file, loop, &samples, &num_samples))
+    if (!player.start(&sd, track, item->loop, prefetch.find(track)))
     {
         fatal("Error starting wav file", 255, 0, 0, 500);
     }
+    source = ProgramSource::CARD;
+}
 
-    cout << F("Starting playback of ") << num_samples << F(" from ") << hex << samples << dec << endl;
+void start_playing(const AudioQueueItem *item)
+{
+    AudioPlayer.stop();
 
-    // enqueue the next audio playback
-    AudioPlayer.start(SAMPLE_RATE, samples, num_samples);
+    open_track(item);
+
+    // fill the whole queue before starting, so playback begins with the most slack. this happens
+    // from loop() like any other read, so the dialer keeps being sampled meanwhile
+    block_samples = 0;
+    mixer.reset();
+    prime_start_time = micros();
+    priming = true;
+}
+
+void prime()
+{
+    bool ended = false;
+    if (AudioPlayer.next_block())
+    {
+        if (tick()) return;
+        ended = true;
+    }
+
+    priming = false;
+    LOG_INFO("Queued %u blocks in %u us", AudioPlayer.queue_stats().high_water, micros() - prime_start_time);
+
+    AudioPlayer.start(DAC_SAMPLE_RATE);
+    // the whole stream fit in the queue
+    if (ended) AudioPlayer.finish();
 }
 
 bool tick()
 {
-    int16_t *samples;
-    uint32_t num_samples;
-    uint64_t time = micros();
-    if (!player.read_and_convert(&samples, &num_samples))
+    int16_t *samples = AudioPlayer.next_block();
+    if (!samples)
     {
+        return true;
+    }
+
+    // mix whatever has been read so far, a block can take several passes through loop()
+    switch (mixer.poll(samples, AUDIO_BLOCK_SAMPLES, &block_samples))
+    {
+    case WavePlayerPoll::PENDING:
+        return true;
+    case WavePlayerPoll::FILLED:
+        // queue the block and continue right into the next one
+        AudioPlayer.enqueue(block_samples);
+        block_samples = 0;
+        return true;
+    default:
         return false;
     }
-    time = micros() - time;
-    // cout << F("Read ") << num_samples << F(" samples in ") << time << F(" us") << endl;
+}
 
-    // enqueue the next sample chunk and continue right into the next read
-    AudioPlayer.enqueue(samples, num_samples);
+/** The queued tracks played back to back, as the mixer's lead voice */
+WavePlayerPoll poll_program(void *ctx, int16_t *samples, uint32_t max_samples, uint32_t *num_samples)
+{
+    (void)ctx;
 
-    return num_samples > 0;
+    AudioQueueItem item;
+    WavePlayerPoll result;
+    switch (source)
+    {
+    case ProgramSource::TONE:
+        result = tone.poll(samples, max_samples, num_samples);
+        break;
+    case ProgramSource::FLASH:
+        result = cache.poll(samples, max_samples, num_samples);
+        break;
+    default:
+        result = player.poll(samples, max_samples, num_samples);
+        break;
+    }
+    switch (result)
+    {
+    case WavePlayerPoll::FILLED:
+        // a short block means the file ended partway through it, so splice the next track
+        // into the rest of the block, it then plays straight on from the last sample of this one
+        if (*num_samples < max_samples && next_track(&item))
+        {
+            open_track(&item);
+            return WavePlayerPoll::PENDING;
+        }
+        return WavePlayerPoll::FILLED;
+    case WavePlayerPoll::DONE:
+        // the file ended on a block boundary
+        if (next_track(&item))
+        {
+            open_track(&item);
+            return WavePlayerPoll::PENDING;
+        }
+        return WavePlayerPoll::DONE;
+    default:
+        return result;
+    }
 }
 
 void stop() {
     AudioPlayer.stop();
+    player.stop();
+    priming = false;
     audio_index = 0;
     audio_tracks = 0;
 }
@@ -283,6 +520,8 @@ void initSD()
  */
 void fatal(const char *message, uint8_t r, uint8_t g, uint8_t b, uint16_t blink_delay_ms)
 {
+    // whatever led up to it is still waiting to be printed
+    log_flush();
     Serial.println(message);
 
     for (bool ledState = HIGH;; ledState = !ledState)
@@ -0,0 +1,198 @@
+/**
+ * What the DAC plays against what was queued: every sample once and in order, whether the queue
+ * stays full, the block interrupts run late, or the producer stalls into an underrun.
+ */
+#include <Arduino.h>
+#include <unity.h>
+
+#include "AudioPlayer.h"
+#include "NativeHal.h"
+
+#define DAC_BITS 12
+#define SAMPLE_RATE 44100
+// a little over a second, so the ring wraps many times
+#define NUM_SAMPLES (48 * AUDIO_BLOCK_SAMPLES + 300)
+// room for the longest concealment tested
+#define MAX_OUTPUT (NUM_SAMPLES + SAMPLE_RATE)
+
+static uint16_t input[NUM_SAMPLES];
+static uint16_t output[MAX_OUTPUT];
+static uint32_t num_output;
+static bool was_playing;
+
+static void dac_sink(uint16_t sample) {
+    // the DMA callback that ends playback runs in the overflow that plays the last sample, before
+    // that sample is taken here, so the one after playback ends still counts
+    bool playing = AudioPlayer.is_playing();
+    if ((playing || was_playing) && num_output < MAX_OUTPUT) output[num_output++] = sample;
+    was_playing = playing;
+}
+
+/**
+ * Queue the input in blocks of block_samples, with the producer checking every poll_us. The
+ * producer stops for stall_us once stall_at samples are queued. Returns once playback has ended.
+ */
+static void play(uint32_t block_samples, uint32_t poll_us, uint32_t stall_at, uint32_t stall_us) {
+    uint32_t queued = 0;
+    num_output = 0;
+    was_playing = false;
+
+    // blocks have to be queued before starting
+    int16_t *block;
+    while (queued < NUM_SAMPLES && (block = AudioPlayer.next_block())) {
+        uint32_t n = NUM_SAMPLES - queued < block_samples ? NUM_SAMPLES - queued : block_samples;
+        memcpy(block, input + queued, n * sizeof(int16_t));
+        AudioPlayer.enqueue(n);
+        queued += n;
+    }
+    AudioPlayer.start(SAMPLE_RATE);
+
+    bool stalled = false;
+    uint64_t give_up_us = hal_now_us() + 10000000;
+    while (queued < NUM_SAMPLES) {
+        TEST_ASSERT_TRUE(AudioPlayer.is_playing());
+        TEST_ASSERT_TRUE(hal_now_us() < give_up_us);
+
+        if (!stalled && queued >= stall_at) {
+            stalled = true;
+            hal_advance_us(stall_us);
+        }
+
+        while (queued < NUM_SAMPLES && AudioPlayer.ready()) {
+            uint32_t n = NUM_SAMPLES - queued < block_samples ? NUM_SAMPLES - queued : block_samples;
+            memcpy(AudioPlayer.next_block(), input + queued, n * sizeof(int16_t));
+            AudioPlayer.enqueue(n);
+            queued += n;
+        }
+        // as soon as the last block is queued, like the main loop
+        if (queued == NUM_SAMPLES) AudioPlayer.finish();
+        hal_advance_us(poll_us);
+    }
+
+    while (AudioPlayer.is_playing()) {
+        // the stream has ended, so running dry has to stop playback
+        TEST_ASSERT_TRUE(hal_now_us() < give_up_us);
+        hal_advance_us(poll_us);
+    }
+    AudioPlayer.stop();
+}
+
+/** The output is the input with at most one run of concealment spliced in, returns that run's length */
+static uint32_t check_output() {
+    // the DAC holds the last sample until playback is seen to end, which late interrupts delay
+    while (num_output >= 2 && output[num_output - 1] == input[NUM_SAMPLES - 1] && output[num_output - 2] == input[NUM_SAMPLES - 1]) {
+        num_output--;
+    }
+
+    uint32_t k = 0;
+    while (k < NUM_SAMPLES && k < num_output && output[k] == input[k]) k++;
+    if (k == NUM_SAMPLES) {
+        TEST_ASSERT_EQUAL_UINT32(NUM_SAMPLES, num_output);
+        return 0;
+    }
+
+    // everything after the concealment is the rest of the input, nothing dropped or repeated
+    TEST_ASSERT_GREATER_THAN_UINT32(NUM_SAMPLES - k, num_output - k);
+    uint32_t gap = num_output - NUM_SAMPLES;
+    for (uint32_t i = k; i < NUM_SAMPLES; i++) {
+        if (output[i + gap] != input[i]) {
+            printf("output %u is %u, expected input %u = %u\n", i + gap, output[i + gap], i, input[i]);
+            TEST_FAIL_MESSAGE("samples dropped or repeated after the underrun");
+        }
+    }
+    return gap;
+}
+
+void setUp() {
+    setenv("SIM_IRQ_LATENCY_US", "0", 1);
+    AudioPlayer.set_underrun_policy(AudioUnderrun::FADE);
+}
+
+void tearDown() {
+    // a failed test can leave playback running
+    AudioPlayer.stop();
+}
+
+static void test_full_queue() {
+    uint32_t underruns = AudioPlayer.underrun_stats().underruns;
+    play(AUDIO_BLOCK_SAMPLES, 100, NUM_SAMPLES, 0);
+    TEST_ASSERT_EQUAL_UINT32(0, check_output());
+    TEST_ASSERT_EQUAL_UINT32(underruns, AudioPlayer.underrun_stats().underruns);
+}
+
+static void test_short_blocks() {
+    // blocks of uneven lengths, so block ends fall anywhere in a TC5 period
+    play(97, 100, NUM_SAMPLES, 0);
+    TEST_ASSERT_EQUAL_UINT32(0, check_output());
+}
+
+static void test_late_interrupts() {
+    // the block interrupt runs well after the DMAC has moved on into the next block
+    setenv("SIM_IRQ_LATENCY_US", "5000", 1);
+    play(AUDIO_BLOCK_SAMPLES, 100, NUM_SAMPLES, 0);
+    TEST_ASSERT_EQUAL_UINT32(0, check_output());
+}
+
+static void test_late_producer() {
+    // the producer only tops the queue up once it's nearly dry
+    play(AUDIO_BLOCK_SAMPLES, 60000, NUM_SAMPLES, 0);
+    TEST_ASSERT_EQUAL_UINT32(0, check_output());
+}
+
+static void test_underrun() {
+    uint32_t underruns = AudioPlayer.underrun_stats().underruns;
+    play(AUDIO_BLOCK_SAMPLES, 100, NUM_SAMPLES / 2, 200000);
+
+    // the queue holds ~93ms, so most of the stall is concealed
+    uint32_t gap = check_output();
+    TEST_ASSERT_GREATER_THAN_UINT32(SAMPLE_RATE / 10, gap);
+    TEST_ASSERT_EQUAL_UINT32(underruns + 1, AudioPlayer.underrun_stats().underruns);
+}
+
+static void test_underrun_late_interrupts() {
+    setenv("SIM_IRQ_LATENCY_US", "500", 1);
+    uint32_t underruns = AudioPlayer.underrun_stats().underruns;
+    play(AUDIO_BLOCK_SAMPLES, 100, NUM_SAMPLES / 2, 200000);
+    TEST_ASSERT_GREATER_THAN_UINT32(0, check_output());
+    TEST_ASSERT_EQUAL_UINT32(underruns + 1, AudioPlayer.underrun_stats().underruns);
+}
+
+static void test_underrun_stop_policy() {
+    AudioPlayer.set_underrun_policy(AudioUnderrun::STOP);
+    num_output = 0;
+    was_playing = false;
+
+    // running dry without finish() ends playback after the last queued sample
+    uint32_t queued = 0;
+    int16_t *block;
+    while ((block = AudioPlayer.next_block())) {
+        memcpy(block, input + queued, AUDIO_BLOCK_SAMPLES * sizeof(int16_t));
+        AudioPlayer.enqueue(AUDIO_BLOCK_SAMPLES);
+        queued += AUDIO_BLOCK_SAMPLES;
+    }
+    AudioPlayer.start(SAMPLE_RATE);
+    hal_advance_us(200000);
+    TEST_ASSERT_FALSE(AudioPlayer.is_playing());
+    AudioPlayer.stop();
+
+    TEST_ASSERT_EQUAL_UINT32(queued, num_output);
+    TEST_ASSERT_EQUAL_UINT16_ARRAY(input, output, queued);
+}
+
+int main() {
+    // a ramp that never holds a value, so a repeated or skipped sample always shows
+    for (uint32_t i = 0; i < NUM_SAMPLES; i++) input[i] = (uint16_t)(i * 3 % (1 << DAC_BITS));
+
+    AudioPlayer.init(DAC_BITS);
+    hal_set_dac_sink(dac_sink);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_full_queue);
+    RUN_TEST(test_short_blocks);
+    RUN_TEST(test_late_interrupts);
+    RUN_TEST(test_late_producer);
+    RUN_TEST(test_underrun);
+    RUN_TEST(test_underrun_late_interrupts);
+    RUN_TEST(test_underrun_stop_policy);
+    return UNITY_END();
+}
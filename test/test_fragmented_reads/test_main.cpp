@@ -0,0 +1,107 @@
+/**
+ * Per-chunk read time across a heavily fragmented FAT32 file. Every cluster of the file is its
+ * own extent, so finding a chunk's sectors has to follow the FAT. With the extent table that costs
+ * the same at any offset; walking the chain from the first cluster would grow with the offset.
+ */
+#include <Arduino.h>
+#include <SdFat.h>
+#include <unity.h>
+
+#include "FatImage.h"
+#include "NativeHal.h"
+#include "WavePlayer.h"
+
+#define IMAGE_PATH "test_fragmented_reads.img"
+// 16-bit mono samples, ~8000 one-sector extents
+#define DATA_BYTES (4000u * 1024)
+#define BLOCK_SAMPLES 1024
+// offset bins the file is split into
+#define NUM_BINS 8
+
+static uint8_t wav[44 + DATA_BYTES];
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, (uint16_t)v);
+    put16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void make_wav() {
+    memcpy(wav, "RIFF", 4);
+    put32(wav + 4, sizeof(wav) - 8);
+    memcpy(wav + 8, "WAVEfmt ", 8);
+    put32(wav + 16, 16);
+    put16(wav + 20, 1);
+    put16(wav + 22, 1);
+    put32(wav + 24, 44100);
+    put32(wav + 28, 44100 * 2);
+    put16(wav + 32, 2);
+    put16(wav + 34, 16);
+    memcpy(wav + 36, "data", 4);
+    put32(wav + 40, DATA_BYTES);
+
+    for (uint32_t i = 0; i < DATA_BYTES / 2; i++) put16(wav + 44 + 2 * i, (uint16_t)(i * 7));
+}
+
+void setUp() {}
+void tearDown() {}
+
+static void test_chunk_time_is_flat_across_offset() {
+    static const FatImageFile files[] = { { "FRAG.WAV", wav, sizeof(wav) } };
+    make_wav();
+    TEST_ASSERT_TRUE(fat_image_write(IMAGE_PATH, files, 1, 1));
+    setenv("SIM_SD_IMAGE", IMAGE_PATH, 1);
+
+    static SdFs sd;
+    static FsFile file;
+    static StaticWavePlayer<4> player;
+    static int16_t block[BLOCK_SAMPLES];
+    TEST_ASSERT_TRUE(sd.begin(SdSpiConfig(4, DEDICATED_SPI, SD_SCK_MHZ(12))));
+    TEST_ASSERT_TRUE(file.open("FRAG.WAV", FILE_READ));
+    TEST_ASSERT_TRUE(player.init());
+    TEST_ASSERT_TRUE(player.start(&sd, &file, false));
+
+    uint64_t bin_us[NUM_BINS] = {}, bin_cycles[NUM_BINS] = {};
+    uint32_t bin_blocks[NUM_BINS] = {};
+    uint32_t total_samples = 0, num_samples;
+    for (;;) {
+        uint64_t start_us = hal_now_us(), start_cycles = hal_host_cycles();
+        bool more = player.read_and_convert(block, BLOCK_SAMPLES, &num_samples);
+        uint64_t us = hal_now_us() - start_us, cycles = hal_host_cycles() - start_cycles;
+        if (!more && num_samples == 0) break;
+
+        uint32_t bin = (uint64_t)total_samples * 2 * NUM_BINS / DATA_BYTES;
+        if (bin >= NUM_BINS) bin = NUM_BINS - 1;
+        bin_us[bin] += us;
+        bin_cycles[bin] += cycles;
+        bin_blocks[bin]++;
+        total_samples += num_samples;
+        if (!more) break;
+    }
+    TEST_ASSERT_EQUAL_UINT32(DATA_BYTES / 2, total_samples);
+
+    printf("offset KB   virtual us/block   host cycles/block\n");
+    for (uint32_t i = 0; i < NUM_BINS; i++) {
+        TEST_ASSERT_GREATER_THAN_UINT32(0, bin_blocks[i]);
+        printf("%9u %18.1f %19.0f\n", i * DATA_BYTES / NUM_BINS / 1024,
+            (double)bin_us[i] / bin_blocks[i], (double)bin_cycles[i] / bin_blocks[i]);
+    }
+
+    // the first bin includes the header and the start of the stream, so compare the next one
+    double first = (double)bin_us[1] / bin_blocks[1];
+    double last = (double)bin_us[NUM_BINS - 1] / bin_blocks[NUM_BINS - 1];
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32((uint32_t)(first * 1.25), (uint32_t)last);
+
+    file.close();
+    remove(IMAGE_PATH);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_chunk_time_is_flat_across_offset);
+    return UNITY_END();
+}
@@ -0,0 +1,232 @@
+/**
+ * ImaAdpcmDecoder against a whole-block reference decoder, written after the IMA/DVI reference
+ * implementation, on encoded tones and on random bytes that drive the predictor and step index
+ * into their clamps. Also reports the decoder's host cycles per output sample.
+ */
+#include <Arduino.h>
+#include <math.h>
+#include <unity.h>
+
+#include "ImaAdpcm.h"
+#include "NativeHal.h"
+
+// ~4s of mono, 2s of stereo at 44.1kHz
+#define DATA_BYTES (96 * 1024)
+// benchmark passes, the fastest is reported
+#define PASSES 5
+
+static uint8_t data[DATA_BYTES];
+static int16_t output[2 * DATA_BYTES + 64];
+static int16_t expected[2 * DATA_BYTES + 64];
+
+static const int ref_steps[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73,
+    80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494,
+    544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499,
+    2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+    11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767,
+};
+static const int ref_index_adjust[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+typedef struct {
+    int valpred;
+    int index;
+} RefState;
+
+static int ref_decode_nibble(RefState *state, int delta) {
+    int step = ref_steps[state->index];
+
+    state->index += ref_index_adjust[delta & 7];
+    if (state->index < 0) state->index = 0;
+    if (state->index > 88) state->index = 88;
+
+    int vpdiff = step >> 3;
+    if (delta & 4) vpdiff += step;
+    if (delta & 2) vpdiff += step >> 1;
+    if (delta & 1) vpdiff += step >> 2;
+
+    state->valpred += (delta & 8) ? -vpdiff : vpdiff;
+    if (state->valpred > 32767) state->valpred = 32767;
+    if (state->valpred < -32768) state->valpred = -32768;
+    return state->valpred;
+}
+
+static int ref_encode_sample(RefState *state, int sample) {
+    int diff = sample - state->valpred;
+    int delta = 0;
+    if (diff < 0) {
+        delta = 8;
+        diff = -diff;
+    }
+
+    int step = ref_steps[state->index];
+    for (int mask = 4; mask > 0; mask >>= 1, step >>= 1) {
+        if (diff >= step) {
+            delta |= mask;
+            diff -= step;
+        }
+    }
+
+    ref_decode_nibble(state, delta);
+    return delta;
+}
+
+static int16_t ref_dac_code(int s) {
+    return (int16_t)((s >> (16 - DAC_BITS)) + (1 << (DAC_BITS - 1)));
+}
+
+/** Decode whole blocks into DAC codes, stereo mixed down to mono. Returns the # of samples */
+static uint32_t ref_decode(const uint8_t *src, uint32_t bytes, int channels, int block_align) {
+    uint32_t n = 0;
+    int per_block = (block_align / channels - 4) * 2 + 1;
+    static int pcm[2][4096];
+
+    for (uint32_t block = 0; block + block_align <= bytes; block += block_align) {
+        const uint8_t *b = src + block;
+        RefState state[2];
+        for (int c = 0; c < channels; c++) {
+            state[c].valpred = (int16_t)(b[4 * c] | b[4 * c + 1] << 8);
+            state[c].index = b[4 * c + 2] > 88 ? 88 : b[4 * c + 2];
+            pcm[c][0] = state[c].valpred;
+        }
+
+        // 4-byte groups of 8 samples, alternating between the channels
+        const uint8_t *p = b + 4 * channels;
+        for (int s = 1; s < per_block; s += 8) {
+            for (int c = 0; c < channels; c++) {
+                for (int k = 0; k < 8; k++) {
+                    int byte = p[k / 2];
+                    pcm[c][s + k] = ref_decode_nibble(&state[c], k & 1 ? byte >> 4 : byte & 0x0F);
+                }
+                p += 4;
+            }
+        }
+
+        for (int s = 0; s < per_block; s++) {
+            expected[n++] = ref_dac_code(channels == 2 ? (pcm[0][s] + pcm[1][s]) >> 1 : pcm[0][s]);
+        }
+    }
+    return n;
+}
+
+/** Encode a tone sweep with a little noise into whole blocks, both channels a different tone */
+static void make_encoded(int channels, int block_align) {
+    int per_block = (block_align / channels - 4) * 2 + 1;
+    uint32_t seed = 7, t = 0;
+    static int pcm[2][4096];
+
+    for (uint32_t block = 0; block + block_align <= DATA_BYTES; block += block_align) {
+        uint8_t *b = data + block;
+        for (int s = 0; s < per_block; s++, t++) {
+            for (int c = 0; c < channels; c++) {
+                seed = seed * 1103515245 + 12345;
+                double f = (200.0 + t * 0.05) * (c + 1);
+                pcm[c][s] = (int)(20000 * sin(2 * M_PI * f * t / 44100)) + (int)(seed >> 24) - 128;
+            }
+        }
+
+        RefState state[2];
+        for (int c = 0; c < channels; c++) {
+            state[c].valpred = pcm[c][0];
+            // carry on from the previous block's step size, like an encoder would
+            state[c].index = block == 0 ? 0 : data[block - block_align + 4 * c + 2];
+            b[4 * c] = (uint8_t)pcm[c][0];
+            b[4 * c + 1] = (uint8_t)(pcm[c][0] >> 8);
+            b[4 * c + 2] = (uint8_t)state[c].index;
+            b[4 * c + 3] = 0;
+        }
+
+        uint8_t *p = b + 4 * channels;
+        for (int s = 1; s < per_block; s += 8) {
+            for (int c = 0; c < channels; c++) {
+                for (int k = 0; k < 8; k += 2) {
+                    int lo = ref_encode_sample(&state[c], pcm[c][s + k]);
+                    int hi = ref_encode_sample(&state[c], pcm[c][s + k + 1]);
+                    p[k / 2] = (uint8_t)(lo | hi << 4);
+                }
+                p += 4;
+            }
+        }
+    }
+}
+
+static void make_random(int channels, int block_align) {
+    uint32_t seed = 12345;
+    for (uint32_t i = 0; i < DATA_BYTES; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (uint8_t)(seed >> 16);
+    }
+    // headers with step indexes past the table's end, which are clamped
+    for (uint32_t block = 0; block + block_align <= DATA_BYTES; block += block_align) {
+        for (int c = 0; c < channels; c++) data[block + 4 * c + 2] = (uint8_t)(data[block + 4 * c + 2] % 100);
+    }
+}
+
+/** Decode the whole buffer a few units at a time, the way sectors land */
+static uint32_t decode_streamed(ImaAdpcmDecoder *decoder, int channels, int block_align) {
+    static const uint32_t chunks[] = { 1, 3, 7, 16, 2, 31 };
+    decoder->configure(channels, block_align);
+    uint32_t units = DATA_BYTES / block_align * block_align / decoder->unit_size();
+    uint32_t n = 0, u = 0;
+
+    for (uint32_t i = 0; u < units; i++) {
+        uint32_t count = chunks[i % 6];
+        if (count > units - u) count = units - u;
+        n += decoder->decode(data + u * decoder->unit_size(), output + n, count);
+        u += count;
+    }
+    return n;
+}
+
+static void check(int channels, int block_align) {
+    ImaAdpcmDecoder decoder;
+    TEST_ASSERT_TRUE(ImaAdpcmDecoder::supported(channels, 4, block_align));
+
+    uint32_t n = ref_decode(data, DATA_BYTES, channels, block_align);
+    TEST_ASSERT_EQUAL_UINT32(n, decode_streamed(&decoder, channels, block_align));
+    TEST_ASSERT_EQUAL_INT16_ARRAY(expected, output, n);
+
+    uint64_t best = UINT64_MAX;
+    uint32_t units = DATA_BYTES / block_align * block_align / decoder.unit_size();
+    for (int pass = 0; pass < PASSES; pass++) {
+        decoder.configure(channels, block_align);
+        uint64_t start = hal_host_cycles();
+        decoder.decode(data, output, units);
+        uint64_t cycles = hal_host_cycles() - start;
+        if (cycles < best) best = cycles;
+    }
+    printf("%s, %4d byte blocks: %.2f host cycles/sample\n", channels == 2 ? "stereo" : "mono  ", block_align,
+        (double)best / n);
+}
+
+void setUp() {}
+void tearDown() {}
+
+static void test_mono_tone() {
+    make_encoded(1, 512);
+    check(1, 512);
+}
+
+static void test_stereo_tone() {
+    make_encoded(2, 1024);
+    check(2, 1024);
+}
+
+static void test_mono_random() {
+    make_random(1, 256);
+    check(1, 256);
+}
+
+static void test_stereo_random() {
+    make_random(2, 2048);
+    check(2, 2048);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_mono_tone);
+    RUN_TEST(test_stereo_tone);
+    RUN_TEST(test_mono_random);
+    RUN_TEST(test_stereo_random);
+    return UNITY_END();
+}
@@ -0,0 +1,214 @@
+/**
+ * mix_voices() and Mixer::poll() against a straight bias + sum(g * (s - bias)) reference, and the
+ * mix kernel's host cycles per sample for 1-4 voices. The overlay tests need a build with
+ * MIXER_VOICES above 1, e.g. PLATFORMIO_BUILD_FLAGS=-DMIXER_VOICES=4 pio test -e native.
+ */
+#include <Arduino.h>
+#include <unity.h>
+
+#include "Mixer.h"
+#include "NativeHal.h"
+
+#define BIAS ((int32_t)DacCode<DAC_BITS>::BIAS)
+#define MASK ((int32_t)DacCode<DAC_BITS>::MASK)
+// the lead's length, a little over 20 blocks
+#define STREAM_SAMPLES (20 * AUDIO_BLOCK_SAMPLES + 333)
+// blocks mixed per benchmark pass
+#define BENCH_BLOCKS 256
+#define PASSES 5
+
+static int16_t streams[4][STREAM_SAMPLES];
+static int16_t output[STREAM_SAMPLES];
+static int16_t expected[STREAM_SAMPLES];
+
+static uint32_t seed = 1;
+
+static uint32_t random_u32() {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+/** One mixed sample, rounded to nearest and saturated to the DAC range */
+static int16_t ref_mix(const int32_t *s, const uint16_t *gains, uint8_t count) {
+    int64_t v = (int64_t)BIAS << 15;
+    for (uint8_t i = 0; i < count; i++) v += (int64_t)gains[i] * (s[i] - BIAS);
+
+    int64_t r = (v + (1 << 14)) >> 15;
+    return (int16_t)(r < 0 ? 0 : (r > MASK ? MASK : r));
+}
+
+static void make_streams() {
+    for (uint8_t v = 0; v < 4; v++) {
+        for (uint32_t i = 0; i < STREAM_SAMPLES; i++) {
+            // mostly full scale, so loud mixes saturate at both ends
+            streams[v][i] = (int16_t)(random_u32() % 8 == 0 ? BIAS : random_u32() % (MASK + 1));
+        }
+    }
+}
+
+/** A source with WavePlayer's poll() contract, delivering chunk samples per call and PENDING every pending_every calls */
+typedef struct {
+    const int16_t *data;
+    uint32_t len;
+    uint32_t pos;
+    uint32_t chunk;
+    uint32_t pending_every;
+    uint32_t calls;
+} TestSource;
+
+static WavePlayerPoll source_poll(void *ctx, int16_t *samples, uint32_t max_samples, uint32_t *num_samples) {
+    TestSource *s = (TestSource *)ctx;
+    if (s->pending_every && ++s->calls % s->pending_every == 0) return WavePlayerPoll::PENDING;
+    if (s->pos == s->len) return WavePlayerPoll::DONE;
+
+    uint32_t n = max_samples - *num_samples;
+    if (n > s->chunk) n = s->chunk;
+    if (n > s->len - s->pos) n = s->len - s->pos;
+    memcpy(samples + *num_samples, s->data + s->pos, n * sizeof(int16_t));
+    s->pos += n;
+    *num_samples += n;
+
+    return *num_samples == max_samples || s->pos == s->len ? WavePlayerPoll::FILLED : WavePlayerPoll::PENDING;
+}
+
+/** Poll the mixer block by block until the lead ends, like the main loop. Returns the # of samples */
+static uint32_t run_mixer(Mixer *mixer) {
+    uint32_t total = 0;
+    for (;;) {
+        uint32_t num_samples = 0;
+        WavePlayerPoll result;
+        uint32_t polls = 0;
+        while ((result = mixer->poll(output + total, AUDIO_BLOCK_SAMPLES, &num_samples)) == WavePlayerPoll::PENDING) {
+            TEST_ASSERT_LESS_THAN_UINT32(10000, ++polls);
+        }
+        if (result != WavePlayerPoll::FILLED) return total;
+        total += num_samples;
+    }
+}
+
+/** What the voices should mix to: each overlay plays from the first sample until it runs out */
+static void make_expected(const uint32_t *lens, const uint16_t *gains, uint8_t voices) {
+    for (uint32_t i = 0; i < STREAM_SAMPLES; i++) {
+        int32_t s[4];
+        uint16_t g[4];
+        uint8_t count = 0;
+        for (uint8_t v = 0; v < voices; v++) {
+            if (i >= lens[v]) continue;
+            s[count] = streams[v][i];
+            g[count] = gains[v];
+            count++;
+        }
+        expected[i] = ref_mix(s, g, count);
+    }
+}
+
+void setUp() {}
+void tearDown() {}
+
+static void test_mix_voices() {
+    static int16_t out[AUDIO_BLOCK_SAMPLES];
+    for (uint8_t count = 1; count <= 4; count++) {
+        for (int round = 0; round < 50; round++) {
+            // from silent to just under 2x, so the sum of gains can reach ~8x
+            uint16_t gains[4];
+            for (uint8_t v = 0; v < 4; v++) gains[v] = round == 0 ? 0xFFFF : (uint16_t)random_u32();
+
+            uint32_t offset = random_u32() % (STREAM_SAMPLES - AUDIO_BLOCK_SAMPLES);
+            const int16_t *in[4];
+            for (uint8_t v = 0; v < 4; v++) in[v] = streams[v] + offset;
+            memcpy(out, in[0], sizeof(out));
+
+            mix_voices(out, in, gains, count, AUDIO_BLOCK_SAMPLES);
+
+            for (uint32_t i = 0; i < AUDIO_BLOCK_SAMPLES; i++) {
+                int32_t s[4];
+                for (uint8_t v = 0; v < count; v++) s[v] = in[v][i];
+                TEST_ASSERT_EQUAL_INT16(ref_mix(s, gains, count), out[i]);
+            }
+        }
+    }
+}
+
+static void test_lead_passes_through() {
+    Mixer mixer;
+    TestSource lead = { streams[0], STREAM_SAMPLES, 0, 300, 3, 0 };
+    mixer.play(0, source_poll, &lead);
+
+    TEST_ASSERT_EQUAL_UINT32(STREAM_SAMPLES, run_mixer(&mixer));
+    TEST_ASSERT_EQUAL_INT16_ARRAY(streams[0], output, STREAM_SAMPLES);
+}
+
+static void test_lead_gain() {
+    static const uint32_t lens[] = { STREAM_SAMPLES };
+    static const uint16_t gains[] = { 0x5000 };
+    Mixer mixer;
+    TestSource lead = { streams[0], STREAM_SAMPLES, 0, 1000, 0, 0 };
+    mixer.play(0, source_poll, &lead, gains[0]);
+
+    TEST_ASSERT_EQUAL_UINT32(STREAM_SAMPLES, run_mixer(&mixer));
+    make_expected(lens, gains, 1);
+    TEST_ASSERT_EQUAL_INT16_ARRAY(expected, output, STREAM_SAMPLES);
+}
+
+#if MIXER_VOICES > 1
+static void test_overlays() {
+    // overlays ending partway through a block, on a block boundary, and after the lead
+    const uint32_t lens[] = { STREAM_SAMPLES, 3 * AUDIO_BLOCK_SAMPLES + 17, 8 * AUDIO_BLOCK_SAMPLES, STREAM_SAMPLES + 5000 };
+    const uint16_t gains[] = { MIXER_UNITY_GAIN, 0x4000, 0xC000, 0x2000 };
+    uint8_t voices = MIXER_VOICES < 4 ? MIXER_VOICES : 4;
+
+    Mixer mixer;
+    TestSource sources[4] = {
+        { streams[0], lens[0], 0, 256, 5, 0 },
+        { streams[1], lens[1], 0, 100, 2, 0 },
+        { streams[2], lens[2], 0, 4096, 0, 0 },
+        { streams[3], lens[3], 0, 77, 7, 0 },
+    };
+    for (uint8_t v = 0; v < voices; v++) mixer.play(v, source_poll, &sources[v], gains[v]);
+
+    TEST_ASSERT_EQUAL_UINT32(STREAM_SAMPLES, run_mixer(&mixer));
+    make_expected(lens, gains, voices);
+    TEST_ASSERT_EQUAL_INT16_ARRAY(expected, output, STREAM_SAMPLES);
+
+    // overlays that ended were dropped, the one still going plays on
+    if (voices > 1) TEST_ASSERT_FALSE(mixer.is_playing(1));
+    if (voices > 2) TEST_ASSERT_FALSE(mixer.is_playing(2));
+    if (voices > 3) TEST_ASSERT_TRUE(mixer.is_playing(3));
+}
+#endif
+
+static void test_benchmark() {
+    static int16_t out[AUDIO_BLOCK_SAMPLES];
+    const uint16_t gains[4] = { 0x6000, 0x3000, 0x2000, 0x1000 };
+    const int16_t *in[4];
+
+    for (uint8_t count = 1; count <= 4; count++) {
+        uint64_t best = UINT64_MAX;
+        for (int pass = 0; pass < PASSES; pass++) {
+            uint64_t start = hal_host_cycles();
+            for (uint32_t b = 0; b < BENCH_BLOCKS; b++) {
+                uint32_t offset = b % 20 * AUDIO_BLOCK_SAMPLES;
+                for (uint8_t v = 0; v < 4; v++) in[v] = streams[v] + offset;
+                mix_voices(out, in, gains, count, AUDIO_BLOCK_SAMPLES);
+            }
+            uint64_t cycles = hal_host_cycles() - start;
+            if (cycles < best) best = cycles;
+        }
+        printf("%u voice%s: %.2f host cycles/sample\n", count, count > 1 ? "s" : " ",
+            (double)best / (BENCH_BLOCKS * AUDIO_BLOCK_SAMPLES));
+    }
+}
+
+int main() {
+    make_streams();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_mix_voices);
+    RUN_TEST(test_lead_passes_through);
+    RUN_TEST(test_lead_gain);
+#if MIXER_VOICES > 1
+    RUN_TEST(test_overlays);
+#endif
+    RUN_TEST(test_benchmark);
+    return UNITY_END();
+}
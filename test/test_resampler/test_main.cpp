@@ -0,0 +1,106 @@
+/**
+ * Resampler output against a straight per-sample interpolation of the whole stream, and its cost
+ * in host cycles per output sample for the rates WAVs usually come in.
+ */
+#include <Arduino.h>
+#include <unity.h>
+
+#include "NativeHal.h"
+#include "Resampler.h"
+
+// a second of input at the highest rate tested
+#define INPUT_SAMPLES 48000
+// input fed per process() call, as a converted sector or so would be
+#define BATCH_SAMPLES 256
+// output block, as an AudioPlayer queue block
+#define BLOCK_SAMPLES 1024
+// benchmark passes, the fastest is reported
+#define PASSES 5
+
+static int16_t input[INPUT_SAMPLES];
+static int16_t output[INPUT_SAMPLES * DAC_SAMPLE_RATE / 4000 + BLOCK_SAMPLES];
+static int16_t expected[INPUT_SAMPLES * DAC_SAMPLE_RATE / 4000 + BLOCK_SAMPLES];
+
+static void make_input() {
+    uint32_t seed = 1;
+    for (uint32_t i = 0; i < INPUT_SAMPLES; i++) {
+        seed = seed * 1103515245 + 12345;
+        // a ramp with noise, to cover the full range and large steps between samples
+        input[i] = (int16_t)((int32_t)(i * 37) % 65536 - 32768 + (int32_t)(seed >> 20) - 2048);
+    }
+}
+
+/** The stream as one piece: output k sits at Q16 index 1 + k * step, where index 0 is a silent sample before the input */
+static uint32_t reference(uint32_t in_rate, uint32_t in_count) {
+    uint32_t step = (uint32_t)((((uint64_t)in_rate << 16) + DAC_SAMPLE_RATE / 2) / DAC_SAMPLE_RATE);
+    uint32_t n = 0;
+    for (uint64_t pos = 1ull << 16; pos < ((uint64_t)in_count << 16); pos += step) {
+        uint32_t i = pos >> 16;
+        int32_t a = i == 0 ? 0 : input[i - 1];
+        int32_t b = input[i];
+        int32_t frac = (pos & 0xFFFF) >> 1;
+        expected[n] = (int16_t)(a + (((b - a) * frac) >> 15));
+
+        // the Q15 fraction and the truncation each lose under one step against the exact interpolation
+        double exact = a + (b - a) * (double)(pos & 0xFFFF) / 65536;
+        TEST_ASSERT_TRUE(expected[n] > exact - 2 && expected[n] < exact + 2);
+        n++;
+    }
+    return n;
+}
+
+/** Feed the input in batches into blocks, like the player does. Returns the # of samples out */
+static uint32_t run(Resampler *resampler, uint32_t in_count) {
+    uint32_t in = 0, out = 0;
+    while (in < in_count) {
+        uint32_t batch = in_count - in < BATCH_SAMPLES ? in_count - in : BATCH_SAMPLES;
+        uint32_t block_end = (out / BLOCK_SAMPLES + 1) * BLOCK_SAMPLES;
+        uint32_t produced;
+        in += resampler->process(input + in, batch, output + out, block_end - out, &produced);
+        out += produced;
+    }
+    return out;
+}
+
+static void check_rate(uint32_t in_rate) {
+    Resampler resampler;
+    uint32_t in_count = INPUT_SAMPLES * (uint64_t)in_rate / 48000;
+    uint64_t best = UINT64_MAX;
+    uint32_t produced = 0;
+
+    for (int pass = 0; pass < PASSES; pass++) {
+        TEST_ASSERT_TRUE(resampler.configure(in_rate, DAC_SAMPLE_RATE));
+        uint64_t start = hal_host_cycles();
+        produced = run(&resampler, in_count);
+        uint64_t cycles = hal_host_cycles() - start;
+        if (cycles < best) best = cycles;
+    }
+
+    uint32_t n = reference(in_rate, in_count);
+    TEST_ASSERT_EQUAL_UINT32(n, produced);
+    TEST_ASSERT_EQUAL_INT16_ARRAY(expected, output, n);
+
+    printf("%6u Hz -> %u Hz: %7u samples out, %.2f host cycles/sample\n", in_rate, DAC_SAMPLE_RATE, produced,
+        (double)best / produced);
+}
+
+void setUp() {}
+void tearDown() {}
+
+static void test_8000() { check_rate(8000); }
+static void test_11025() { check_rate(11025); }
+static void test_16000() { check_rate(16000); }
+static void test_22050() { check_rate(22050); }
+static void test_48000() { check_rate(48000); }
+
+int main() {
+    make_input();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_8000);
+    RUN_TEST(test_11025);
+    RUN_TEST(test_16000);
+    RUN_TEST(test_22050);
+    RUN_TEST(test_48000);
+    return UNITY_END();
+}
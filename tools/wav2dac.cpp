@@ -0,0 +1,154 @@
+/**
+ * Host-side encoder from WAV to the DAC-ready container in src/DacFile.h.
+ *
+ * Samples go through the same conversion kernels and resampler the firmware uses, so a .DAC file
+ * plays back exactly like the WAV it was made from, without any work on the board. Build it with
+ * the same DAC_BITS as the firmware:
+ *
+ *     g++ -O2 -Isrc tools/wav2dac.cpp src/Resampler.cpp -o wav2dac
+ *     ./wav2dac [--loop START END] 13.WAV 13.DAC
+ *
+ * Loop points are in samples of the input file. Without --loop, the loop in a `smpl` chunk is
+ * used if there is one, otherwise the whole file loops.
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "DacFile.h"
+#include "Resampler.h"
+#include "SampleConverter.h"
+
+static uint32_t le16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static uint32_t le32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+static void put16(uint8_t *p, uint32_t v) { p[0] = v; p[1] = v >> 8; }
+static void put32(uint8_t *p, uint32_t v) { put16(p, v); put16(p + 2, v >> 16); }
+
+static int fail(const char *message, const char *path) {
+    fprintf(stderr, "wav2dac: %s: %s\n", path, message);
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    bool has_loop = false;
+    uint32_t loop_start = 0, loop_end = 0;
+
+    int arg = 1;
+    if (argc == 6 && strcmp(argv[1], "--loop") == 0) {
+        has_loop = true;
+        loop_start = strtoul(argv[2], NULL, 0);
+        loop_end = strtoul(argv[3], NULL, 0);
+        arg = 4;
+    }
+
+    if (argc - arg != 2) {
+        fprintf(stderr, "usage: wav2dac [--loop START END] in.wav out.dac\n");
+        return 2;
+    }
+    const char *in_path = argv[arg], *out_path = argv[arg + 1];
+
+    FILE *in = fopen(in_path, "rb");
+    if (!in) return fail("can't open", in_path);
+    std::vector<uint8_t> wav;
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) wav.insert(wav.end(), chunk, chunk + n);
+    fclose(in);
+
+    if (wav.size() < 12 || memcmp(&wav[0], "RIFF", 4) != 0 || memcmp(&wav[8], "WAVE", 4) != 0) {
+        return fail("not a WAV file", in_path);
+    }
+
+    // walk the chunks for the format, the samples and an optional loop
+    const uint8_t *fmt = NULL, *data = NULL;
+    uint32_t data_size = 0;
+    for (size_t pos = 12; pos + 8 <= wav.size();) {
+        const uint8_t *id = &wav[pos];
+        uint32_t size = le32(id + 4);
+        const uint8_t *body = id + 8;
+        uint32_t avail = (uint32_t)(wav.size() - pos - 8);
+        if (size > avail) size = avail;
+
+        if (memcmp(id, "fmt ", 4) == 0 && size >= 16) {
+            fmt = body;
+        } else if (memcmp(id, "data", 4) == 0) {
+            data = body;
+            data_size = size;
+        } else if (memcmp(id, "smpl", 4) == 0 && size >= 60 && !has_loop && le32(body + 28) > 0) {
+            has_loop = true;
+            loop_start = le32(body + 36 + 8);
+            // smpl loop ends are inclusive
+            loop_end = le32(body + 36 + 12) + 1;
+        }
+
+        pos += 8 + size + (size & 1);
+    }
+    if (!fmt || !data) return fail("missing fmt or data chunk", in_path);
+
+    uint16_t audio_format = le16(fmt);
+    uint16_t num_channels = le16(fmt + 2);
+    uint32_t sample_rate = le32(fmt + 4);
+    uint16_t block_align = le16(fmt + 12);
+    uint16_t bits_per_sample = le16(fmt + 14);
+
+    SampleConverterFn converter = select_sample_converter(audio_format, bits_per_sample, num_channels);
+    if (!converter || block_align == 0) return fail("unsupported sample format", in_path);
+
+    Resampler resampler;
+    if (!resampler.configure(sample_rate, DAC_SAMPLE_RATE)) return fail("unsupported sample rate", in_path);
+
+    // the kernels read whole words, so convert from an aligned copy
+    uint32_t frames = data_size / block_align;
+    std::vector<uint32_t> aligned((frames * block_align + 3) / 4);
+    memcpy(aligned.data(), data, frames * block_align);
+    std::vector<int16_t> converted(frames);
+    converter((const uint8_t *)aligned.data(), converted.data(), frames);
+
+    std::vector<int16_t> samples;
+    if (resampler.passthrough()) {
+        samples = converted;
+    } else {
+        int16_t out[1024];
+        for (uint32_t i = 0; i < frames;) {
+            uint32_t produced;
+            i += resampler.process(&converted[i], frames - i, out, 1024, &produced);
+            samples.insert(samples.end(), out, out + produced);
+        }
+    }
+    uint32_t num_samples = (uint32_t)samples.size();
+
+    if (has_loop) {
+        loop_start = (uint32_t)((uint64_t)loop_start * DAC_SAMPLE_RATE / sample_rate);
+        loop_end = (uint32_t)((uint64_t)loop_end * DAC_SAMPLE_RATE / sample_rate);
+        if (loop_end > num_samples || loop_start >= loop_end) return fail("loop points out of range", in_path);
+    } else {
+        loop_start = 0;
+        loop_end = num_samples;
+    }
+
+    uint32_t data_bytes = num_samples * sizeof(int16_t);
+    std::vector<uint8_t> out(DAC_FILE_DATA_OFFSET + ((data_bytes + 511) & ~511u), 0);
+
+    uint8_t *header = out.data();
+    memcpy(header + offsetof(DacFileHeader, magic), DAC_FILE_MAGIC, 4);
+    put16(header + offsetof(DacFileHeader, version), DAC_FILE_VERSION);
+    header[offsetof(DacFileHeader, dac_bits)] = DAC_BITS;
+    put32(header + offsetof(DacFileHeader, sample_rate), DAC_SAMPLE_RATE);
+    put32(header + offsetof(DacFileHeader, num_samples), num_samples);
+    put32(header + offsetof(DacFileHeader, loop_start), loop_start);
+    put32(header + offsetof(DacFileHeader, loop_end), loop_end);
+
+    for (uint32_t i = 0; i < num_samples; ++i) put16(&out[DAC_FILE_DATA_OFFSET + i * 2], (uint16_t)samples[i]);
+
+    FILE *f = fopen(out_path, "wb");
+    if (!f || fwrite(out.data(), 1, out.size(), f) != out.size() || fclose(f) != 0) {
+        return fail("can't write", out_path);
+    }
+
+    printf("%s: %u samples at %u Hz, %u bits, loop %u-%u\n", out_path, num_samples, DAC_SAMPLE_RATE,
+        DAC_BITS, loop_start, loop_end);
+    return 0;
+}